@@ -1,12 +1,11 @@
 #include <config.h>
 #include <stdio.h>
 #include <sys/types.h>
-#include <pwd.h>
-#include <grp.h>
 #include "system.h"
 #include "chown-core.h"
 #include "error.h"
 #include "ignore-value.h"
+#include "lookup-cache.h"
 #include "root-dev-ino.h"
 #include "xfts.h"
 
@@ -46,15 +45,15 @@ chopt_free (struct Chown_option *chopt)
 extern char *gid_to_name (gid_t gid)
 {
   char buf[INT_BUFSIZE_BOUND (intmax_t)];
-  struct group *grp = getgrgid (gid);
-  return xstrdup (grp ? grp->gr_name  : TYPE_SIGNED (gid_t) ? imaxtostr (gid, buf) : umaxtostr (gid, buf));
+  char const *name = lookup_group_name (gid);
+  return xstrdup (name ? name : TYPE_SIGNED (gid_t) ? imaxtostr (gid, buf) : umaxtostr (gid, buf));
 }
 extern char *
 uid_to_name (uid_t uid)
 {
   char buf[INT_BUFSIZE_BOUND (intmax_t)];
-  struct passwd *pwd = getpwuid (uid);
-  return xstrdup (pwd ? pwd->pw_name : TYPE_SIGNED (uid_t) ? imaxtostr (uid, buf) : umaxtostr (uid, buf));
+  char const *name = lookup_user_name (uid);
+  return xstrdup (name ? name : TYPE_SIGNED (uid_t) ? imaxtostr (uid, buf) : umaxtostr (uid, buf));
 }
 static char *user_group_str (char const *user, char const *group)
 {
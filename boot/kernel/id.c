@@ -11,6 +11,7 @@
 #include "mgetgroups.h"
 #include "quote.h"
 #include "group-list.h"
+#include "lookup-cache.h"
 #include "smack.h"
 #include "userspec.h"
 static bool just_context = 0;
@@ -266,12 +267,12 @@ uidtostr_ptr (uid_t const *uid)
 static void
 print_user (uid_t uid)
 {
-  struct passwd *pwd = NULL;
+  char const *name = NULL;
 
   if (use_name)
     {
-      pwd = getpwuid (uid);
-      if (pwd == NULL)
+      name = lookup_user_name (uid);
+      if (name == NULL)
         {
           error (0, 0, _("cannot find name for user ID %s"),
                  uidtostr (uid));
@@ -279,8 +280,7 @@ print_user (uid_t uid)
         }
     }
 
-  char *s = pwd ? pwd->pw_name : uidtostr (uid);
-  fputs (s, stdout);
+  fputs (name ? name : uidtostr (uid), stdout);
 }
 
 /* Print all of the info about the user's user and group IDs. */
@@ -289,7 +289,7 @@ static void
 print_full_info (char const *username)
 {
   struct passwd *pwd;
-  struct group *grp;
+  char const *name;
 
   printf (_("uid=%s"), uidtostr (ruid));
   pwd = getpwuid (ruid);
@@ -297,9 +297,9 @@ print_full_info (char const *username)
     printf ("(%s)", pwd->pw_name);
 
   printf (_(" gid=%s"), gidtostr (rgid));
-  grp = getgrgid (rgid);
-  if (grp)
-    printf ("(%s)", grp->gr_name);
+  name = lookup_group_name (rgid);
+  if (name)
+    printf ("(%s)", name);
 
   if (euid != ruid)
     {
@@ -312,9 +312,9 @@ print_full_info (char const *username)
   if (egid != rgid)
     {
       printf (_(" egid=%s"), gidtostr (egid));
-      grp = getgrgid (egid);
-      if (grp)
-        printf ("(%s)", grp->gr_name);
+      name = lookup_group_name (egid);
+      if (name)
+        printf ("(%s)", name);
     }
 
   {
@@ -345,9 +345,9 @@ print_full_info (char const *username)
         if (i > 0)
           putchar (',');
         fputs (gidtostr (groups[i]), stdout);
-        grp = getgrgid (groups[i]);
-        if (grp)
-          printf ("(%s)", grp->gr_name);
+        name = lookup_group_name (groups[i]);
+        if (name)
+          printf ("(%s)", name);
       }
     free (groups);
   }
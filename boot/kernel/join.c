@@ -8,6 +8,7 @@
 #include "fadvise.h"
 #include "hard-locale.h"
 #include "linebuffer.h"
+#include "lineindex.h"
 #include "memcasecmp.h"
 #include "quote.h"
 #include "stdio--.h"
@@ -65,6 +66,9 @@ static uintmax_t line_no[2] = {0, 0};
 static char *g_names[2];
 static struct line *spareline[2] = {NULL, NULL};
 
+/* The readers of the lines of each file.  */
+static struct line_reader readers[2];
+
 /* True if the LC_COLLATE locale is hard.  */
 static bool hard_LC_COLLATE;
 
@@ -421,10 +425,11 @@ get_line (FILE *fp, struct line **linep, int which)
   else
     line = init_linep (linep);
 
-  if (! readlinebuffer_delim (&line->buf, fp, eolchar))
+  if (! line_reader_read (&readers[which - 1], &line->buf))
     {
-      if (ferror (fp))
-        die (EXIT_FAILURE, errno, _("read error"));
+      int err = line_reader_error (&readers[which - 1]);
+      if (err)
+        die (EXIT_FAILURE, err, _("read error"));
       freeline (line);
       return false;
     }
@@ -623,6 +628,8 @@ join (FILE *fp1, FILE *fp2)
 
   fadvise (fp1, FADVISE_SEQUENTIAL);
   fadvise (fp2, FADVISE_SEQUENTIAL);
+  line_reader_init (&readers[0], fp1, eolchar);
+  line_reader_init (&readers[1], fp2, eolchar);
 
   /* Read the first line of each file.  */
   initseq (&seq1);
@@ -769,6 +776,8 @@ join (FILE *fp1, FILE *fp2)
 
   delseq (&seq1);
   delseq (&seq2);
+  line_reader_free (&readers[0]);
+  line_reader_free (&readers[1]);
 }
 
 /* Add a field spec for field FIELD of file FILE to 'outlist'.  */
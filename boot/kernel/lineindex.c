@@ -0,0 +1,241 @@
+#include <config.h>
+#include <sys/types.h>
+#include "system.h"
+#include "lineindex.h"
+#include "safe-read.h"
+#include "xalloc.h"
+
+/* Use SSE2 and AVX2 where the compiler can target them in single
+   functions, and the processor turns out to support them.  */
+#if ((defined __x86_64__ || defined __i386__) \
+     && (defined __clang__ || 4 < __GNUC__ + (9 <= __GNUC_MINOR__)))
+# define USE_X86_LINE_INDEX 1
+# include <immintrin.h>
+#else
+# define USE_X86_LINE_INDEX 0
+#endif
+
+/* The initial size of a line_reader's buffer.  */
+enum { LINE_READER_SIZE = 64 * 1024 };
+
+/* Store into ENDS the offsets just past the first NENDS_MAX or fewer
+   bytes equal to DELIM of BUF, which has SIZE bytes, starting the scan
+   at offset I, and return their number.  N of them have been stored
+   already.  */
+
+static size_t
+line_index_scalar (char const *buf, size_t size, char delim,
+                   size_t *ends, size_t nends_max, size_t i, size_t n)
+{
+  char const *lim = buf + size;
+  char const *p = buf + i;
+
+  while (n < nends_max && (p = memchr (p, delim, lim - p)))
+    ends[n++] = ++p - buf;
+
+  return n;
+}
+
+#if USE_X86_LINE_INDEX
+
+/* Like line_index_scalar with I and N zero, but compare 16 bytes at a
+   time with SSE2 instructions.  */
+
+static size_t __attribute__ ((__target__ ("sse2")))
+line_index_sse2 (char const *buf, size_t size, char delim,
+                 size_t *ends, size_t nends_max)
+{
+  __m128i d = _mm_set1_epi8 (delim);
+  size_t n = 0;
+  size_t i;
+
+  for (i = 0; i + 16 <= size; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((__m128i const *) (buf + i));
+      unsigned int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, d));
+      for (; mask; mask &= mask - 1)
+        {
+          if (n == nends_max)
+            return n;
+          ends[n++] = i + __builtin_ctz (mask) + 1;
+        }
+    }
+
+  return line_index_scalar (buf, size, delim, ends, nends_max, i, n);
+}
+
+/* Likewise, but compare 32 bytes at a time with AVX2 instructions.  */
+
+static size_t __attribute__ ((__target__ ("avx2")))
+line_index_avx2 (char const *buf, size_t size, char delim,
+                 size_t *ends, size_t nends_max)
+{
+  __m256i d = _mm256_set1_epi8 (delim);
+  size_t n = 0;
+  size_t i;
+
+  for (i = 0; i + 32 <= size; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((__m256i const *) (buf + i));
+      unsigned int mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, d));
+      for (; mask; mask &= mask - 1)
+        {
+          if (n == nends_max)
+            return n;
+          ends[n++] = i + __builtin_ctz (mask) + 1;
+        }
+    }
+
+  return line_index_scalar (buf, size, delim, ends, nends_max, i, n);
+}
+
+#endif
+
+/* Store into ENDS the offsets just past the first NENDS_MAX or fewer
+   bytes equal to DELIM of BUF, which has SIZE bytes; that is, the
+   offsets of the starts of the lines after the first.  Return the
+   number of offsets stored, which is less than NENDS_MAX only if BUF
+   has no more delimiters.  Scan many bytes at once with the widest
+   vector instructions that the processor supports.  */
+
+size_t
+line_index (char const *buf, size_t size, char delim,
+            size_t *ends, size_t nends_max)
+{
+#if USE_X86_LINE_INDEX
+  if (__builtin_cpu_supports ("avx2"))
+    return line_index_avx2 (buf, size, delim, ends, nends_max);
+  if (__builtin_cpu_supports ("sse2"))
+    return line_index_sse2 (buf, size, delim, ends, nends_max);
+#endif
+  return line_index_scalar (buf, size, delim, ends, nends_max, 0, 0);
+}
+
+/* Initialize READER to read the lines of FP, which end in DELIM.
+   Nothing must have been read from FP yet, as READER reads its file
+   descriptor directly, so that lines are available as soon as they
+   are written to a pipe.  */
+
+void
+line_reader_init (struct line_reader *reader, FILE *fp, char delim)
+{
+  reader->fp = fp;
+  reader->delim = delim;
+  reader->eof = false;
+  reader->err = 0;
+  reader->buf = NULL;
+  reader->alloc = reader->len = reader->pos = reader->scanned = 0;
+  reader->nends = reader->next = 0;
+}
+
+/* Read the next line of READER into LINE, with its delimiter, which
+   is supplied if the last line lacks one.  Return LINE, or a null
+   pointer at end of file or on a read error, as readlinebuffer_delim
+   does; line_reader_error then tells which.  */
+
+struct linebuffer *
+line_reader_read (struct line_reader *reader, struct linebuffer *line)
+{
+  while (reader->next == reader->nends)
+    {
+      if (reader->scanned < reader->len)
+        {
+          /* Find the ends of the next lines in the bytes not yet
+             scanned.  */
+          size_t base = reader->scanned;
+          size_t n = line_index (reader->buf + base, reader->len - base,
+                                 reader->delim, reader->ends,
+                                 LINE_INDEX_BATCH);
+          for (size_t i = 0; i < n; i++)
+            reader->ends[i] += base;
+          reader->nends = n;
+          reader->next = 0;
+          reader->scanned = (n == LINE_INDEX_BATCH
+                             ? reader->ends[n - 1] : reader->len);
+          continue;
+        }
+
+      if (reader->eof)
+        {
+          if (reader->pos == reader->len)
+            return NULL;
+          /* Supply the missing delimiter of the last line, for which
+             the read that found end of file left room.  */
+          reader->buf[reader->len++] = reader->delim;
+          continue;
+        }
+
+      /* Move the start of the next line to the start of the buffer,
+         growing the buffer if the line fills it, and read more.  */
+      if (reader->pos)
+        {
+          reader->len -= reader->pos;
+          reader->scanned -= reader->pos;
+          memmove (reader->buf, reader->buf + reader->pos, reader->len);
+          reader->pos = 0;
+        }
+      if (! reader->alloc)
+        {
+          reader->alloc = LINE_READER_SIZE;
+          reader->buf = xmalloc (reader->alloc);
+        }
+      else if (reader->len == reader->alloc)
+        reader->buf = x2realloc (reader->buf, &reader->alloc);
+
+      size_t nread = safe_read (fileno (reader->fp),
+                                reader->buf + reader->len,
+                                reader->alloc - reader->len);
+      if (nread == SAFE_READ_ERROR)
+        {
+          reader->err = errno;
+          reader->eof = true;
+          return NULL;
+        }
+      if (nread == 0)
+        {
+          reader->eof = true;
+          if (reader->len == reader->alloc)
+            reader->buf = x2realloc (reader->buf, &reader->alloc);
+        }
+      reader->len += nread;
+    }
+
+  size_t end = reader->ends[reader->next++];
+  size_t length = end - reader->pos;
+  if (line->size < length)
+    {
+      free (line->buffer);
+      line->size = length;
+      line->buffer = xcharalloc (length);
+    }
+  memcpy (line->buffer, reader->buf + reader->pos, length);
+  line->length = length;
+  reader->pos = end;
+  return line;
+}
+
+/* Return true if READER has no more lines to read.  */
+
+bool
+line_reader_eof (struct line_reader const *reader)
+{
+  return (reader->eof && reader->pos == reader->len
+          && reader->next == reader->nends);
+}
+
+/* Return the errno value of the read error that ended READER's input,
+   or 0 if there was none.  */
+
+int
+line_reader_error (struct line_reader const *reader)
+{
+  return reader->err;
+}
+
+/* Free the storage of READER, but do not close its stream.  */
+
+void
+line_reader_free (struct line_reader *reader)
+{
+  free (reader->buf);
+}
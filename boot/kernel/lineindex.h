@@ -0,0 +1,49 @@
+#ifndef LINEINDEX_H
+# define LINEINDEX_H
+
+# include <stdio.h>
+# include "linebuffer.h"
+
+/* A good number of line ends for line_index to find at a time.  */
+enum { LINE_INDEX_BATCH = 1024 };
+
+/* A reader of the lines of a stream that fills a buffer of the
+   stream's bytes and finds the ends of many lines at once.  */
+
+struct line_reader
+{
+  FILE *fp;
+  char delim;
+  bool eof;
+
+  /* The errno value of a read error, or 0.  */
+  int err;
+
+  /* The buffer of ALLOC bytes, of which the first LEN are from FP,
+     and those from POS on are yet to be read as lines.  The bytes
+     before SCANNED have been searched for line ends.  */
+  char *buf;
+  size_t alloc;
+  size_t len;
+  size_t pos;
+  size_t scanned;
+
+  /* The offsets in BUF just past the ends of the next lines: the
+     NENDS - NEXT lines from the line that starts at POS.  */
+  size_t ends[LINE_INDEX_BATCH];
+  size_t nends;
+  size_t next;
+};
+
+extern size_t line_index (char const *buf, size_t size, char delim,
+                          size_t *ends, size_t nends_max);
+
+extern void line_reader_init (struct line_reader *reader, FILE *fp,
+                              char delim);
+extern struct linebuffer *line_reader_read (struct line_reader *reader,
+                                            struct linebuffer *line);
+extern bool line_reader_eof (struct line_reader const *reader);
+extern int line_reader_error (struct line_reader const *reader);
+extern void line_reader_free (struct line_reader *reader);
+
+#endif
@@ -0,0 +1,188 @@
+#include <config.h>
+#include <sys/types.h>
+#include <pwd.h>
+#include <grp.h>
+#include "system.h"
+#include "lookup-cache.h"
+#include "xalloc.h"
+
+/* Each cache is an open-addressing hash table with linear probing,
+   whose size is a power of two and which doubles when it is three
+   quarters full.  Entries are never removed, so that a name looked up
+   once stays valid until the program exits.  These caches are not
+   safe to use from more than one thread.  */
+
+/* The initial number of slots of a table.  */
+enum { LOOKUP_TABLE_SIZE = 64 };
+
+struct lookup_slot
+{
+  uintmax_t key;
+  bool used;
+
+  /* For the name caches, the name of the id, or NULL if it has none;
+     for the probe cache, the set of probes that are unsupported.  */
+  char *name;
+  unsigned int unsupported;
+};
+
+struct lookup_table
+{
+  struct lookup_slot *slots;
+  size_t size;
+  size_t used;
+  struct lookup_cache_stats stats;
+};
+
+static struct lookup_table tables[LOOKUP_CACHES];
+
+/* Return the index of the first slot to probe for KEY in a table of
+   SIZE slots.  */
+
+static size_t
+slot_index (uintmax_t key, size_t size)
+{
+  uint_least64_t h = key * 0x9e3779b97f4a7c15u;
+  return (h ^ (h >> 32)) & (size - 1);
+}
+
+/* Return the slot of TABLE for KEY, adding one if KEY is not in TABLE
+   yet, and set *FOUND to whether it was.  */
+
+static struct lookup_slot *
+find_slot (struct lookup_table *table, uintmax_t key, bool *found)
+{
+  if (table->size * 3 <= (table->used + 1) * 4)
+    {
+      size_t size = table->size ? table->size * 2 : LOOKUP_TABLE_SIZE;
+      struct lookup_slot *slots = xcalloc (size, sizeof *slots);
+      for (size_t i = 0; i < table->size; i++)
+        if (table->slots[i].used)
+          {
+            size_t j = slot_index (table->slots[i].key, size);
+            while (slots[j].used)
+              j = (j + 1) & (size - 1);
+            slots[j] = table->slots[i];
+          }
+      free (table->slots);
+      table->slots = slots;
+      table->size = size;
+    }
+
+  size_t i = slot_index (key, table->size);
+  while (table->slots[i].used && table->slots[i].key != key)
+    i = (i + 1) & (table->size - 1);
+
+  struct lookup_slot *slot = &table->slots[i];
+  *found = slot->used;
+  if (! slot->used)
+    {
+      table->used++;
+      table->stats.entries++;
+      slot->used = true;
+      slot->key = key;
+    }
+  return slot;
+}
+
+/* Look up KEY in TABLE as find_slot does, counting a hit or a miss.  */
+
+static struct lookup_slot *
+lookup (struct lookup_table *table, uintmax_t key, bool *found)
+{
+  struct lookup_slot *slot = find_slot (table, key, found);
+  if (*found)
+    table->stats.hits++;
+  else
+    table->stats.misses++;
+  return slot;
+}
+
+/* Return the slot of TABLE for KEY, or NULL if KEY is not in TABLE.  */
+
+static struct lookup_slot const *
+find_existing_slot (struct lookup_table const *table, uintmax_t key)
+{
+  if (! table->used)
+    return NULL;
+
+  size_t i = slot_index (key, table->size);
+  while (table->slots[i].used)
+    {
+      if (table->slots[i].key == key)
+        return &table->slots[i];
+      i = (i + 1) & (table->size - 1);
+    }
+  return NULL;
+}
+
+/* Return the name of the user with id UID, or NULL if it has none.
+   The name remains valid until the program exits.  */
+
+char const *
+lookup_user_name (uid_t uid)
+{
+  bool found;
+  struct lookup_slot *slot = lookup (&tables[LOOKUP_USERS], uid, &found);
+  if (! found)
+    {
+      struct passwd *pwd = getpwuid (uid);
+      if (pwd)
+        slot->name = xstrdup (pwd->pw_name);
+    }
+  return slot->name;
+}
+
+/* Likewise, for the group with id GID.  */
+
+char const *
+lookup_group_name (gid_t gid)
+{
+  bool found;
+  struct lookup_slot *slot = lookup (&tables[LOOKUP_GROUPS], gid, &found);
+  if (! found)
+    {
+      struct group *grp = getgrgid (gid);
+      if (grp)
+        slot->name = xstrdup (grp->gr_name);
+    }
+  return slot->name;
+}
+
+/* Return true if PROBE has been found to be unsupported on the file
+   system with device number DEV, counting a hit if so and a miss
+   otherwise.  A miss adds no entry; fs_probe_set_unsupported does,
+   once PROBE is found to be unsupported.  */
+
+bool
+fs_probe_unsupported (dev_t dev, enum fs_probe probe)
+{
+  struct lookup_table *table = &tables[LOOKUP_FS_PROBES];
+  struct lookup_slot const *slot = find_existing_slot (table, dev);
+  bool unsupported = slot && (slot->unsupported >> probe) & 1;
+  if (unsupported)
+    table->stats.hits++;
+  else
+    table->stats.misses++;
+  return unsupported;
+}
+
+/* Note that PROBE is unsupported on the file system with device
+   number DEV.  */
+
+void
+fs_probe_set_unsupported (dev_t dev, enum fs_probe probe)
+{
+  bool found;
+  find_slot (&tables[LOOKUP_FS_PROBES], dev, &found)->unsupported
+    |= 1u << probe;
+}
+
+/* Store into *STATS the numbers of lookups of CACHE that were and were
+   not answered from it, and the number of its entries.  */
+
+void
+lookup_cache_stats (enum lookup_cache cache, struct lookup_cache_stats *stats)
+{
+  *stats = tables[cache].stats;
+}
@@ -0,0 +1,42 @@
+#ifndef LOOKUP_CACHE_H
+# define LOOKUP_CACHE_H
+
+# include <sys/types.h>
+
+/* The caches of lookups that programs repeat for many files: user
+   and group names by id, and whether file systems lack support for
+   extended attributes.  */
+
+enum lookup_cache
+{
+  LOOKUP_USERS,
+  LOOKUP_GROUPS,
+  LOOKUP_FS_PROBES,
+  LOOKUP_CACHES
+};
+
+/* The extended attribute probes whose lack of support on a file
+   system is remembered.  */
+
+enum fs_probe
+{
+  FS_PROBE_SECURITY_CONTEXT,
+  FS_PROBE_ACL,
+  FS_PROBE_CAPABILITY
+};
+
+struct lookup_cache_stats
+{
+  size_t hits;
+  size_t misses;
+  size_t entries;
+};
+
+extern char const *lookup_user_name (uid_t uid);
+extern char const *lookup_group_name (gid_t gid);
+extern bool fs_probe_unsupported (dev_t dev, enum fs_probe probe);
+extern void fs_probe_set_unsupported (dev_t dev, enum fs_probe probe);
+extern void lookup_cache_stats (enum lookup_cache cache,
+                                struct lookup_cache_stats *stats);
+
+#endif
@@ -17,6 +17,10 @@
 #include <signal.h>
 #include <selinux/selinux.h>
 #include <wchar.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
 
 #if HAVE_LANGINFO_CODESET
 # include <langinfo.h>
@@ -46,7 +50,8 @@
 #include "human.h"
 #include "filemode.h"
 #include "filevercmp.h"
-#include "idcache.h"
+#include "lookup-cache.h"
+#include "statx-ring.h"
 #include "ls.h"
 #include "mbswidth.h"
 #include "mpsort.h"
@@ -85,6 +90,25 @@
 # define st_author st_uid
 #endif
 
+/* On Linux, unsorted listings read directories with getdents64
+   directly, into a buffer far larger than readdir's.  */
+#ifdef SYS_getdents64
+# define USE_GETDENTS64 1
+enum { GETDENTS_BUFSIZE = 256 * 1024 };
+
+/* A directory entry as getdents64 returns it.  */
+struct linux_dirent64
+  {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short int d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+#else
+# define USE_GETDENTS64 0
+#endif
+
 enum filetype
   {
     unknown,
@@ -138,6 +162,62 @@ struct bin_str
     char const *string;		
   };
 
+/* The number of directory entries in a scan_batch.  */
+enum { SCAN_BATCH_SIZE = 64 };
+
+/* An entry of a directory read ahead of print_dir by --parallel
+   threads, or by print_dir itself to stat a batch of entries through
+   an io_uring.  If STATTED, STAT_ERRNO is the errno value of the
+   failure to stat it for gobble_file, or 0 and STAT is its status.  */
+struct dir_entry
+  {
+    char *name;
+    enum filetype type;
+    ino_t inode;
+    bool statted;
+    int stat_errno;
+    struct stat stat;
+  };
+
+/* A batch of entries of a directory, stat'ed by one thread.  */
+struct scan_batch
+  {
+    struct dir_scan *scan;
+    struct scan_batch *next;
+    struct scan_batch *next_queued;
+    bool needs_stat;
+    size_t n;
+    struct dir_entry entries[SCAN_BATCH_SIZE];
+  };
+
+/* A directory read ahead of print_dir by --parallel threads.  */
+struct dir_scan
+  {
+    char *name;
+    DIR *dirp;
+    struct dir_scan *next_queued;
+    bool started;
+
+    /* The batches of entries read from the directory.  PENDING counts
+       the batches still being stat'ed, plus one while the directory
+       is being read; the scan is DONE once it drops to zero.  */
+    struct scan_batch *batches;
+    struct scan_batch **batches_tail;
+    size_t pending;
+    bool done;
+
+    /* The errno values of failures to open the directory, to get its
+       status for loop detection (into DIR_STAT otherwise), to read it
+       and to close it, or 0.  Reading continues after the
+       READ_OVERFLOWS failures with EOVERFLOW.  */
+    int open_errno;
+    int dir_stat_errno;
+    struct stat dir_stat;
+    size_t read_overflows;
+    int read_errno;
+    int close_errno;
+  };
+
 #if ! HAVE_TCGETPGRP
 # define tcgetpgrp(Fd) 0
 #endif
@@ -154,9 +234,12 @@ static size_t quote_name_buf (char **inbuf, size_t bufsize, char *name,
 static char *make_link_name (char const *name, char const *linkname);
 static int decode_switches (int argc, char **argv);
 static bool file_ignored (char const *name);
+static bool file_needs_stat (enum filetype type, ino_t inode,
+                             bool command_line_arg);
 static uintmax_t gobble_file (char const *name, enum filetype type,
                               ino_t inode, bool command_line_arg,
-                              char const *dirname);
+                              char const *dirname,
+                              struct dir_entry const *ent);
 static const struct bin_str * get_color_indicator (const struct fileinfo *f,
                                                    bool symlink_target);
 static bool print_color_indicator (const struct bin_str *ind);
@@ -169,10 +252,16 @@ static void extract_dirs_from_files (char const *dirname,
 static void get_link_name (char const *filename, struct fileinfo *f,
                            bool command_line_arg);
 static void indent (size_t from, size_t to);
+static bool is_directory (const struct fileinfo *f);
+static bool basename_is_dot_or_dotdot (char const *name);
 static size_t calculate_columns (bool by_columns);
 static void print_current_files (void);
 static void print_dir (char const *name, char const *realname,
                        bool command_line_arg);
+static void print_scanned_dir (char const *name, char const *realname,
+                               bool command_line_arg, struct dir_scan *scan);
+static void scan_pending_dirs (void);
+static void start_scan_threads (void);
 static size_t print_file_name_and_frills (const struct fileinfo *f,
                                           size_t start_col);
 static void print_horizontal (void);
@@ -187,7 +276,14 @@ static size_t print_name_with_quoting (const struct fileinfo *f,
 static void prep_non_filename_text (void);
 static bool print_type_indicator (bool stat_ok, mode_t mode,
                                   enum filetype type);
+static void append_type_indicator (bool stat_ok, mode_t mode,
+                                   enum filetype type);
+static size_t append_name_with_quoting (const struct fileinfo *f,
+                                        bool symlink_target,
+                                        struct obstack *stack,
+                                        size_t start_col);
 static void print_with_separator (char sep);
+static void report_stats (void);
 static void queue_directory (char const *name, char const *realname,
                              bool command_line_arg);
 static void sort_files (void);
@@ -219,10 +315,47 @@ struct pending
     char *name;
     char *realname;
     bool command_line_arg;
+    struct dir_scan *scan;
     struct pending *next;
   };
 
 static struct pending *pending_dirs;
+
+/* The number of threads to list directories with, and whether they
+   read directories ahead of print_dir.  */
+static size_t nthreads = 1;
+static bool scan_dirs;
+
+/* Whether print_dir may stat directory entries in batches through an
+   io_uring, which pays off when their status is slow to get.  */
+static bool use_io_uring;
+
+/* If true, report how well the lookup caches served the run on
+   standard error (--stats).  */
+static bool stats;
+
+/* Whether print_dir lists each entry as soon as it is read, rather
+   than reading the whole directory first.  */
+static bool stream_entries;
+
+/* The directories to read and the batches of entries to stat, in
+   first-in first-out queues, for the --parallel threads.  WORK is
+   signaled when a job is queued, and DONE when a scan is done.  */
+static struct
+  {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct dir_scan *scans;
+    struct dir_scan **scans_tail;
+    struct scan_batch *batches;
+    struct scan_batch **batches_tail;
+  } scan_pool =
+  {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, NULL, &scan_pool.scans,
+    NULL, &scan_pool.batches
+  };
 static struct timespec current_time;
 static bool print_scontext;
 static char UNKNOWN_SECURITY_CONTEXT[] = "?";
@@ -423,6 +556,9 @@ static bool print_dir_name;
 static size_t line_length;
 static timezone_t localtz;
 
+/* True if the LC_COLLATE locale is hard.  */
+static bool hard_LC_COLLATE;
+
 static bool format_needs_stat;
 static bool format_needs_type;
 
@@ -462,10 +598,13 @@ enum
   HIDE_OPTION,
   HYPERLINK_OPTION,
   INDICATOR_STYLE_OPTION,
+  IO_URING_OPTION,
+  PARALLEL_OPTION,
   QUOTING_STYLE_OPTION,
   SHOW_CONTROL_CHARS_OPTION,
   SI_OPTION,
   SORT_OPTION,
+  STATS_OPTION,
   TIME_OPTION,
   TIME_STYLE_OPTION
 };
@@ -499,6 +638,8 @@ static struct option const long_options[] =
   {"hide", required_argument, NULL, HIDE_OPTION},
   {"ignore", required_argument, NULL, 'I'},
   {"indicator-style", required_argument, NULL, INDICATOR_STYLE_OPTION},
+  {"io-uring", no_argument, NULL, IO_URING_OPTION},
+  {"parallel", required_argument, NULL, PARALLEL_OPTION},
   {"dereference", no_argument, NULL, 'L'},
   {"literal", no_argument, NULL, 'N'},
   {"quote-name", no_argument, NULL, 'Q'},
@@ -507,6 +648,7 @@ static struct option const long_options[] =
   {"format", required_argument, NULL, FORMAT_OPTION},
   {"show-control-chars", no_argument, NULL, SHOW_CONTROL_CHARS_OPTION},
   {"sort", required_argument, NULL, SORT_OPTION},
+  {"stats", no_argument, NULL, STATS_OPTION},
   {"tabsize", required_argument, NULL, 'T'},
   {"time", required_argument, NULL, TIME_OPTION},
   {"time-style", required_argument, NULL, TIME_STYLE_OPTION},
@@ -572,14 +714,22 @@ static enum when_type const when_types[] =
 };
 ARGMATCH_VERIFY (when_args, when_types);
 
-/* Information about filling a column.  */
-struct column_info
-{
-  bool valid_len;
-  size_t line_len;
-  size_t *col_arr;
-};
-static struct column_info *column_info;
+/* The widths of the columns that calculate_columns chose, and the
+   lengths of the names and frills of the files in the order of
+   sorted_file, which it computed along the way.  */
+static size_t *column_width;
+static size_t *file_length;
+
+/* The maxima of FILE_LENGTH over consecutive blocks of
+   FILE_LENGTH_BLOCK files, for finding the widest file of a column
+   without looking at all of its files.  */
+enum { FILE_LENGTH_BLOCK = 64 };
+static size_t *block_length;
+
+/* The sum and the maximum of FILE_LENGTH.  */
+static size_t total_file_length;
+static size_t longest_file_length;
+
 static size_t max_idx;
 
 #define MIN_COLUMN_WIDTH	3
@@ -599,6 +749,35 @@ static size_t dired_pos;
       }									\
     while (0)
 
+/* The rows of a long listing not yet written.  print_long_format
+   assembles each row here, so that rows are written to stdout a batch
+   at a time rather than a field at a time; dired_pos counts the bytes
+   as they are added.  Only the main thread prints, so one buffer
+   serves.  */
+enum { ROW_BATCH_SIZE = 64 * 1024 };
+static char *row_buf;
+static size_t row_len;
+static size_t row_alloc;
+
+/* Add the N bytes of S to the rows.  */
+static void
+append_row (char const *s, size_t n)
+{
+  while (row_alloc - row_len < n)
+    row_buf = x2realloc (row_buf, &row_alloc);
+  memcpy (row_buf + row_len, s, n);
+  row_len += n;
+  dired_pos += n;
+}
+
+/* Write the rows that have been assembled.  */
+static void
+flush_rows (void)
+{
+  fwrite (row_buf, 1, row_len, stdout);
+  row_len = 0;
+}
+
 /* With --dired, store pairs of beginning and ending indices of file names.  */
 static struct obstack dired_obstack;
 static struct obstack subdired_obstack;
@@ -729,26 +908,30 @@ calc_req_mask (void)
   return mask;
 }
 
+/* Store into *ST the status STX that statx returned for MASK.  */
+static void
+stat_from_statx (struct stat *st, struct statx *stx, unsigned int mask)
+{
+  statx_to_stat (stx, st);
+  /* Since we only need one timestamp type,
+     store birth time in st_mtim.  */
+  if (mask & STATX_BTIME)
+    {
+      if (stx->stx_mask & STATX_BTIME)
+        st->st_mtim = statx_timestamp_to_timespec (stx->stx_btime);
+      else
+        st->st_mtim.tv_sec = st->st_mtim.tv_nsec = -1;
+    }
+}
+
 static int
 do_statx (int fd, char const *name, struct stat *st, int flags,
           unsigned int mask)
 {
   struct statx stx;
-  bool want_btime = mask & STATX_BTIME;
   int ret = statx (fd, name, flags, mask, &stx);
   if (ret >= 0)
-    {
-      statx_to_stat (&stx, st);
-      /* Since we only need one timestamp type,
-         store birth time in st_mtim.  */
-      if (want_btime)
-        {
-          if (stx.stx_mask & STATX_BTIME)
-            st->st_mtim = statx_timestamp_to_timespec (stx.stx_btime);
-          else
-            st->st_mtim.tv_sec = st->st_mtim.tv_nsec = -1;
-        }
-    }
+    stat_from_statx (st, &stx, mask);
 
   return ret;
 }
@@ -783,6 +966,15 @@ fstat_for_ino (int fd, struct stat *st)
 {
   return do_statx (fd, "", st, AT_EMPTY_PATH, STATX_INO);
 }
+
+/* Like do_stat if DEREF, and like do_lstat otherwise, for NAME in
+   the directory open on FD.  */
+static inline int
+do_statat (int fd, char const *name, struct stat *st, bool deref)
+{
+  return do_statx (fd, name, st, deref ? 0 : AT_SYMLINK_NOFOLLOW,
+                   calc_req_mask ());
+}
 #else
 static inline int
 do_stat (char const *name, struct stat *st)
@@ -813,6 +1005,12 @@ fstat_for_ino (int fd, struct stat *st)
 {
   return fstat (fd, st);
 }
+
+static inline int
+do_statat (int fd, char const *name, struct stat *st, bool deref)
+{
+  return fstatat (fd, name, st, deref ? 0 : AT_SYMLINK_NOFOLLOW);
+}
 #endif
 
 /* Return the address of the first plain %b spec in FMT, or NULL if
@@ -1067,6 +1265,7 @@ process_signals (void)
       int stops;
       sigset_t oldset;
 
+      flush_rows ();
       if (used_color)
         restore_default_color ();
       fflush (stdout);
@@ -1223,6 +1422,7 @@ main (int argc, char **argv)
   current_time.tv_nsec = -1;
 
   i = decode_switches (argc, argv);
+  hard_LC_COLLATE = hard_locale (LC_COLLATE);
 
   if (print_with_color)
     parse_ls_color ();
@@ -1290,6 +1490,16 @@ main (int argc, char **argv)
         hostname = "";
     }
 
+  /* In this narrow case, print out each name right away, so ls uses
+     constant memory while processing the entries of a directory.
+     Useful when there are many (millions) of entries in a directory.
+     Reading directories ahead would defeat that.  */
+  stream_entries = (format == one_per_line && sort_type == sort_none
+                    && !print_block_size);
+  scan_dirs = 1 < nthreads && !stream_entries;
+  if (scan_dirs)
+    start_scan_threads ();
+
   cwd_n_alloc = 100;
   cwd_file = xnmalloc (cwd_n_alloc, sizeof *cwd_file);
   cwd_n_used = 0;
@@ -1301,13 +1511,14 @@ main (int argc, char **argv)
   if (n_files <= 0)
     {
       if (immediate_dirs)
-        gobble_file (".", directory, NOT_AN_INODE_NUMBER, true, "");
+        gobble_file (".", directory, NOT_AN_INODE_NUMBER, true, "", NULL);
       else
         queue_directory (".", NULL, true);
     }
   else
     do
-      gobble_file (argv[i++], unknown, NOT_AN_INODE_NUMBER, true, "");
+      gobble_file (argv[i++], unknown, NOT_AN_INODE_NUMBER, true, "",
+                 NULL);
     while (i < argc);
 
   if (cwd_n_used)
@@ -1333,6 +1544,9 @@ main (int argc, char **argv)
 
   while (pending_dirs)
     {
+      if (scan_dirs)
+        scan_pending_dirs ();
+
       thispend = pending_dirs;
       pending_dirs = pending_dirs->next;
 
@@ -1354,8 +1568,12 @@ main (int argc, char **argv)
             }
         }
 
-      print_dir (thispend->name, thispend->realname,
-                 thispend->command_line_arg);
+      if (thispend->scan)
+        print_scanned_dir (thispend->name, thispend->realname,
+                           thispend->command_line_arg, thispend->scan);
+      else
+        print_dir (thispend->name, thispend->realname,
+                   thispend->command_line_arg);
 
       free_pending_ent (thispend);
       print_dir_name = true;
@@ -1403,9 +1621,33 @@ main (int argc, char **argv)
       hash_free (active_dir_set);
     }
 
+  if (stats)
+    report_stats ();
+
   return exit_status;
 }
 
+/* Report the statistics of the lookup caches, for --stats.  */
+
+static void
+report_stats (void)
+{
+  static char const *const names[LOOKUP_CACHES] =
+    {
+      [LOOKUP_USERS] = N_("user names"),
+      [LOOKUP_GROUPS] = N_("group names"),
+      [LOOKUP_FS_PROBES] = N_("file system probes")
+    };
+
+  for (int i = 0; i < LOOKUP_CACHES; i++)
+    {
+      struct lookup_cache_stats st;
+      lookup_cache_stats (i, &st);
+      error (0, 0, _("%s: %zu hits, %zu misses, %zu entries"),
+             _(names[i]), st.hits, st.misses, st.entries);
+    }
+}
+
 /* Set the line length to the value given by SPEC.  Return true if
    successful.  0 means no limit on line length.  */
 
@@ -1758,6 +2000,19 @@ decode_switches (int argc, char **argv)
           }
           break;
 
+        case IO_URING_OPTION:
+          use_io_uring = true;
+          break;
+
+        case PARALLEL_OPTION:
+          nthreads = xnumtoumax (optarg, 0, 1, SIZE_MAX, "",
+                                 _("invalid number of threads"), LS_FAILURE);
+          break;
+
+        case STATS_OPTION:
+          stats = true;
+          break;
+
         case SORT_OPTION:
           sort_type = XARGMATCH ("--sort", optarg, sort_args, sort_types);
           sort_type_specified = true;
@@ -2465,62 +2720,77 @@ queue_directory (char const *name, char const *realname, bool command_line_arg)
   new->realname = realname ? xstrdup (realname) : NULL;
   new->name = name ? xstrdup (name) : NULL;
   new->command_line_arg = command_line_arg;
+  new->scan = NULL;
   new->next = pending_dirs;
   pending_dirs = new;
 }
 
-/* Read directory NAME, and list the files in it.
-   If REALNAME is nonzero, print its name instead of NAME;
-   this is used for symbolic links to directories.
-   COMMAND_LINE_ARG means this directory was mentioned on the command line.  */
+/* Return the type of file that the d_type member D_TYPE of a directory
+   entry stands for, or unknown if it does not tell.  */
 
-static void
-print_dir (char const *name, char const *realname, bool command_line_arg)
+static enum filetype
+d_type_filetype (int d_type)
 {
-  DIR *dirp;
-  struct dirent *next;
-  uintmax_t total_blocks = 0;
-  static bool first = true;
-
-  errno = 0;
-  dirp = opendir (name);
-  if (!dirp)
+#if HAVE_STRUCT_DIRENT_D_TYPE
+  switch (d_type)
     {
-      file_failure (command_line_arg, _("cannot open directory %s"), name);
-      return;
+    case DT_BLK:  return blockdev;
+    case DT_CHR:  return chardev;
+    case DT_DIR:  return directory;
+    case DT_FIFO: return fifo;
+    case DT_LNK:  return symbolic_link;
+    case DT_REG:  return normal;
+    case DT_SOCK: return sock;
+# ifdef DT_WHT
+    case DT_WHT:  return whiteout;
+# endif
     }
+#endif
+  return unknown;
+}
 
-  if (LOOP_DETECT)
-    {
-      struct stat dir_stat;
-      int fd = dirfd (dirp);
+/* Return the type of the file of the directory entry DP, or unknown
+   if readdir does not tell.  */
 
-      /* If dirfd failed, endure the overhead of stat'ing by path  */
-      if ((0 <= fd
-           ? fstat_for_ino (fd, &dir_stat)
-           : stat_for_ino (name, &dir_stat)) < 0)
-        {
-          file_failure (command_line_arg,
-                        _("cannot determine device and inode of %s"), name);
-          closedir (dirp);
-          return;
-        }
+static enum filetype
+dirent_type (struct dirent const *dp)
+{
+#if HAVE_STRUCT_DIRENT_D_TYPE
+  return d_type_filetype (dp->d_type);
+#else
+  return unknown;
+#endif
+}
 
-      /* If we've already visited this dev/inode pair, warn that
-         we've found a loop, and do not process this directory.  */
-      if (visit_dir (dir_stat.st_dev, dir_stat.st_ino))
-        {
-          error (0, 0, _("%s: not listing already-listed directory"),
-                 quotef (name));
-          closedir (dirp);
-          set_exit_status (true);
-          return;
-        }
+/* Note that the directory NAME whose status is DIR_STAT is being
+   listed, for loop detection.  Return false after diagnosing it if
+   it is already being listed.  */
 
-      dev_ino_push (dir_stat.st_dev, dir_stat.st_ino);
+static bool
+enter_dir (char const *name, struct stat const *dir_stat)
+{
+  /* If we've already visited this dev/inode pair, warn that
+     we've found a loop, and do not process this directory.  */
+  if (visit_dir (dir_stat->st_dev, dir_stat->st_ino))
+    {
+      error (0, 0, _("%s: not listing already-listed directory"),
+             quotef (name));
+      set_exit_status (true);
+      return false;
     }
 
-  clear_files ();
+  dev_ino_push (dir_stat->st_dev, dir_stat->st_ino);
+  return true;
+}
+
+/* Print the heading of the listing of directory NAME, or REALNAME if
+   nonzero, if one is wanted.  */
+
+static void
+print_dir_header (char const *name, char const *realname,
+                  bool command_line_arg)
+{
+  static bool first = true;
 
   if (recursive || print_dir_name)
     {
@@ -2544,78 +2814,14 @@ print_dir (char const *name, char const *realname, bool command_line_arg)
 
       DIRED_FPUTS_LITERAL (":\n", stdout);
     }
+}
 
-  /* Read the directory entries, and insert the subfiles into the 'cwd_file'
-     table.  */
-
-  while (1)
-    {
-      /* Set errno to zero so we can distinguish between a readdir failure
-         and when readdir simply finds that there are no more entries.  */
-      errno = 0;
-      next = readdir (dirp);
-      if (next)
-        {
-          if (! file_ignored (next->d_name))
-            {
-              enum filetype type = unknown;
-
-#if HAVE_STRUCT_DIRENT_D_TYPE
-              switch (next->d_type)
-                {
-                case DT_BLK:  type = blockdev;		break;
-                case DT_CHR:  type = chardev;		break;
-                case DT_DIR:  type = directory;		break;
-                case DT_FIFO: type = fifo;		break;
-                case DT_LNK:  type = symbolic_link;	break;
-                case DT_REG:  type = normal;		break;
-                case DT_SOCK: type = sock;		break;
-# ifdef DT_WHT
-                case DT_WHT:  type = whiteout;		break;
-# endif
-                }
-#endif
-              total_blocks += gobble_file (next->d_name, type,
-                                           RELIABLE_D_INO (next),
-                                           false, name);
-
-              /* In this narrow case, print out each name right away, so
-                 ls uses constant memory while processing the entries of
-                 this directory.  Useful when there are many (millions)
-                 of entries in a directory.  */
-              if (format == one_per_line && sort_type == sort_none
-                      && !print_block_size && !recursive)
-                {
-                  /* We must call sort_files in spite of
-                     "sort_type == sort_none" for its initialization
-                     of the sorted_file vector.  */
-                  sort_files ();
-                  print_current_files ();
-                  clear_files ();
-                }
-            }
-        }
-      else if (errno != 0)
-        {
-          file_failure (command_line_arg, _("reading directory %s"), name);
-          if (errno != EOVERFLOW)
-            break;
-        }
-      else
-        break;
-
-      /* When processing a very large directory, and since we've inhibited
-         interrupts, this loop would take so long that ls would be annoyingly
-         uninterruptible.  This ensures that it handles signals promptly.  */
-      process_signals ();
-    }
-
-  if (closedir (dirp) != 0)
-    {
-      file_failure (command_line_arg, _("closing directory %s"), name);
-      /* Don't return; print whatever we got.  */
-    }
+/* Sort and print the files of directory NAME, which occupy
+   TOTAL_BLOCKS blocks.  */
 
+static void
+print_dir_files (char const *name, uintmax_t total_blocks)
+{
   /* Sort the directory contents.  */
   sort_files ();
 
@@ -2644,83 +2850,801 @@ print_dir (char const *name, char const *realname, bool command_line_arg)
     print_current_files ();
 }
 
-/* Add 'pattern' to the list of patterns for which files that match are
-   not listed.  */
+/* List the file NAME, an entry of directory DIRNAME whose type is TYPE
+   and whose inode number is INODE, right away.  If recursing, queue it
+   onto SUBDIRS if it is a subdirectory.  */
 
 static void
-add_ignore_pattern (char const *pattern)
+stream_file (char const *name, enum filetype type, ino_t inode,
+             char const *dirname, struct pending **subdirs)
 {
-  struct ignore_pattern *ignore;
+  gobble_file (name, type, inode, false, dirname, NULL);
 
-  ignore = xmalloc (sizeof *ignore);
-  ignore->pattern = pattern;
-  /* Add it to the head of the linked list.  */
-  ignore->next = ignore_patterns;
-  ignore_patterns = ignore;
-}
+  /* We must call sort_files in spite of "sort_type == sort_none" for
+     its initialization of the sorted_file vector.  */
+  sort_files ();
 
-/* Return true if one of the PATTERNS matches FILE.  */
+  struct fileinfo const *f = sorted_file[0];
+  if (recursive && is_directory (f) && ! basename_is_dot_or_dotdot (name))
+    {
+      struct pending *saved = pending_dirs;
+      char *subdir = file_name_concat (dirname, name, NULL);
+      pending_dirs = *subdirs;
+      queue_directory (subdir, f->linkname, false);
+      *subdirs = pending_dirs;
+      pending_dirs = saved;
+      free (subdir);
+    }
 
-static bool
-patterns_match (struct ignore_pattern const *patterns, char const *file)
-{
-  struct ignore_pattern const *p;
-  for (p = patterns; p; p = p->next)
-    if (fnmatch (p->pattern, file, FNM_PERIOD) == 0)
-      return true;
-  return false;
+  print_current_files ();
+  clear_files ();
 }
 
-/* Return true if FILE should be ignored.  */
+/* List each entry of the directory NAME open on DIRP as soon as it is
+   read, and close DIRP.  COMMAND_LINE_ARG means NAME was mentioned on
+   the command line.  */
 
-static bool
-file_ignored (char const *name)
+static void
+stream_dir (DIR *dirp, char const *name, bool command_line_arg)
 {
-  return ((ignore_mode != IGNORE_MINIMAL
-           && name[0] == '.'
-           && (ignore_mode == IGNORE_DEFAULT || ! name[1 + (name[1] == '.')]))
-          || (ignore_mode == IGNORE_DEFAULT
-              && patterns_match (hide_patterns, name))
-          || patterns_match (ignore_patterns, name));
-}
-
-/* POSIX requires that a file size be printed without a sign, even
-   when negative.  Assume the typical case where negative sizes are
-   actually positive values that have wrapped around.  */
+  /* The subdirectories to list if recursing, last one first.  */
+  struct pending *subdirs = NULL;
 
-static uintmax_t
-unsigned_file_size (off_t size)
-{
-  return size + (size < 0) * ((uintmax_t) OFF_T_MAX - OFF_T_MIN + 1);
-}
+#if USE_GETDENTS64
+  static char *getdents_buf;
+  int fd = dirfd (dirp);
 
-#ifdef HAVE_CAP
-/* Return true if NAME has a capability (see linux/capability.h) */
-static bool
-has_capability (char const *name)
-{
-  char *result;
-  bool has_cap;
+  /* Bypass readdir, which reads only 32 KiB or so at a time, and
+     process the records of large reads in place.  */
+  if (0 <= fd)
+    {
+      if (! getdents_buf)
+        getdents_buf = xmalloc (GETDENTS_BUFSIZE);
 
-  cap_t cap_d = cap_get_file (name);
-  if (cap_d == NULL)
-    return false;
+      while (true)
+        {
+          ssize_t n = syscall (SYS_getdents64, fd, getdents_buf,
+                               GETDENTS_BUFSIZE);
+          if (n <= 0)
+            {
+              if (n < 0)
+                file_failure (command_line_arg,
+                              _("reading directory %s"), name);
+              break;
+            }
 
-  result = cap_to_text (cap_d, NULL);
-  cap_free (cap_d);
-  if (!result)
-    return false;
+          for (ssize_t off = 0; off < n; )
+            {
+              struct linux_dirent64 const *dp
+                = (struct linux_dirent64 const *) (getdents_buf + off);
+              off += dp->d_reclen;
 
-  /* check if human-readable capability string is empty */
-  has_cap = !!*result;
+              /* Skip deleted entries, as readdir does.  */
+              if (dp->d_ino != 0 && ! file_ignored (dp->d_name))
+                stream_file (dp->d_name, d_type_filetype (dp->d_type),
+                             RELIABLE_D_INO (dp), name, &subdirs);
 
-  cap_free (result);
-  return has_cap;
-}
-#else
-static bool
-has_capability (char const *name _GL_UNUSED)
-{
+              process_signals ();
+            }
+        }
+    }
+  else
+#endif
+    while (true)
+      {
+        errno = 0;
+        struct dirent *next = readdir (dirp);
+        if (next)
+          {
+            if (! file_ignored (next->d_name))
+              stream_file (next->d_name, dirent_type (next),
+                           RELIABLE_D_INO (next), name, &subdirs);
+          }
+        else if (errno != 0)
+          {
+            file_failure (command_line_arg, _("reading directory %s"), name);
+            if (errno != EOVERFLOW)
+              break;
+          }
+        else
+          break;
+
+        process_signals ();
+      }
+
+  if (closedir (dirp) != 0)
+    file_failure (command_line_arg, _("closing directory %s"), name);
+
+  /* Queue the marker and subdirectories as extract_dirs_from_files
+     would, so that the subdirectories are listed in the order read.  */
+  if (recursive)
+    {
+      if (LOOP_DETECT)
+        queue_directory (NULL, name, false);
+      while (subdirs)
+        {
+          struct pending *p = subdirs;
+          subdirs = p->next;
+          p->next = pending_dirs;
+          pending_dirs = p;
+        }
+    }
+}
+
+#if HAVE_STATX_RING
+/* The io_uring through which print_dir stats directory entries in
+   batches, and whether it has been opened yet.  */
+static struct statx_ring *stat_ring;
+static bool stat_ring_opened;
+#endif
+
+/* Return true if print_dir can stat the entries of a batch all at
+   once, opening the io_uring to do so on first use.  */
+static bool
+stat_ring_usable (void)
+{
+#if HAVE_STATX_RING
+  if (! use_io_uring)
+    return false;
+  if (! stat_ring_opened)
+    {
+      stat_ring = statx_ring_open (SCAN_BATCH_SIZE);
+      stat_ring_opened = true;
+    }
+  return stat_ring != NULL;
+#else
+  return false;
+#endif
+}
+
+/* Stat all at once those of the N ENTRIES of the directory DIRNAME,
+   open on FD, whose status gobble_file needs, and then add them all
+   in order to the table of files.  Free their names, and return the
+   number of blocks they occupy.  */
+static uintmax_t
+gobble_entries (int fd, struct dir_entry *entries, size_t n,
+                char const *dirname)
+{
+  uintmax_t blocks = 0;
+
+#if HAVE_STATX_RING
+  struct statx_request requests[SCAN_BATCH_SIZE];
+  struct statx stx[SCAN_BATCH_SIZE];
+  int flags = dereference == DEREF_ALWAYS ? 0 : AT_SYMLINK_NOFOLLOW;
+  unsigned int mask = calc_req_mask ();
+  size_t nrequests = 0;
+
+  for (size_t i = 0; i < n; i++)
+    if (entries[i].statted)
+      {
+        struct statx_request *r = &requests[nrequests];
+        r->fd = fd;
+        r->name = entries[i].name;
+        r->flags = flags;
+        r->mask = mask;
+        r->buf = &stx[nrequests++];
+      }
+  statx_ring_run (stat_ring, requests, nrequests);
+
+  for (size_t i = 0, j = 0; i < n; i++)
+    if (entries[i].statted)
+      {
+        entries[i].stat_errno = requests[j].err;
+        if (! requests[j].err)
+          stat_from_statx (&entries[i].stat, &stx[j], mask);
+        j++;
+      }
+#endif
+
+  for (size_t i = 0; i < n; i++)
+    {
+      struct dir_entry *ent = &entries[i];
+      blocks += gobble_file (ent->name, ent->type, ent->inode, false,
+                             dirname, ent);
+      free (ent->name);
+    }
+
+  return blocks;
+}
+
+/* Read directory NAME, and list the files in it.
+   If REALNAME is nonzero, print its name instead of NAME;
+   this is used for symbolic links to directories.
+   COMMAND_LINE_ARG means this directory was mentioned on the command line.  */
+
+static void
+print_dir (char const *name, char const *realname, bool command_line_arg)
+{
+  DIR *dirp;
+  struct dirent *next;
+  uintmax_t total_blocks = 0;
+
+  errno = 0;
+  dirp = opendir (name);
+  if (!dirp)
+    {
+      file_failure (command_line_arg, _("cannot open directory %s"), name);
+      return;
+    }
+
+  if (LOOP_DETECT)
+    {
+      struct stat dir_stat;
+      int fd = dirfd (dirp);
+
+      /* If dirfd failed, endure the overhead of stat'ing by path  */
+      if ((0 <= fd
+           ? fstat_for_ino (fd, &dir_stat)
+           : stat_for_ino (name, &dir_stat)) < 0)
+        {
+          file_failure (command_line_arg,
+                        _("cannot determine device and inode of %s"), name);
+          closedir (dirp);
+          return;
+        }
+
+      if (! enter_dir (name, &dir_stat))
+        {
+          closedir (dirp);
+          return;
+        }
+    }
+
+  clear_files ();
+  print_dir_header (name, realname, command_line_arg);
+
+  if (stream_entries)
+    {
+      stream_dir (dirp, name, command_line_arg);
+      return;
+    }
+
+  /* Read the directory entries, and insert the subfiles into the 'cwd_file'
+     table.  Once an entry needs to be stat'ed and an io_uring can do
+     that, collect the entries in batches, so that those of a batch
+     that need it are stat'ed all at once.  */
+
+  int fd = dirfd (dirp);
+  struct dir_entry entries[SCAN_BATCH_SIZE];
+  size_t nentries = 0;
+
+  while (1)
+    {
+      /* Set errno to zero so we can distinguish between a readdir failure
+         and when readdir simply finds that there are no more entries.  */
+      errno = 0;
+      next = readdir (dirp);
+      if (next)
+        {
+          if (! file_ignored (next->d_name))
+            {
+              enum filetype type = dirent_type (next);
+              ino_t inode = RELIABLE_D_INO (next);
+              bool needs_stat = file_needs_stat (type, inode, false);
+
+              if (nentries
+                  || (needs_stat && 0 <= fd && stat_ring_usable ()))
+                {
+                  struct dir_entry *ent = &entries[nentries++];
+                  ent->name = xstrdup (next->d_name);
+                  ent->type = type;
+                  ent->inode = inode;
+                  ent->statted = needs_stat;
+                  if (nentries == SCAN_BATCH_SIZE)
+                    {
+                      total_blocks += gobble_entries (fd, entries, nentries,
+                                                      name);
+                      nentries = 0;
+                    }
+                }
+              else
+                total_blocks += gobble_file (next->d_name, type, inode,
+                                             false, name, NULL);
+            }
+        }
+      else
+        {
+          /* Add the entries read so far first, so that any diagnostics
+             about them come before this one.  */
+          int err = errno;
+          total_blocks += gobble_entries (fd, entries, nentries, name);
+          nentries = 0;
+
+          if (err == 0)
+            break;
+          errno = err;
+          file_failure (command_line_arg, _("reading directory %s"), name);
+          if (err != EOVERFLOW)
+            break;
+        }
+
+      /* When processing a very large directory, and since we've inhibited
+         interrupts, this loop would take so long that ls would be annoyingly
+         uninterruptible.  This ensures that it handles signals promptly.  */
+      process_signals ();
+    }
+
+  if (closedir (dirp) != 0)
+    {
+      file_failure (command_line_arg, _("closing directory %s"), name);
+      /* Don't return; print whatever we got.  */
+    }
+
+  print_dir_files (name, total_blocks);
+}
+
+/* With --parallel, up to NTHREADS threads read the next few pending
+   directories ahead of print_dir, and stat their entries in batches
+   while they are still being read.  print_scanned_dir then lists
+   each directory in turn as print_dir would, so that the output does
+   not depend on the order in which the threads finish.  */
+
+/* With scan_pool.lock held, note that a batch of entries of SCAN has
+   been stat'ed, or that its directory has been read, and finish SCAN
+   if that was the last of its work.  */
+
+static void
+release_scan (struct dir_scan *scan)
+{
+  if (--scan->pending == 0)
+    {
+      if (scan->dirp && closedir (scan->dirp) != 0)
+        scan->close_errno = errno;
+      scan->done = true;
+      pthread_cond_broadcast (&scan_pool.done);
+    }
+}
+
+/* Append BATCH to the entries of its scan, and queue it to be
+   stat'ed if need be.  */
+
+static void
+queue_batch (struct scan_batch *batch)
+{
+  struct dir_scan *scan = batch->scan;
+
+  batch->next = NULL;
+  pthread_mutex_lock (&scan_pool.lock);
+  *scan->batches_tail = batch;
+  scan->batches_tail = &batch->next;
+  if (batch->needs_stat)
+    {
+      scan->pending++;
+      batch->next_queued = NULL;
+      *scan_pool.batches_tail = batch;
+      scan_pool.batches_tail = &batch->next_queued;
+      pthread_cond_signal (&scan_pool.work);
+    }
+  pthread_mutex_unlock (&scan_pool.lock);
+}
+
+/* Stat the entries of BATCH whose status gobble_file needs.
+   scan_pool.lock is held, but released meanwhile.  */
+
+static void
+stat_batch (struct scan_batch *batch)
+{
+  struct dir_scan *scan = batch->scan;
+  int fd = dirfd (scan->dirp);
+  bool deref = dereference == DEREF_ALWAYS;
+
+  pthread_mutex_unlock (&scan_pool.lock);
+  for (size_t i = 0; i < batch->n; i++)
+    {
+      struct dir_entry *ent = &batch->entries[i];
+      if (ent->statted)
+        ent->stat_errno = (do_statat (fd, ent->name, &ent->stat, deref) == 0
+                           ? 0 : errno);
+    }
+  pthread_mutex_lock (&scan_pool.lock);
+  release_scan (scan);
+}
+
+/* Read the directory of SCAN, queueing batches of its entries to be
+   stat'ed as they fill.  scan_pool.lock is held, but released
+   meanwhile.  */
+
+static void
+read_scan (struct dir_scan *scan)
+{
+  scan->started = true;
+  pthread_mutex_unlock (&scan_pool.lock);
+
+  scan->dirp = opendir (scan->name);
+  if (! scan->dirp)
+    scan->open_errno = errno;
+  else
+    {
+      int fd = dirfd (scan->dirp);
+
+      if (LOOP_DETECT
+          && (0 <= fd
+              ? fstat_for_ino (fd, &scan->dir_stat)
+              : stat_for_ino (scan->name, &scan->dir_stat)) < 0)
+        scan->dir_stat_errno = errno;
+      else
+        {
+          struct scan_batch *batch = NULL;
+
+          while (true)
+            {
+              errno = 0;
+              struct dirent *next = readdir (scan->dirp);
+              if (next)
+                {
+                  if (file_ignored (next->d_name))
+                    continue;
+                  if (! batch)
+                    {
+                      batch = xmalloc (sizeof *batch);
+                      batch->scan = scan;
+                      batch->needs_stat = false;
+                      batch->n = 0;
+                    }
+                  struct dir_entry *ent = &batch->entries[batch->n++];
+                  ent->name = xstrdup (next->d_name);
+                  ent->type = dirent_type (next);
+                  ent->inode = RELIABLE_D_INO (next);
+                  /* Without a descriptor to stat the entry relative to,
+                     leave that to gobble_file.  */
+                  ent->statted = (0 <= fd
+                                  && file_needs_stat (ent->type, ent->inode,
+                                                      false));
+                  batch->needs_stat |= ent->statted;
+                  if (batch->n == SCAN_BATCH_SIZE)
+                    {
+                      queue_batch (batch);
+                      batch = NULL;
+                    }
+                }
+              else if (errno == EOVERFLOW)
+                scan->read_overflows++;
+              else
+                {
+                  scan->read_errno = errno;
+                  break;
+                }
+            }
+
+          if (batch)
+            queue_batch (batch);
+        }
+    }
+
+  pthread_mutex_lock (&scan_pool.lock);
+  release_scan (scan);
+}
+
+/* With scan_pool.lock held, remove SCAN from the queue of directories
+   to read, and read it.  */
+
+static void
+take_scan (struct dir_scan *scan)
+{
+  struct dir_scan **p = &scan_pool.scans;
+  while (*p != scan)
+    p = &(*p)->next_queued;
+  *p = scan->next_queued;
+  if (! *p)
+    scan_pool.scans_tail = p;
+  read_scan (scan);
+}
+
+/* With scan_pool.lock held, run the first queued job of the --parallel
+   threads, preferring batches to stat as they let listings finish
+   sooner.  Do not read a directory if BATCHES_ONLY.  Return false if
+   there was no such job.  */
+
+static bool
+run_scan_job (bool batches_only)
+{
+  struct scan_batch *batch = scan_pool.batches;
+  if (batch)
+    {
+      scan_pool.batches = batch->next_queued;
+      if (! scan_pool.batches)
+        scan_pool.batches_tail = &scan_pool.batches;
+      stat_batch (batch);
+      return true;
+    }
+
+  if (scan_pool.scans && ! batches_only)
+    {
+      take_scan (scan_pool.scans);
+      return true;
+    }
+
+  return false;
+}
+
+static void *
+scan_thread (void *arg _GL_UNUSED)
+{
+  pthread_mutex_lock (&scan_pool.lock);
+  while (true)
+    if (! run_scan_job (false))
+      pthread_cond_wait (&scan_pool.work, &scan_pool.lock);
+  return NULL;
+}
+
+/* Start the threads that read directories ahead of print_dir, other
+   than the main thread.  Leave signals to the main thread.  */
+
+static void
+start_scan_threads (void)
+{
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+
+  for (size_t i = 1; i < nthreads; i++)
+    {
+      pthread_t thread;
+      if (pthread_create (&thread, NULL, scan_thread, NULL) != 0)
+        break;
+      pthread_detach (thread);
+    }
+
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+}
+
+/* Start reading ahead the first few pending directories, enough to
+   keep all the threads busy.  */
+
+static void
+scan_pending_dirs (void)
+{
+  size_t n = 0;
+
+  pthread_mutex_lock (&scan_pool.lock);
+  for (struct pending *p = pending_dirs; p && n < 2 * nthreads; p = p->next)
+    if (p->name)
+      {
+        if (! p->scan)
+          {
+            struct dir_scan *scan = xcalloc (1, sizeof *scan);
+            scan->name = p->name;
+            scan->batches_tail = &scan->batches;
+            scan->pending = 1;
+            *scan_pool.scans_tail = scan;
+            scan_pool.scans_tail = &scan->next_queued;
+            pthread_cond_signal (&scan_pool.work);
+            p->scan = scan;
+          }
+        n++;
+      }
+  pthread_mutex_unlock (&scan_pool.lock);
+}
+
+/* Wait for SCAN to be done, reading its directory first if no thread
+   has started to, and stat'ing queued batches of entries meanwhile.  */
+
+static void
+finish_scan (struct dir_scan *scan)
+{
+  pthread_mutex_lock (&scan_pool.lock);
+  if (! scan->started)
+    take_scan (scan);
+  while (! scan->done)
+    if (! run_scan_job (true))
+      pthread_cond_wait (&scan_pool.done, &scan_pool.lock);
+  pthread_mutex_unlock (&scan_pool.lock);
+}
+
+static void
+free_scan (struct dir_scan *scan)
+{
+  struct scan_batch *batch = scan->batches;
+  while (batch)
+    {
+      struct scan_batch *next = batch->next;
+      for (size_t i = 0; i < batch->n; i++)
+        free (batch->entries[i].name);
+      free (batch);
+      batch = next;
+    }
+  free (scan);
+}
+
+/* Like print_dir, but list the directory that SCAN reads ahead.  */
+
+static void
+print_scanned_dir (char const *name, char const *realname,
+                   bool command_line_arg, struct dir_scan *scan)
+{
+  uintmax_t total_blocks = 0;
+
+  finish_scan (scan);
+
+  if (scan->open_errno)
+    {
+      errno = scan->open_errno;
+      file_failure (command_line_arg, _("cannot open directory %s"), name);
+    }
+  else if (scan->dir_stat_errno)
+    {
+      errno = scan->dir_stat_errno;
+      file_failure (command_line_arg,
+                    _("cannot determine device and inode of %s"), name);
+    }
+  else if (! LOOP_DETECT || enter_dir (name, &scan->dir_stat))
+    {
+      clear_files ();
+      print_dir_header (name, realname, command_line_arg);
+
+      for (struct scan_batch *batch = scan->batches; batch;
+           batch = batch->next)
+        for (size_t i = 0; i < batch->n; i++)
+          {
+            struct dir_entry const *ent = &batch->entries[i];
+            total_blocks += gobble_file (ent->name, ent->type, ent->inode,
+                                         false, name, ent);
+            process_signals ();
+          }
+
+      for (size_t i = 0; i < scan->read_overflows; i++)
+        {
+          errno = EOVERFLOW;
+          file_failure (command_line_arg, _("reading directory %s"), name);
+        }
+      if (scan->read_errno)
+        {
+          errno = scan->read_errno;
+          file_failure (command_line_arg, _("reading directory %s"), name);
+        }
+      if (scan->close_errno)
+        {
+          errno = scan->close_errno;
+          file_failure (command_line_arg, _("closing directory %s"), name);
+        }
+
+      print_dir_files (name, total_blocks);
+    }
+
+  free_scan (scan);
+}
+
+/* Add 'pattern' to the list of patterns for which files that match are
+   not listed.  */
+
+static void
+add_ignore_pattern (char const *pattern)
+{
+  struct ignore_pattern *ignore;
+
+  ignore = xmalloc (sizeof *ignore);
+  ignore->pattern = pattern;
+  /* Add it to the head of the linked list.  */
+  ignore->next = ignore_patterns;
+  ignore_patterns = ignore;
+}
+
+/* Return true if one of the PATTERNS matches FILE.  */
+
+static bool
+patterns_match (struct ignore_pattern const *patterns, char const *file)
+{
+  struct ignore_pattern const *p;
+  for (p = patterns; p; p = p->next)
+    if (fnmatch (p->pattern, file, FNM_PERIOD) == 0)
+      return true;
+  return false;
+}
+
+/* Return true if FILE should be ignored.  */
+
+static bool
+file_ignored (char const *name)
+{
+  return ((ignore_mode != IGNORE_MINIMAL
+           && name[0] == '.'
+           && (ignore_mode == IGNORE_DEFAULT || ! name[1 + (name[1] == '.')]))
+          || (ignore_mode == IGNORE_DEFAULT
+              && patterns_match (hide_patterns, name))
+          || patterns_match (ignore_patterns, name));
+}
+
+/* POSIX requires that a file size be printed without a sign, even
+   when negative.  Assume the typical case where negative sizes are
+   actually positive values that have wrapped around.  */
+
+static uintmax_t
+unsigned_file_size (off_t size)
+{
+  return size + (size < 0) * ((uintmax_t) OFF_T_MAX - OFF_T_MIN + 1);
+}
+
+/* The results of human_readable for recently seen numbers of blocks
+   and file sizes, so that files of the same size cost one conversion
+   for both the column widths and the listing.  */
+enum { HUMAN_MEMO_SIZE = 64 };
+struct human_memo
+  {
+    bool valid;
+    uintmax_t n;
+    int width;
+    char text[LONGEST_HUMAN_READABLE + 1];
+  };
+static struct human_memo block_size_memo[HUMAN_MEMO_SIZE];
+static struct human_memo file_size_memo[HUMAN_MEMO_SIZE];
+
+/* Return human_readable (N, ..., OPTS, FROM_BLOCK_SIZE, TO_BLOCK_SIZE)
+   using MEMO, whose entries must all have been converted with the same
+   options, and store its width into *WIDTH if WIDTH is non-null.  */
+
+static char const *
+human_readable_memo (struct human_memo *memo, uintmax_t n, int opts,
+                     uintmax_t from_block_size, uintmax_t to_block_size,
+                     int *width)
+{
+  uint_least64_t h = n * 0x9e3779b97f4a7c15u;
+  struct human_memo *m = &memo[(h >> 32) % HUMAN_MEMO_SIZE];
+
+  if (! (m->valid && m->n == n))
+    {
+      char const *text = human_readable (n, m->text, opts,
+                                         from_block_size, to_block_size);
+      memmove (m->text, text, strlen (text) + 1);
+      m->width = mbswidth (m->text, 0);
+      m->n = n;
+      m->valid = true;
+    }
+
+  if (width)
+    *width = m->width;
+  return m->text;
+}
+
+/* Return the human-readable number of blocks of the file whose
+   status is ST, as -s shows it, and store its width into *WIDTH if
+   WIDTH is non-null.  */
+
+static char const *
+human_blocks (struct stat const *st, int *width)
+{
+  return human_readable_memo (block_size_memo, ST_NBLOCKS (*st),
+                              human_output_opts, ST_NBLOCKSIZE,
+                              output_block_size, width);
+}
+
+/* Likewise, for the size of the file, as -l shows it.  */
+
+static char const *
+human_size (struct stat const *st, int *width)
+{
+  return human_readable_memo (file_size_memo,
+                              unsigned_file_size (st->st_size),
+                              file_human_output_opts, 1,
+                              file_output_block_size, width);
+}
+
+#ifdef HAVE_CAP
+/* Return true if NAME has a capability (see linux/capability.h) */
+static bool
+has_capability (char const *name)
+{
+  char *result;
+  bool has_cap;
+
+  cap_t cap_d = cap_get_file (name);
+  if (cap_d == NULL)
+    return false;
+
+  result = cap_to_text (cap_d, NULL);
+  cap_free (cap_d);
+  if (!result)
+    return false;
+
+  /* check if human-readable capability string is empty */
+  has_cap = !!*result;
+
+  cap_free (result);
+  return has_cap;
+}
+#else
+static bool
+has_capability (char const *name _GL_UNUSED)
+{
   errno = ENOTSUP;
   return false;
 }
@@ -2782,11 +3706,7 @@ errno_unsupported (int err)
 static int
 getfilecon_cache (char const *file, struct fileinfo *f, bool deref)
 {
-  /* st_dev of the most recently processed device for which we've
-     found that [l]getfilecon fails indicating lack of support.  */
-  static dev_t unsupported_device;
-
-  if (f->stat.st_dev == unsupported_device)
+  if (fs_probe_unsupported (f->stat.st_dev, FS_PROBE_SECURITY_CONTEXT))
     {
       errno = ENOTSUP;
       return -1;
@@ -2802,7 +3722,7 @@ getfilecon_cache (char const *file, struct fileinfo *f, bool deref)
          ? getfilecon (file, &f->scontext)
          : lgetfilecon (file, &f->scontext));
   if (r < 0 && errno_unsupported (errno))
-    unsupported_device = f->stat.st_dev;
+    fs_probe_set_unsupported (f->stat.st_dev, FS_PROBE_SECURITY_CONTEXT);
   return r;
 }
 
@@ -2812,11 +3732,7 @@ getfilecon_cache (char const *file, struct fileinfo *f, bool deref)
 static int
 file_has_acl_cache (char const *file, struct fileinfo *f)
 {
-  /* st_dev of the most recently processed device for which we've
-     found that file_has_acl fails indicating lack of support.  */
-  static dev_t unsupported_device;
-
-  if (f->stat.st_dev == unsupported_device)
+  if (fs_probe_unsupported (f->stat.st_dev, FS_PROBE_ACL))
     {
       errno = ENOTSUP;
       return 0;
@@ -2827,7 +3743,7 @@ file_has_acl_cache (char const *file, struct fileinfo *f)
   errno = 0;
   int n = file_has_acl (file, &f->stat);
   if (n <= 0 && errno_unsupported (errno))
-    unsupported_device = f->stat.st_dev;
+    fs_probe_set_unsupported (f->stat.st_dev, FS_PROBE_ACL);
   return n;
 }
 
@@ -2837,11 +3753,7 @@ file_has_acl_cache (char const *file, struct fileinfo *f)
 static bool
 has_capability_cache (char const *file, struct fileinfo *f)
 {
-  /* st_dev of the most recently processed device for which we've
-     found that has_capability fails indicating lack of support.  */
-  static dev_t unsupported_device;
-
-  if (f->stat.st_dev == unsupported_device)
+  if (fs_probe_unsupported (f->stat.st_dev, FS_PROBE_CAPABILITY))
     {
       errno = ENOTSUP;
       return 0;
@@ -2849,7 +3761,7 @@ has_capability_cache (char const *file, struct fileinfo *f)
 
   bool b = has_capability (file);
   if ( !b && errno_unsupported (errno))
-    unsupported_device = f->stat.st_dev;
+    fs_probe_set_unsupported (f->stat.st_dev, FS_PROBE_CAPABILITY);
   return b;
 }
 
@@ -2862,12 +3774,60 @@ needs_quoting (char const* name)
   return *name != *test || strlen (name) != len;
 }
 
+/* Return true if gobble_file needs the status of a file of TYPE with
+   inode number INODE (NOT_AN_INODE_NUMBER if unknown), which is a
+   command line argument if COMMAND_LINE_ARG.  */
+static bool
+file_needs_stat (enum filetype type, ino_t inode, bool command_line_arg)
+{
+  return (command_line_arg
+          || print_hyperlink
+          || format_needs_stat
+          /* When coloring a directory (we may know the type from
+             direct.d_type), we have to stat it in order to indicate
+             sticky and/or other-writable attributes.  */
+          || (type == directory && print_with_color
+              && (is_colored (C_OTHER_WRITABLE)
+                  || is_colored (C_STICKY)
+                  || is_colored (C_STICKY_OTHER_WRITABLE)))
+          /* When dereferencing symlinks, the inode and type must come from
+             stat, but readdir provides the inode and type of lstat.  */
+          || ((print_inode || format_needs_type)
+              && (type == symbolic_link || type == unknown)
+              && (dereference == DEREF_ALWAYS
+                  || color_symlink_as_referent || check_symlink_mode))
+          /* Command line dereferences are already taken care of by the above
+             assertion that the inode number is not yet known.  */
+          || (print_inode && inode == NOT_AN_INODE_NUMBER)
+          || (format_needs_type
+              && (type == unknown || command_line_arg
+                  /* --indicator-style=classify (aka -F)
+                     requires that we stat each regular file
+                     to see if it's executable.  */
+                  || (type == normal && (indicator_style == classify
+                                         /* This is so that --color ends up
+                                            highlighting files with these
+                                            mode bits set even when options
+                                            like -F are not specified.  Note
+                                            we do a redundant stat in the
+                                            very unlikely case where C_CAP
+                                            is set but not the others. */
+                                         || (print_with_color
+                                             && (is_colored (C_EXEC)
+                                                 || is_colored (C_SETUID)
+                                                 || is_colored (C_SETGID)
+                                                 || is_colored (C_CAP)))
+                                         )))));
+}
+
 /* Add a file to the current table of files.
    Verify that the file exists, and print an error message if it does not.
+   If ENT is not null, it is the file's entry read ahead by print_dir.
    Return the number of blocks that the file occupies.  */
 static uintmax_t
 gobble_file (char const *name, enum filetype type, ino_t inode,
-             bool command_line_arg, char const *dirname)
+             bool command_line_arg, char const *dirname,
+             struct dir_entry const *ent)
 {
   uintmax_t blocks = 0;
   struct fileinfo *f;
@@ -2896,44 +3856,7 @@ gobble_file (char const *name, enum filetype type, ino_t inode,
         cwd_some_quoted = 1;
     }
 
-  if (command_line_arg
-      || print_hyperlink
-      || format_needs_stat
-      /* When coloring a directory (we may know the type from
-         direct.d_type), we have to stat it in order to indicate
-         sticky and/or other-writable attributes.  */
-      || (type == directory && print_with_color
-          && (is_colored (C_OTHER_WRITABLE)
-              || is_colored (C_STICKY)
-              || is_colored (C_STICKY_OTHER_WRITABLE)))
-      /* When dereferencing symlinks, the inode and type must come from
-         stat, but readdir provides the inode and type of lstat.  */
-      || ((print_inode || format_needs_type)
-          && (type == symbolic_link || type == unknown)
-          && (dereference == DEREF_ALWAYS
-              || color_symlink_as_referent || check_symlink_mode))
-      /* Command line dereferences are already taken care of by the above
-         assertion that the inode number is not yet known.  */
-      || (print_inode && inode == NOT_AN_INODE_NUMBER)
-      || (format_needs_type
-          && (type == unknown || command_line_arg
-              /* --indicator-style=classify (aka -F)
-                 requires that we stat each regular file
-                 to see if it's executable.  */
-              || (type == normal && (indicator_style == classify
-                                     /* This is so that --color ends up
-                                        highlighting files with these mode
-                                        bits set even when options like -F are
-                                        not specified.  Note we do a redundant
-                                        stat in the very unlikely case where
-                                        C_CAP is set but not the others. */
-                                     || (print_with_color
-                                         && (is_colored (C_EXEC)
-                                             || is_colored (C_SETUID)
-                                             || is_colored (C_SETGID)
-                                             || is_colored (C_CAP)))
-                                     )))))
-
+  if (file_needs_stat (type, inode, command_line_arg))
     {
       /* Absolute name of this file.  */
       char *full_name;
@@ -2957,42 +3880,53 @@ gobble_file (char const *name, enum filetype type, ino_t inode,
                           _("error canonicalizing %s"), full_name);
         }
 
-      switch (dereference)
+      if (ent && ent->statted)
         {
-        case DEREF_ALWAYS:
-          err = do_stat (full_name, &f->stat);
-          do_deref = true;
-          break;
+          /* The file has already been stat'ed, by a --parallel thread
+             or in a batch.  */
+          if (ent->stat_errno == 0)
+            f->stat = ent->stat;
+          errno = ent->stat_errno;
+          err = - (ent->stat_errno != 0);
+          do_deref = dereference == DEREF_ALWAYS;
+        }
+      else
+        switch (dereference)
+          {
+          case DEREF_ALWAYS:
+            err = do_stat (full_name, &f->stat);
+            do_deref = true;
+            break;
 
-        case DEREF_COMMAND_LINE_ARGUMENTS:
-        case DEREF_COMMAND_LINE_SYMLINK_TO_DIR:
-          if (command_line_arg)
-            {
-              bool need_lstat;
-              err = do_stat (full_name, &f->stat);
-              do_deref = true;
-
-              if (dereference == DEREF_COMMAND_LINE_ARGUMENTS)
-                break;
-
-              need_lstat = (err < 0
-                            ? errno == ENOENT
-                            : ! S_ISDIR (f->stat.st_mode));
-              if (!need_lstat)
-                break;
-
-              /* stat failed because of ENOENT, maybe indicating a dangling
-                 symlink.  Or stat succeeded, FULL_NAME does not refer to a
-                 directory, and --dereference-command-line-symlink-to-dir is
-                 in effect.  Fall through so that we call lstat instead.  */
-            }
-          FALLTHROUGH;
+          case DEREF_COMMAND_LINE_ARGUMENTS:
+          case DEREF_COMMAND_LINE_SYMLINK_TO_DIR:
+            if (command_line_arg)
+              {
+                bool need_lstat;
+                err = do_stat (full_name, &f->stat);
+                do_deref = true;
 
-        default: /* DEREF_NEVER */
-          err = do_lstat (full_name, &f->stat);
-          do_deref = false;
-          break;
-        }
+                if (dereference == DEREF_COMMAND_LINE_ARGUMENTS)
+                  break;
+
+                need_lstat = (err < 0
+                              ? errno == ENOENT
+                              : ! S_ISDIR (f->stat.st_mode));
+                if (!need_lstat)
+                  break;
+
+                /* stat failed because of ENOENT, maybe indicating a dangling
+                   symlink.  Or stat succeeded, FULL_NAME does not refer to a
+                   directory, and --dereference-command-line-symlink-to-dir is
+                   in effect.  Fall through so that we call lstat instead.  */
+              }
+            FALLTHROUGH;
+
+          default: /* DEREF_NEVER */
+            err = do_lstat (full_name, &f->stat);
+            do_deref = false;
+            break;
+          }
 
       if (err != 0)
         {
@@ -3104,10 +4038,8 @@ gobble_file (char const *name, enum filetype type, ino_t inode,
       blocks = ST_NBLOCKS (f->stat);
       if (format == long_format || print_block_size)
         {
-          char buf[LONGEST_HUMAN_READABLE + 1];
-          int len = mbswidth (human_readable (blocks, buf, human_output_opts,
-                                              ST_NBLOCKSIZE, output_block_size),
-                              0);
+          int len;
+          human_blocks (&f->stat, &len);
           if (block_size_width < len)
             block_size_width = len;
         }
@@ -3165,12 +4097,8 @@ gobble_file (char const *name, enum filetype type, ino_t inode,
             }
           else
             {
-              char buf[LONGEST_HUMAN_READABLE + 1];
-              uintmax_t size = unsigned_file_size (f->stat.st_size);
-              int len = mbswidth (human_readable (size, buf,
-                                                  file_human_output_opts,
-                                                  1, file_output_block_size),
-                                  0);
+              int len;
+              human_size (&f->stat, &len);
               if (file_size_width < len)
                 file_size_width = len;
             }
@@ -3514,57 +4442,312 @@ static int rev_xstrcoll_df_version (V a, V b)
    array below is defined by the order of the elements in the time_type and
    sort_type enums!  */
 
-#define LIST_SORTFUNCTION_VARIANTS(key_name)                        \
-  {                                                                 \
-    {                                                               \
-      { xstrcoll_##key_name, xstrcoll_df_##key_name },              \
-      { rev_xstrcoll_##key_name, rev_xstrcoll_df_##key_name },      \
-    },                                                              \
-    {                                                               \
-      { strcmp_##key_name, strcmp_df_##key_name },                  \
-      { rev_strcmp_##key_name, rev_strcmp_df_##key_name },          \
-    }                                                               \
-  }
+#define LIST_SORTFUNCTION_VARIANTS(key_name)                        \
+  {                                                                 \
+    {                                                               \
+      { xstrcoll_##key_name, xstrcoll_df_##key_name },              \
+      { rev_xstrcoll_##key_name, rev_xstrcoll_df_##key_name },      \
+    },                                                              \
+    {                                                               \
+      { strcmp_##key_name, strcmp_df_##key_name },                  \
+      { rev_strcmp_##key_name, rev_strcmp_df_##key_name },          \
+    }                                                               \
+  }
+
+static qsortFunc const sort_functions[][2][2][2] =
+  {
+    LIST_SORTFUNCTION_VARIANTS (name),
+    LIST_SORTFUNCTION_VARIANTS (extension),
+    LIST_SORTFUNCTION_VARIANTS (width),
+    LIST_SORTFUNCTION_VARIANTS (size),
+
+    {
+      {
+        { xstrcoll_version, xstrcoll_df_version },
+        { rev_xstrcoll_version, rev_xstrcoll_df_version },
+      },
+
+      /* We use NULL for the strcmp variants of version comparison
+         since as explained in cmp_version definition, version comparison
+         does not rely on xstrcoll, so it will never longjmp, and never
+         need to try the strcmp fallback. */
+      {
+        { NULL, NULL },
+        { NULL, NULL },
+      }
+    },
+
+    /* last are time sort functions */
+    LIST_SORTFUNCTION_VARIANTS (mtime),
+    LIST_SORTFUNCTION_VARIANTS (ctime),
+    LIST_SORTFUNCTION_VARIANTS (atime),
+    LIST_SORTFUNCTION_VARIANTS (btime)
+  };
+
+/* The number of sort keys is calculated as the sum of
+     the number of elements in the sort_type enum (i.e., sort_numtypes)
+     the number of elements in the time_type enum (i.e., time_numtypes) - 1
+   This is because when sort_type==sort_time, we have up to
+   time_numtypes possible sort keys.
+   This line verifies at compile-time that the array of sort functions has been
+   initialized for all possible sort keys. */
+verify (ARRAY_CARDINALITY (sort_functions)
+        == sort_numtypes + time_numtypes - 1 );
+
+/* The keys of a file to sort it by, extracted from its fileinfo so
+   that sorting many files compares compact keys in one array rather
+   than chasing pointers and collating names.  NAME and EXT are the
+   offsets in sort_key_text of the collation keys of the file's name
+   and extension, and PREFIX is the first bytes of the former, most
+   significant first.  NUM and NUM_NS are the size, time or width to
+   sort by, complemented when larger ones come first.  DIR is true
+   for a directory listed first.  */
+
+struct sort_key
+{
+  uint_least64_t prefix;
+  intmax_t num;
+  int num_ns;
+  bool dir;
+  size_t name;
+  size_t ext;
+  struct fileinfo *f;
+};
+
+/* The collation keys of the files being sorted.  */
+static char *sort_key_text;
+static size_t sort_key_text_alloc;
+static size_t sort_key_text_used;
+
+/* The keys of the files being sorted, followed by as much room to
+   merge them in.  */
+static struct sort_key *sort_keys;
+static size_t sort_keys_alloc;
+
+/* The function to compare the keys of two files by, apart from
+   --group-directories-first and --reverse.  */
+static int (*sort_key_cmp) (struct sort_key const *, struct sort_key const *);
+
+/* Append to sort_key_text the key that collates like S if COLLATE,
+   and S itself otherwise, and return its offset.  Return SIZE_MAX if
+   strxfrm fails.  */
+
+static size_t
+add_collation_key (char const *s, bool collate)
+{
+  size_t off = sort_key_text_used;
+
+  while (true)
+    {
+      size_t avail = sort_key_text_alloc - off;
+      size_t len;
+      if (collate)
+        {
+          errno = 0;
+          len = strxfrm (sort_key_text + off, s, avail);
+          if (errno)
+            return SIZE_MAX;
+        }
+      else
+        {
+          len = strlen (s);
+          if (len < avail)
+            memcpy (sort_key_text + off, s, len + 1);
+        }
+
+      if (len < avail)
+        {
+          sort_key_text_used = off + len + 1;
+          return off;
+        }
+
+      sort_key_text_alloc = MAX (2 * sort_key_text_alloc, off + len + 1);
+      sort_key_text = xrealloc (sort_key_text, sort_key_text_alloc);
+    }
+}
+
+/* Compare the names of the files of keys A and B.  */
+
+static inline int
+cmp_key_names (struct sort_key const *a, struct sort_key const *b)
+{
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+
+  /* The prefixes end with a null byte if the keys are that short.  */
+  if (! (a->prefix & UCHAR_MAX))
+    return 0;
+  size_t skip = sizeof a->prefix;
+  return strcmp (sort_key_text + a->name + skip,
+                 sort_key_text + b->name + skip);
+}
+
+static int
+cmp_key_name (struct sort_key const *a, struct sort_key const *b)
+{
+  return cmp_key_names (a, b);
+}
+
+static int
+cmp_key_extension (struct sort_key const *a, struct sort_key const *b)
+{
+  int diff = strcmp (sort_key_text + a->ext, sort_key_text + b->ext);
+  return diff ? diff : cmp_key_names (a, b);
+}
+
+static int
+cmp_key_num (struct sort_key const *a, struct sort_key const *b)
+{
+  int diff = longdiff (a->num, b->num);
+  if (! diff)
+    diff = longdiff (a->num_ns, b->num_ns);
+  return diff ? diff : cmp_key_names (a, b);
+}
+
+static inline int
+compare_sort_keys (struct sort_key const *a, struct sort_key const *b)
+{
+  if (a->dir != b->dir)
+    return a->dir ? -1 : 1;
+  return sort_reverse ? sort_key_cmp (b, a) : sort_key_cmp (a, b);
+}
+
+/* Sort the N keys of KEYS stably, as mpsort would, using TMP with
+   room for N / 2 keys.  */
+
+static void
+merge_sort_keys (struct sort_key *keys, size_t n, struct sort_key *tmp)
+{
+  if (n <= 8)
+    {
+      for (size_t i = 1; i < n; i++)
+        {
+          struct sort_key key = keys[i];
+          size_t j = i;
+          for (; j && 0 < compare_sort_keys (&keys[j - 1], &key); j--)
+            keys[j] = keys[j - 1];
+          keys[j] = key;
+        }
+      return;
+    }
+
+  size_t nlo = n / 2;
+  merge_sort_keys (keys, nlo, tmp);
+  merge_sort_keys (keys + nlo, n - nlo, tmp);
+  if (compare_sort_keys (&keys[nlo - 1], &keys[nlo]) <= 0)
+    return;
+
+  /* Merge the lower half, moved out of the way, with the upper half,
+     which stays ahead of the merged keys.  */
+  memcpy (tmp, keys, nlo * sizeof *keys);
+  struct sort_key *lo = tmp;
+  struct sort_key *lolim = tmp + nlo;
+  struct sort_key *hi = keys + nlo;
+  struct sort_key *hilim = keys + n;
+  struct sort_key *out = keys;
+  while (lo < lolim && hi < hilim)
+    *out++ = compare_sort_keys (lo, hi) <= 0 ? *lo++ : *hi++;
+  memcpy (out, lo, (lolim - lo) * sizeof *lo);
+}
+
+/* Sort the files in SORTED_FILE by extracting their keys first, and
+   return true; or return false if the keys cannot be extracted, when
+   the files must be sorted by comparing their fileinfo.  */
+
+static bool
+sort_files_by_keys (void)
+{
+  bool collate = hard_LC_COLLATE;
+  struct timespec (*get_time) (struct stat const *) = NULL;
+
+  switch (sort_type)
+    {
+    case sort_name:
+      sort_key_cmp = cmp_key_name;
+      break;
+    case sort_extension:
+      sort_key_cmp = cmp_key_extension;
+      break;
+    case sort_width:
+    case sort_size:
+      sort_key_cmp = cmp_key_num;
+      break;
+    case sort_time:
+      sort_key_cmp = cmp_key_num;
+      switch (time_type)
+        {
+        case time_ctime: get_time = get_stat_ctime; break;
+        case time_mtime: get_time = get_stat_mtime; break;
+        case time_atime: get_time = get_stat_atime; break;
+        case time_btime: get_time = get_stat_btime; break;
+        default: abort ();
+        }
+      break;
+    default:
+      return false;
+    }
 
-static qsortFunc const sort_functions[][2][2][2] =
-  {
-    LIST_SORTFUNCTION_VARIANTS (name),
-    LIST_SORTFUNCTION_VARIANTS (extension),
-    LIST_SORTFUNCTION_VARIANTS (width),
-    LIST_SORTFUNCTION_VARIANTS (size),
+  if (sort_keys_alloc < cwd_n_used + cwd_n_used / 2)
+    {
+      free (sort_keys);
+      sort_keys = xnmalloc (cwd_n_used, 3 * sizeof *sort_keys);
+      sort_keys_alloc = 3 * cwd_n_used;
+    }
 
+  sort_key_text_used = 0;
+  for (size_t i = 0; i < cwd_n_used; i++)
     {
-      {
-        { xstrcoll_version, xstrcoll_df_version },
-        { rev_xstrcoll_version, rev_xstrcoll_df_version },
-      },
+      struct fileinfo *f = sorted_file[i];
+      struct sort_key *key = &sort_keys[i];
+      key->f = f;
+      key->dir = directories_first && is_linked_directory (f);
+      key->num = 0;
+      key->num_ns = 0;
+
+      key->name = add_collation_key (f->name, collate);
+      if (key->name == SIZE_MAX)
+        return false;
+      if (sort_type == sort_extension)
+        {
+          char const *ext = strrchr (f->name, '.');
+          key->ext = add_collation_key (ext ? ext : "", collate);
+          if (key->ext == SIZE_MAX)
+            return false;
+        }
 
-      /* We use NULL for the strcmp variants of version comparison
-         since as explained in cmp_version definition, version comparison
-         does not rely on xstrcoll, so it will never longjmp, and never
-         need to try the strcmp fallback. */
-      {
-        { NULL, NULL },
-        { NULL, NULL },
-      }
-    },
+      if (sort_type == sort_width)
+        key->num = fileinfo_name_width (f);
+      else if (sort_type == sort_size)
+        key->num = ~ (intmax_t) f->stat.st_size;
+      else if (get_time)
+        {
+          struct timespec t = get_time (&f->stat);
+          key->num = ~ (intmax_t) t.tv_sec;
+          key->num_ns = ~ t.tv_nsec;
+        }
+    }
 
-    /* last are time sort functions */
-    LIST_SORTFUNCTION_VARIANTS (mtime),
-    LIST_SORTFUNCTION_VARIANTS (ctime),
-    LIST_SORTFUNCTION_VARIANTS (atime),
-    LIST_SORTFUNCTION_VARIANTS (btime)
-  };
+  /* Compute the prefixes now that sort_key_text will not move.  */
+  for (size_t i = 0; i < cwd_n_used; i++)
+    {
+      struct sort_key *key = &sort_keys[i];
+      char const *p = sort_key_text + key->name;
+      uint_least64_t prefix = 0;
+      for (size_t j = 0; j < sizeof prefix; j++)
+        {
+          prefix <<= CHAR_BIT;
+          if (*p)
+            prefix |= to_uchar (*p++);
+        }
+      key->prefix = prefix;
+    }
 
-/* The number of sort keys is calculated as the sum of
-     the number of elements in the sort_type enum (i.e., sort_numtypes)
-     the number of elements in the time_type enum (i.e., time_numtypes) - 1
-   This is because when sort_type==sort_time, we have up to
-   time_numtypes possible sort keys.
-   This line verifies at compile-time that the array of sort functions has been
-   initialized for all possible sort keys. */
-verify (ARRAY_CARDINALITY (sort_functions)
-        == sort_numtypes + time_numtypes - 1 );
+  merge_sort_keys (sort_keys, cwd_n_used, sort_keys + cwd_n_used);
+
+  for (size_t i = 0; i < cwd_n_used; i++)
+    sorted_file[i] = sort_keys[i].f;
+  return true;
+}
 
 /* Set up SORTED_FILE to point to the in-use entries in CWD_FILE, in order.  */
 
@@ -3614,6 +4797,9 @@ sort_files (void)
   if (sort_type == sort_none)
     return;
 
+  if (1 < cwd_n_used && sort_files_by_keys ())
+    return;
+
   /* Try strcoll.  If it fails, fall back on strcmp.  We can't safely
      ignore strcoll failures, as a failing strcoll might be a
      comparison function that is not a total order, and if we ignored
@@ -3675,8 +4861,12 @@ print_current_files (void)
         {
           set_normal_color ();
           print_long_format (sorted_file[i]);
-          DIRED_PUTCHAR ('\n');
+
+          /* Colors are written directly, so keep rows in step.  */
+          if (print_with_color || ROW_BATCH_SIZE <= row_len)
+            flush_rows ();
         }
+      flush_rows ();
       break;
     }
 }
@@ -3737,26 +4927,27 @@ long_time_expected_width (void)
 static void
 format_user_or_group (char const *name, unsigned long int id, int width)
 {
-  size_t len;
-
   if (name)
     {
       int width_gap = width - mbswidth (name, 0);
       int pad = MAX (0, width_gap);
-      fputs (name, stdout);
-      len = strlen (name) + pad;
+      append_row (name, strlen (name));
 
       do
-        putchar (' ');
+        append_row (" ", 1);
       while (pad--);
     }
   else
     {
-      printf ("%*lu ", width, id);
-      len = width;
-    }
+      char buf[INT_BUFSIZE_BOUND (id)];
+      char const *p = umaxtostr (id, buf);
+      int len = strlen (p);
 
-  dired_pos += len + 1;
+      for (; len < width; width--)
+        append_row (" ", 1);
+      append_row (p, len);
+      append_row (" ", 1);
+    }
 }
 
 /* Print the name or id of the user with id U, using a print width of
@@ -3766,7 +4957,8 @@ static void
 format_user (uid_t u, int width, bool stat_ok)
 {
   format_user_or_group (! stat_ok ? "?" :
-                        (numeric_ids ? NULL : getuser (u)), u, width);
+                        (numeric_ids ? NULL : lookup_user_name (u)),
+                        u, width);
 }
 
 /* Likewise, for groups.  */
@@ -3775,7 +4967,8 @@ static void
 format_group (gid_t g, int width, bool stat_ok)
 {
   format_user_or_group (! stat_ok ? "?" :
-                        (numeric_ids ? NULL : getgroup (g)), g, width);
+                        (numeric_ids ? NULL : lookup_group_name (g)),
+                        g, width);
 }
 
 /* Return the number of columns that format_user_or_group will print.  */
@@ -3801,7 +4994,8 @@ format_user_or_group_width (char const *name, unsigned long int id)
 static int
 format_user_width (uid_t u)
 {
-  return format_user_or_group_width (numeric_ids ? NULL : getuser (u), u);
+  return format_user_or_group_width (numeric_ids ? NULL
+                                     : lookup_user_name (u), u);
 }
 
 /* Likewise, for groups.  */
@@ -3809,7 +5003,8 @@ format_user_width (uid_t u)
 static int
 format_group_width (gid_t g)
 {
-  return format_user_or_group_width (numeric_ids ? NULL : getgroup (g), g);
+  return format_user_or_group_width (numeric_ids ? NULL
+                                     : lookup_group_name (g), g);
 }
 
 /* Return a pointer to a formatted version of F->stat.st_ino,
@@ -3824,6 +5019,222 @@ format_inode (char *buf, size_t buflen, const struct fileinfo *f)
           : (char *) "?");
 }
 
+/* The long-format timestamps most recently formatted, for reuse by
+   files whose times fall in the same minute, or the same day if the
+   format shows nothing finer.  Each remembers the range of times that
+   it stands for, which is checked with localtime_rz the first time it
+   is reused, as a change of UTC offset could end the minute or day
+   early.  time_memo[RECENT] holds those formatted for recentness
+   RECENT.  */
+enum { TIME_MEMO_SIZE = 16, TIME_MEMO_TEXT_SIZE = 64 };
+enum time_memo_state { TIME_MEMO_EMPTY, TIME_MEMO_UNCHECKED, TIME_MEMO_OK };
+struct time_memo
+  {
+    enum time_memo_state state;
+    time_t lo;
+    time_t hi;
+    struct tm tm;
+    size_t len;
+    char text[TIME_MEMO_TEXT_SIZE];
+  };
+static struct time_memo time_memo[2][TIME_MEMO_SIZE];
+
+/* Return the number of seconds within which all times look the same
+   when formatted with FMT: 60 if it shows nothing finer than minutes,
+   24 * 60 * 60 if nothing finer than days, and 0 if it shows seconds,
+   the time zone, or anything not known to be coarser.  */
+
+static int
+time_format_granularity (char const *fmt)
+{
+  int granularity = 24 * 60 * 60;
+
+  for (char const *p = fmt; (p = strchr (p, '%')); p++)
+    {
+      p++;
+      p += strspn (p, "_-0^#");
+      p += strspn (p, "0123456789");
+      p += strspn (p, "EO");
+      if (*p && strchr ("%aAbBCdDeFgGhjmnqtuUVwWyY", *p))
+        continue;
+      if (*p && strchr ("HIklMpPR", *p))
+        granularity = 60;
+      else
+        return 0;
+    }
+
+  return granularity;
+}
+
+/* Return the granularity of the long-format timestamps with
+   recentness RECENT.  */
+
+static int
+time_memo_granularity (bool recent)
+{
+  static int granularity[2] = { -1, -1 };
+  if (granularity[recent] < 0)
+    granularity[recent] = time_format_granularity (long_time_format[recent]);
+  return granularity[recent];
+}
+
+/* Return true if the broken-down times A and B fall in the same period
+   of GRANULARITY seconds, with the same daylight saving time and, where
+   it is known, the same UTC offset.  */
+
+static bool
+same_time_period (struct tm const *a, struct tm const *b, int granularity)
+{
+  return (a->tm_year == b->tm_year && a->tm_yday == b->tm_yday
+          && a->tm_isdst == b->tm_isdst
+#if HAVE_TM_GMTOFF
+          && a->tm_gmtoff == b->tm_gmtoff
+#endif
+          && (granularity != 60
+              || (a->tm_hour == b->tm_hour && a->tm_min == b->tm_min)));
+}
+
+/* Return the number of the period of GRANULARITY seconds of UTC that
+   contains T, modulo TIME_MEMO_SIZE, which is where time_memo keeps
+   the periods that start in it.  */
+
+static int
+time_memo_index (time_t t, int granularity)
+{
+  uintmax_t period = t / granularity - (t % granularity < 0);
+  return period % TIME_MEMO_SIZE;
+}
+
+/* Return the memo of the formatted timestamp for the time T with
+   recentness RECENT, or NULL if there is none.  */
+
+static struct time_memo *
+find_time_memo (time_t t, bool recent)
+{
+  int granularity = time_memo_granularity (recent);
+  if (! granularity)
+    return NULL;
+
+  /* A period starts in the same UTC period as T, or the one before.  */
+  int index = time_memo_index (t, granularity);
+  for (int i = 0; i < 2; i++)
+    {
+      struct time_memo *m
+        = &time_memo[recent][(index - i) & (TIME_MEMO_SIZE - 1)];
+      if (m->state != TIME_MEMO_EMPTY && m->lo <= t && t <= m->hi)
+        {
+          if (m->state == TIME_MEMO_UNCHECKED)
+            {
+              struct tm lo_tm, hi_tm;
+              if (! (localtime_rz (localtz, &m->lo, &lo_tm)
+                     && localtime_rz (localtz, &m->hi, &hi_tm)
+                     && same_time_period (&lo_tm, &m->tm, granularity)
+                     && same_time_period (&hi_tm, &m->tm, granularity)))
+                {
+                  m->state = TIME_MEMO_EMPTY;
+                  continue;
+                }
+              m->state = TIME_MEMO_OK;
+            }
+          return m;
+        }
+    }
+
+  return NULL;
+}
+
+/* Remember that the time T, whose local time is TM, with recentness
+   RECENT formats as the LEN bytes of TEXT.  */
+
+static void
+remember_time (time_t t, bool recent, struct tm const *tm,
+               char const *text, size_t len)
+{
+  int granularity = time_memo_granularity (recent);
+  if (! granularity || ! (len < TIME_MEMO_TEXT_SIZE))
+    return;
+
+  /* The start of the period is OFFSET seconds before T, if the UTC
+     offset does not change in between; find_time_memo checks that.
+     A leap second makes OFFSET too large.  */
+  int offset = (tm->tm_sec
+                + (granularity == 60 ? 0
+                   : 60 * (tm->tm_min + 60 * tm->tm_hour)));
+  if (! (offset < granularity)
+      || t < TYPE_MINIMUM (time_t) + offset
+      || TYPE_MAXIMUM (time_t) - (granularity - 1) < t - offset)
+    return;
+
+  time_t lo = t - offset;
+  struct time_memo *m = &time_memo[recent][time_memo_index (lo, granularity)];
+  m->state = TIME_MEMO_UNCHECKED;
+  m->lo = lo;
+  m->hi = lo + (granularity - 1);
+  m->tm = *tm;
+  m->len = len;
+  memcpy (m->text, text, len);
+}
+
+/* Return true if the time WHEN is recent, that is, within the past six
+   months.  */
+
+static bool
+recent_time (struct timespec when)
+{
+  /* A Gregorian year has 365.2425 * 24 * 60 * 60 == 31556952 seconds
+     on the average.  Write this value as an integer constant to
+     avoid floating point hassles.  */
+  struct timespec six_months_ago;
+  six_months_ago.tv_sec = current_time.tv_sec - 31556952 / 2;
+  six_months_ago.tv_nsec = current_time.tv_nsec;
+
+  return (timespec_cmp (six_months_ago, when) < 0
+          && (timespec_cmp (when, current_time) < 0));
+}
+
+/* Store into BUF, of size TIME_STAMP_LEN_MAXIMUM + 1, the long-format
+   timestamp of the time WHEN, and return its length as align_nstrftime
+   does.  Return 0 without storing anything if WHEN cannot be converted
+   to local time.  */
+
+static size_t
+format_long_time (char *buf, struct timespec when)
+{
+  struct tm tm;
+  size_t s;
+
+  /* If the file appears to be in the future, update the current
+     time, in case the file happens to have been modified since
+     the last time we checked the clock.  */
+  if (timespec_cmp (current_time, when) < 0)
+    {
+      if (! localtime_rz (localtz, &when.tv_sec, &tm))
+        return 0;
+      gettime (&current_time);
+      return align_nstrftime (buf, TIME_STAMP_LEN_MAXIMUM + 1,
+                              recent_time (when), &tm, localtz, when.tv_nsec);
+    }
+
+  bool recent = recent_time (when);
+  struct time_memo const *m = find_time_memo (when.tv_sec, recent);
+  if (m)
+    {
+      memcpy (buf, m->text, m->len);
+      return m->len;
+    }
+
+  if (! localtime_rz (localtz, &when.tv_sec, &tm))
+    return 0;
+
+  /* We assume here that all time zones are offset from UTC by a
+     whole number of seconds.  */
+  s = align_nstrftime (buf, TIME_STAMP_LEN_MAXIMUM + 1, recent,
+                       &tm, localtz, when.tv_nsec);
+  if (s)
+    remember_time (when.tv_sec, recent, &tm, buf, s);
+  return s;
+}
+
 /* Print information about F in long format.  */
 static void
 print_long_format (const struct fileinfo *f)
@@ -3841,7 +5252,6 @@ print_long_format (const struct fileinfo *f)
   size_t s;
   char *p;
   struct timespec when_timespec;
-  struct tm when_local;
   bool btime_ok = true;
 
   /* Compute the mode string, except remove the trailing space if no
@@ -3895,14 +5305,11 @@ print_long_format (const struct fileinfo *f)
 
   if (print_block_size)
     {
-      char hbuf[LONGEST_HUMAN_READABLE + 1];
-      char const *blocks =
-        (! f->stat_ok
-         ? "?"
-         : human_readable (ST_NBLOCKS (f->stat), hbuf, human_output_opts,
-                           ST_NBLOCKSIZE, output_block_size));
+      int width = 1;
+      char const *blocks = (! f->stat_ok ? "?"
+                            : human_blocks (&f->stat, &width));
       int pad;
-      for (pad = block_size_width - mbswidth (blocks, 0); 0 < pad; pad--)
+      for (pad = block_size_width - width; 0 < pad; pad--)
         *p++ = ' ';
       while ((*p++ = *blocks++))
         continue;
@@ -3921,11 +5328,12 @@ print_long_format (const struct fileinfo *f)
      The latter is wrong when nlink_width is zero.  */
   p += strlen (p);
 
-  DIRED_INDENT ();
+  if (dired)
+    append_row ("  ", 2);
 
   if (print_owner || print_group || print_author || print_scontext)
     {
-      DIRED_FPUTS (buf, stdout, p - buf);
+      append_row (buf, p - buf);
 
       if (print_owner)
         format_user (f->stat.st_uid, owner_width, f->stat_ok);
@@ -3959,15 +5367,11 @@ print_long_format (const struct fileinfo *f)
     }
   else
     {
-      char hbuf[LONGEST_HUMAN_READABLE + 1];
-      char const *size =
-        (! f->stat_ok
-         ? "?"
-         : human_readable (unsigned_file_size (f->stat.st_size),
-                           hbuf, file_human_output_opts, 1,
-                           file_output_block_size));
+      int width = 1;
+      char const *size = (! f->stat_ok ? "?"
+                          : human_size (&f->stat, &width));
       int pad;
-      for (pad = file_size_width - mbswidth (size, 0); 0 < pad; pad--)
+      for (pad = file_size_width - width; 0 < pad; pad--)
         *p++ = ' ';
       while ((*p++ = *size++))
         continue;
@@ -3977,41 +5381,13 @@ print_long_format (const struct fileinfo *f)
   s = 0;
   *p = '\1';
 
-  if (f->stat_ok && btime_ok
-      && localtime_rz (localtz, &when_timespec.tv_sec, &when_local))
-    {
-      struct timespec six_months_ago;
-      bool recent;
-
-      /* If the file appears to be in the future, update the current
-         time, in case the file happens to have been modified since
-         the last time we checked the clock.  */
-      if (timespec_cmp (current_time, when_timespec) < 0)
-        gettime (&current_time);
-
-      /* Consider a time to be recent if it is within the past six months.
-         A Gregorian year has 365.2425 * 24 * 60 * 60 == 31556952 seconds
-         on the average.  Write this value as an integer constant to
-         avoid floating point hassles.  */
-      six_months_ago.tv_sec = current_time.tv_sec - 31556952 / 2;
-      six_months_ago.tv_nsec = current_time.tv_nsec;
-
-      recent = (timespec_cmp (six_months_ago, when_timespec) < 0
-                && (timespec_cmp (when_timespec, current_time) < 0));
-
-      /* We assume here that all time zones are offset from UTC by a
-         whole number of seconds.  */
-      s = align_nstrftime (p, TIME_STAMP_LEN_MAXIMUM + 1, recent,
-                           &when_local, localtz, when_timespec.tv_nsec);
-    }
+  if (f->stat_ok && btime_ok)
+    s = format_long_time (p, when_timespec);
 
   if (s || !*p)
     {
       p += s;
       *p++ = ' ';
-
-      /* NUL-terminate the string -- fputs (via DIRED_FPUTS) requires it.  */
-      *p = '\0';
     }
   else
     {
@@ -4026,21 +5402,23 @@ print_long_format (const struct fileinfo *f)
       p += strlen (p);
     }
 
-  DIRED_FPUTS (buf, stdout, p - buf);
-  size_t w = print_name_with_quoting (f, false, &dired_obstack, p - buf);
+  append_row (buf, p - buf);
+  size_t w = append_name_with_quoting (f, false, &dired_obstack, p - buf);
 
   if (f->filetype == symbolic_link)
     {
       if (f->linkname)
         {
-          DIRED_FPUTS_LITERAL (" -> ", stdout);
-          print_name_with_quoting (f, true, NULL, (p - buf) + w + 4);
+          append_row (" -> ", 4);
+          append_name_with_quoting (f, true, NULL, (p - buf) + w + 4);
           if (indicator_style != none)
-            print_type_indicator (true, f->linkmode, unknown);
+            append_type_indicator (true, f->linkmode, unknown);
         }
     }
   else if (indicator_style != none)
-    print_type_indicator (f->stat_ok, f->stat.st_mode, f->filetype);
+    append_type_indicator (f->stat_ok, f->stat.st_mode, f->filetype);
+
+  append_row ("\n", 1);
 }
 
 /* Write to *BUF a quoted representation of the file name NAME, if non-NULL,
@@ -4388,6 +5766,46 @@ print_name_with_quoting (const struct fileinfo *f,
   return len;
 }
 
+/* Like print_name_with_quoting, but add the name to the rows of the
+   long listing.  Names with color or a hyperlink are printed directly,
+   after the rows so far.  */
+
+static size_t
+append_name_with_quoting (const struct fileinfo *f, bool symlink_target,
+                          struct obstack *stack, size_t start_col)
+{
+  if (print_with_color || print_hyperlink)
+    {
+      flush_rows ();
+      return print_name_with_quoting (f, symlink_target, stack, start_col);
+    }
+
+  char const *name = symlink_target ? f->linkname : f->name;
+  char smallbuf[BUFSIZ];
+  char *buf = smallbuf;
+  bool pad;
+  size_t len = quote_name_buf (&buf, sizeof smallbuf, (char *) name,
+                               filename_quoting_options, f->quoted,
+                               NULL, &pad);
+
+  if (pad && !symlink_target)
+    append_row (" ", 1);
+
+  /* The name starts and ends at these dired positions.  */
+  size_t pos[2];
+  pos[0] = dired_pos;
+  append_row (buf, len);
+  pos[1] = dired_pos;
+  if (stack && dired)
+    obstack_grow (stack, pos, sizeof pos);
+
+  if (buf != smallbuf && buf != name)
+    free (buf);
+
+  process_signals ();
+  return len + pad;
+}
+
 static void
 prep_non_filename_text (void)
 {
@@ -4418,9 +5836,7 @@ print_file_name_and_frills (const struct fileinfo *f, size_t start_col)
 
   if (print_block_size)
     printf ("%*s ", format == with_commas ? 0 : block_size_width,
-            ! f->stat_ok ? "?"
-            : human_readable (ST_NBLOCKS (f->stat), buf, human_output_opts,
-                              ST_NBLOCKSIZE, output_block_size));
+            ! f->stat_ok ? "?" : human_blocks (&f->stat, NULL));
 
   if (print_scontext)
     printf ("%*s ", format == with_commas ? 0 : scontext_width, f->scontext);
@@ -4476,6 +5892,17 @@ print_type_indicator (bool stat_ok, mode_t mode, enum filetype type)
   return !!c;
 }
 
+/* Like print_type_indicator, but add the indicator to the rows of the
+   long listing.  */
+
+static void
+append_type_indicator (bool stat_ok, mode_t mode, enum filetype type)
+{
+  char c = get_type_indicator (stat_ok, mode, type);
+  if (c)
+    append_row (&c, 1);
+}
+
 /* Returns if color sequence was printed.  */
 static bool
 print_color_indicator (const struct bin_str *ind)
@@ -4638,10 +6065,7 @@ length_of_file_name_and_frills (const struct fileinfo *f)
 
   if (print_block_size)
     len += 1 + (format == with_commas
-                ? strlen (! f->stat_ok ? "?"
-                          : human_readable (ST_NBLOCKS (f->stat), buf,
-                                            human_output_opts, ST_NBLOCKSIZE,
-                                            output_block_size))
+                ? strlen (! f->stat_ok ? "?" : human_blocks (&f->stat, NULL))
                 : block_size_width);
 
   if (print_scontext)
@@ -4663,7 +6087,6 @@ print_many_per_line (void)
 {
   size_t row;			/* Current row.  */
   size_t cols = calculate_columns (true);
-  struct column_info const *line_fmt = &column_info[cols - 1];
 
   /* Calculate the number of rows that will be in each column except possibly
      for a short column on the right.  */
@@ -4679,8 +6102,8 @@ print_many_per_line (void)
       while (1)
         {
           struct fileinfo const *f = sorted_file[filesno];
-          size_t name_length = length_of_file_name_and_frills (f);
-          size_t max_name_length = line_fmt->col_arr[col++];
+          size_t name_length = file_length[filesno];
+          size_t max_name_length = column_width[col++];
           print_file_name_and_frills (f, pos);
 
           filesno += rows;
@@ -4700,10 +6123,9 @@ print_horizontal (void)
   size_t filesno;
   size_t pos = 0;
   size_t cols = calculate_columns (false);
-  struct column_info const *line_fmt = &column_info[cols - 1];
   struct fileinfo const *f = sorted_file[0];
-  size_t name_length = length_of_file_name_and_frills (f);
-  size_t max_name_length = line_fmt->col_arr[0];
+  size_t name_length = file_length[0];
+  size_t max_name_length = column_width[0];
 
   /* Print first entry.  */
   print_file_name_and_frills (f, 0);
@@ -4727,8 +6149,8 @@ print_horizontal (void)
       f = sorted_file[filesno];
       print_file_name_and_frills (f, pos);
 
-      name_length = length_of_file_name_and_frills (f);
-      max_name_length = line_fmt->col_arr[col];
+      name_length = file_length[filesno];
+      max_name_length = column_width[col];
     }
   putchar ('\n');
 }
@@ -4817,82 +6239,144 @@ attach (char *dest, char const *dirname, char const *name)
   *dest = 0;
 }
 
-/* Allocate enough column info suitable for the current number of
-   files and display columns, and initialize the info to represent the
-   narrowest possible columns.  */
+/* Allocate the column widths and file lengths suitable for the
+   current number of files and display columns, and compute the
+   lengths of the files.  */
 
 static void
 init_column_info (void)
 {
-  size_t i;
   size_t max_cols = MIN (max_idx, cwd_n_used);
+  size_t nblocks = cwd_n_used / FILE_LENGTH_BLOCK + 1;
 
-  /* Currently allocated columns in column_info.  */
-  static size_t column_info_alloc;
+  /* Currently allocated columns and files.  */
+  static size_t column_width_alloc;
+  static size_t file_length_alloc;
 
-  if (column_info_alloc < max_cols)
+  if (column_width_alloc < max_cols)
     {
-      size_t new_column_info_alloc;
-      size_t *p;
+      free (column_width);
+      column_width = xnmalloc (max_cols, sizeof *column_width);
+      column_width_alloc = max_cols;
+    }
 
-      if (max_cols < max_idx / 2)
-        {
-          /* The number of columns is far less than the display width
-             allows.  Grow the allocation, but only so that it's
-             double the current requirements.  If the display is
-             extremely wide, this avoids allocating a lot of memory
-             that is never needed.  */
-          column_info = xnrealloc (column_info, max_cols,
-                                   2 * sizeof *column_info);
-          new_column_info_alloc = 2 * max_cols;
-        }
-      else
-        {
-          column_info = xnrealloc (column_info, max_idx, sizeof *column_info);
-          new_column_info_alloc = max_idx;
-        }
+  if (file_length_alloc < cwd_n_used)
+    {
+      free (file_length);
+      free (block_length);
+      file_length = xnmalloc (cwd_n_used, sizeof *file_length);
+      block_length = xnmalloc (nblocks, sizeof *block_length);
+      file_length_alloc = cwd_n_used;
+    }
 
-      /* Allocate the new size_t objects by computing the triangle
-         formula n * (n + 1) / 2, except that we don't need to
-         allocate the part of the triangle that we've already
-         allocated.  Check for address arithmetic overflow.  */
-      {
-        size_t column_info_growth = new_column_info_alloc - column_info_alloc;
-        size_t s = column_info_alloc + 1 + new_column_info_alloc;
-        size_t t = s * column_info_growth;
-        if (s < new_column_info_alloc || t / column_info_growth != s)
-          xalloc_die ();
-        p = xnmalloc (t / 2, sizeof *p);
-      }
+  for (size_t i = 0; i < nblocks; i++)
+    block_length[i] = 0;
+  total_file_length = longest_file_length = 0;
+  for (size_t i = 0; i < cwd_n_used; i++)
+    {
+      file_length[i] = length_of_file_name_and_frills (sorted_file[i]);
+      size_t *b = &block_length[i / FILE_LENGTH_BLOCK];
+      *b = MAX (*b, file_length[i]);
+      total_file_length += file_length[i];
+      longest_file_length = MAX (longest_file_length, file_length[i]);
+    }
+}
 
-      /* Grow the triangle by parceling out the cells just allocated.  */
-      for (i = column_info_alloc; i < new_column_info_alloc; i++)
-        {
-          column_info[i].col_arr = p;
-          p += i + 1;
-        }
+/* Return the greatest length of the files from index LO up to but not
+   including HI, or 0 if there are none.  */
 
-      column_info_alloc = new_column_info_alloc;
-    }
+static size_t
+max_file_length (size_t lo, size_t hi)
+{
+  size_t max = 0;
+
+  for (; lo < hi && lo % FILE_LENGTH_BLOCK != 0; lo++)
+    max = MAX (max, file_length[lo]);
+  for (; FILE_LENGTH_BLOCK <= hi - lo; lo += FILE_LENGTH_BLOCK)
+    max = MAX (max, block_length[lo / FILE_LENGTH_BLOCK]);
+  for (; lo < hi; lo++)
+    max = MAX (max, file_length[lo]);
+
+  return max;
+}
+
+/* Return true if the files fit in COLS columns, filled down each
+   column if BY_COLUMNS and across each line otherwise, storing the
+   widths of the columns into COLUMN_WIDTH.  If GIVE_UP, return false
+   as soon as the columns are known to be too wide, leaving
+   COLUMN_WIDTH incomplete.
+
+   Every column is at least MIN_COLUMN_WIDTH wide, and has 2 spaces
+   after its widest file unless it is the last one.  The columns fit if
+   their widths add up to less than the line length, or if none of them
+   is wider than MIN_COLUMN_WIDTH.  */
+
+static bool
+columns_fit (size_t cols, bool by_columns, bool give_up)
+{
+  size_t line_len = cols * MIN_COLUMN_WIDTH;
+  bool widened = false;
 
-  for (i = 0; i < max_cols; ++i)
+  /* A file longer than MIN_COLUMN_WIDTH widens its column however
+     many columns there are.  Then no column can be narrower than the
+     average length of its files, at most ROWS of them, plus 2.  */
+  if (give_up && MIN_COLUMN_WIDTH < longest_file_length)
     {
-      size_t j;
+      size_t rows = (cwd_n_used + cols - 1) / cols;
+      if (line_length <= total_file_length / rows + 2 * (cols - 1))
+        return false;
+    }
 
-      column_info[i].valid_len = true;
-      column_info[i].line_len = (i + 1) * MIN_COLUMN_WIDTH;
-      for (j = 0; j <= i; ++j)
-        column_info[i].col_arr[j] = MIN_COLUMN_WIDTH;
+  if (by_columns)
+    {
+      /* Each column is a run of ROWS files, so the widest file of each
+         is found from the maxima of the blocks it spans.  */
+      size_t rows = (cwd_n_used + cols - 1) / cols;
+      for (size_t i = 0; i < cols; i++)
+        {
+          size_t lo = MIN (i * rows, cwd_n_used);
+          size_t hi = MIN (lo + rows, cwd_n_used);
+          size_t real_length = (max_file_length (lo, hi)
+                                + (i == cols - 1 ? 0 : 2));
+          column_width[i] = MIN_COLUMN_WIDTH;
+          if (MIN_COLUMN_WIDTH < real_length)
+            {
+              line_len += real_length - MIN_COLUMN_WIDTH;
+              column_width[i] = real_length;
+              widened = true;
+              if (give_up && line_length <= line_len)
+                return false;
+            }
+        }
+    }
+  else
+    {
+      for (size_t i = 0; i < cols; i++)
+        column_width[i] = MIN_COLUMN_WIDTH;
+      for (size_t filesno = 0, i = 0; filesno < cwd_n_used; filesno++)
+        {
+          size_t real_length = file_length[filesno] + (i == cols - 1 ? 0 : 2);
+          if (column_width[i] < real_length)
+            {
+              line_len += real_length - column_width[i];
+              column_width[i] = real_length;
+              widened = true;
+              if (give_up && line_length <= line_len)
+                return false;
+            }
+          i = i == cols - 1 ? 0 : i + 1;
+        }
     }
+
+  return !widened || line_len < line_length;
 }
 
 /* Calculate the number of columns needed to represent the current set
-   of files in the current display width.  */
+   of files in the current display width, and their widths.  */
 
 static size_t
 calculate_columns (bool by_columns)
 {
-  size_t filesno;		/* Index into cwd_file.  */
   size_t cols;			/* Number of files across.  */
 
   /* Normally the maximum number of columns is determined by the
@@ -4902,40 +6386,16 @@ calculate_columns (bool by_columns)
 
   init_column_info ();
 
-  /* Compute the maximum number of possible columns.  */
-  for (filesno = 0; filesno < cwd_n_used; ++filesno)
-    {
-      struct fileinfo const *f = sorted_file[filesno];
-      size_t name_length = length_of_file_name_and_frills (f);
-
-      for (size_t i = 0; i < max_cols; ++i)
-        {
-          if (column_info[i].valid_len)
-            {
-              size_t idx = (by_columns
-                            ? filesno / ((cwd_n_used + i) / (i + 1))
-                            : filesno % (i + 1));
-              size_t real_length = name_length + (idx == i ? 0 : 2);
-
-              if (column_info[i].col_arr[idx] < real_length)
-                {
-                  column_info[i].line_len += (real_length
-                                              - column_info[i].col_arr[idx]);
-                  column_info[i].col_arr[idx] = real_length;
-                  column_info[i].valid_len = (column_info[i].line_len
-                                              < line_length);
-                }
-            }
-        }
-    }
-
-  /* Find maximum allowed columns.  */
+  /* Find maximum allowed columns.  Trying the numbers of columns from
+     the greatest down costs little, as most of those that do not fit
+     are found out after their first few columns or files.  */
   for (cols = max_cols; 1 < cols; --cols)
     {
-      if (column_info[cols - 1].valid_len)
+      if (columns_fit (cols, by_columns, true))
         break;
     }
 
+  columns_fit (cols, by_columns, false);
   return cols;
 }
 
@@ -5028,6 +6488,8 @@ Sort entries alphabetically if none of -cftuvSUX nor --sort is specified.\n\
   -i, --inode                print the index number of each file\n\
   -I, --ignore=PATTERN       do not list implied entries matching shell PATTERN\
 \n\
+      --io-uring             get the status of directory entries in batches\n\
+                               through io_uring, where the kernel supports it\n\
 "), stdout);
       fputs (_("\
   -k, --kibibytes            default to 1024-byte blocks for disk usage;\n\
@@ -5047,6 +6509,8 @@ Sort entries alphabetically if none of -cftuvSUX nor --sort is specified.\n\
   -o                         like -l, but do not list group information\n\
   -p, --indicator-style=slash\n\
                              append / indicator to directories\n\
+      --parallel=N           read directories and get the status of their\n\
+                               entries with N threads at a time\n\
 "), stdout);
       fputs (_("\
   -q, --hide-control-chars   print ? instead of nongraphic characters\n\
@@ -5069,6 +6533,9 @@ Sort entries alphabetically if none of -cftuvSUX nor --sort is specified.\n\
       --sort=WORD            sort by WORD instead of name: none (-U), size (-S)\
 ,\n\
                                time (-t), version (-v), extension (-X), width\n\
+      --stats                report the hits and misses of the caches of\n\
+                               user and group names and of file system\n\
+                               features to stderr\n\
       --time=WORD            change the default of using modification times;\n\
                                access time (-u): atime, access, use;\n\
                                change time (-c): ctime, status;\n\
@@ -1,10 +1,14 @@
 #include <config.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include "system.h"
 #include "argmatch.h"
@@ -13,10 +17,13 @@
 #include "fadvise.h"
 #include "filevercmp.h"
 #include "flexmember.h"
+#include "full-read.h"
+#include "full-write.h"
+#include "gethrxtime.h"
 #include "hard-locale.h"
 #include "hash.h"
-#include "heap.h"
 #include "ignore-value.h"
+#include "lineindex.h"
 #include "md5.h"
 #include "mbswidth.h"
 #include "nproc.h"
@@ -74,6 +81,26 @@ enum {
   DEFAULT_MAX_THREADS = 8 
 };
 
+/* Buckets with fewer lines than this are handed from radix_sort to
+   sequential_sort, and radix_sort recurses no deeper than
+   RADIX_SORT_MAX_DEPTH buckets before doing the same.  */
+enum
+  {
+    RADIX_SORT_THRESHOLD = 64,
+    RADIX_SORT_MAX_DEPTH = 32
+  };
+
+/* internal_sort sorts runs of ascending lines shorter than
+   NATURAL_RUN_MIN lines up to that length.  Once the lines so sorted
+   exceed 1 / NATURAL_RUN_SLACK of those already seen, the input is not
+   nearly sorted, and it sorts the rest at once; but the first such
+   patch is always allowed, for disorder at the start of the input.  */
+enum
+  {
+    NATURAL_RUN_MIN = 64,
+    NATURAL_RUN_SLACK = 8
+  };
+
 enum
   {
     SORT_OUT_OF_ORDER = 1,
@@ -96,6 +123,20 @@ static int decimal_point;
 static int thousands_sep;
 
 static bool hard_LC_COLLATE;
+
+/* True if lines can be ordered by radix_sort, i.e., if the first key
+   (or the whole line, when there are no keys) is compared bytewise in
+   ascending order and equal keys need not keep their input order.  */
+static bool radix_sortable;
+
+/* True if each line's keyprefix caches a summary of its first key (or
+   of the whole line, when there are no keys), computed once by
+   fillbuf: the key's leading bytes after any ignoring and translation
+   if keys compare as byte strings, or an encoding of its value if the
+   key is numeric.  Lines whose prefixes differ are ordered by them
+   without any access to their text or reparsing of their keys; lines
+   whose prefixes are equal need a full comparison.  */
+static bool key_prefixes;
 #if HAVE_NL_LANGINFO
 static bool hard_LC_TIME;
 #endif
@@ -112,6 +153,17 @@ struct line
   size_t length;	
   char *keybeg;		
   char *keylim;		
+  uint64_t keyprefix;
+};
+
+/* A block of the collation keys of the lines of a buffer.  */
+
+struct xfrm_block
+{
+  struct xfrm_block *next;
+  size_t size;
+  size_t used;
+  char data[FLEXIBLE_ARRAY_MEMBER];
 };
 
 struct buffer
@@ -123,6 +175,27 @@ struct buffer
   size_t left;			
   size_t line_bytes;		
   bool eof;		
+
+  /* If nonnull, the input file, of MAPSIZE bytes, mapped into memory
+     by map_input.  Its lines are recorded in place rather than copied
+     into BUF, which holds only the line array; the first MAPPED bytes
+     have been recorded.  */
+  char *map;
+  size_t mapsize;
+  size_t mapped;
+
+  /* Blocks, newest first, of collation keys of the lines, which are
+     transformed once by xfrm_lines rather than collated at each
+     comparison, as long as the blocks' total size XFRM_SIZE stays
+     within XFRM_MAX.  */
+  struct xfrm_block *xfrm;
+  size_t xfrm_size;
+  size_t xfrm_max;
+
+  /* If nonzero, fillbuf grows the buffer with growbuf rather than
+     return it full, as long as it stays within GROW_LIMIT bytes
+     (--auto-tune).  */
+  size_t grow_limit;
 };
 
 struct keyfield
@@ -169,11 +242,17 @@ struct merge_node
   pthread_mutex_t lock;         
 };
 
+/* The merging that remains to be done in the merge tree of an
+   internal sort.  Each node with lines to merge is a task in POOL.  */
 struct merge_node_queue
 {
-  struct heap *priority_queue;  
-  pthread_mutex_t mutex;        
-  pthread_cond_t cond;        
+  struct task_pool *pool;
+  size_t total_lines;
+  FILE *tfp;
+  char const *temp_output;
+
+  /* 1 until the MERGE_ROOT node has finished merging, then 0.  */
+  atomic_size_t unfinished;
 };
 
 static struct line saved_line;
@@ -205,6 +284,11 @@ static struct month monthtab[] =
 
 #define MIN_SORT_SIZE (nmerge * MIN_MERGE_BUFFER_SIZE)
 
+/* With --auto-tune, give each input of a merge a buffer with room for
+   at least this many lines of the average length of the input, and
+   merge at most AUTO_NMERGE_MAX files at once.  */
+enum { AUTO_MERGE_LINES = 1024, AUTO_NMERGE_MAX = 1024 };
+
 static size_t merge_buffer_size = MAX (MIN_MERGE_BUFFER_SIZE, 256 * 1024);
 
 static size_t sort_size;
@@ -222,11 +306,79 @@ static int tab = TAB_DEFAULT;
 static bool unique;
 static bool have_read_stdin;
 
+/* If nonzero, output only this many lines, the first of the sorted
+   output (--head).  */
+static size_t head_lines;
+
+/* If true, as with -u, but the lines need not be output in order
+   (--unique-unordered).  */
+static bool unique_unordered;
+
 static struct keyfield *keylist;
 static char const *compress_program;
+
+/* True if temporary files are to be compressed in process, with
+   temp_compress.  */
+static bool compress_temp;
 static bool debug;
 static unsigned int nmerge = NMERGE_DEFAULT;
 
+/* True if NMERGE was given with --batch-size.  */
+static bool nmerge_specified;
+
+/* If true, grow the sort buffer rather than create temporary files
+   while memory allows, and merge as many files at once as memory and
+   file descriptors allow (--auto-tune).  */
+static bool auto_tune;
+
+/* If true, report statistics of the run on standard error (--stats).  */
+static bool stats;
+
+/* Statistics of the run, reported with --stats.  Only the main thread
+   updates them, except as noted.  */
+static struct
+{
+  /* When the run started, and the time spent reading input into
+     buffers, sorting the buffers and writing them out, and merging.  */
+  xtime_t start;
+  xtime_t input_time;
+  xtime_t sort_time;
+  xtime_t merge_time;
+
+  /* The lines and bytes sorted in buffers, the number of buffers, the
+     size of the largest, and the number of times a buffer was grown
+     with --auto-tune, which concurrent merges update too.  */
+  uintmax_t lines;
+  uintmax_t bytes;
+  size_t buffers;
+  size_t max_buffer;
+  atomic_size_t buffer_growths;
+
+  /* The temporary files created, the bytes they took, and the bytes
+     read back from them by merges.  */
+  uintmax_t temp_files;
+  uintmax_t temp_written;
+  uintmax_t temp_read;
+
+  /* The number of merge passes, and of files merged at once.  */
+  size_t merge_passes;
+  size_t max_merge;
+
+  /* The comparisons of lines by threads that have finished, which
+     each add their own count of ncompares.  */
+  atomic_uintmax_t comparisons;
+
+  /* The number of threads of the pools, and the total time of their
+     lives and the time they spent asleep for want of tasks.  */
+  size_t threads;
+  xtime_t thread_time;
+  xtime_t thread_idle;
+} sort_stats;
+
+/* The number of comparisons of lines by this thread, counted only
+   with --stats.  */
+static _Thread_local uintmax_t ncompares;
+
 static void async_safe_die (int, char const *) ATTRIBUTE_NORETURN;
 static void
 async_safe_die (int errnum, char const *errstr)
@@ -308,6 +460,10 @@ Other options:\n\
 \n\
 "), stdout);
       fputs (_("\
+      --auto-tune           grow the main memory buffer while memory allows,\n\
+                              and unless --batch-size is given, merge as\n\
+                              many inputs at once as memory and file\n\
+                              descriptors allow\n\
       --batch-size=NMERGE   merge at most NMERGE inputs at once;\n\
                             for more use temp files\n\
 "), stdout);
@@ -317,6 +473,7 @@ Other options:\n\
 \n\
       --compress-program=PROG  compress temporaries with PROG;\n\
                               decompress them with PROG -d\n\
+      --compress-temp       compress temporaries with a fast built-in method\n\
 "), stdout);
       fputs (_("\
       --debug               annotate the part of the line used to sort,\n\
@@ -324,6 +481,8 @@ Other options:\n\
       --files0-from=F       read input from the files specified by\n\
                             NUL-terminated names in file F;\n\
                             If F is - then read names from standard input\n\
+      --head=N              output only the first N lines of the result,\n\
+                              keeping just them and no temporary files\n\
 "), stdout);
       fputs (_("\
   -k, --key=KEYDEF          sort via a key; KEYDEF gives location and type\n\
@@ -334,6 +493,8 @@ Other options:\n\
   -s, --stable              stabilize sort by disabling last-resort comparison\
 \n\
   -S, --buffer-size=SIZE    use SIZE for main memory buffer\n\
+      --stats               report times, temporary files, merge passes,\n\
+                              comparisons and thread use to stderr\n\
 "), stdout);
       printf (_("\
   -t, --field-separator=SEP  use SEP instead of non-blank to blank transition\n\
@@ -342,6 +503,9 @@ Other options:\n\
       --parallel=N          change the number of sorts run concurrently to N\n\
   -u, --unique              with -c, check for strict ordering;\n\
                               without -c, output only the first of an equal run\
+\n\
+      --unique-unordered    like -u, but output the first of each equal set\n\
+                              of lines in no particular order, without sorting\
 \n\
 "), DEFAULT_TMPDIR);
       fputs (_("\
@@ -377,14 +541,19 @@ native byte values.\n\
 }
 enum
 {
-  CHECK_OPTION = CHAR_MAX + 1,
+  AUTO_TUNE_OPTION = CHAR_MAX + 1,
+  CHECK_OPTION,
   COMPRESS_PROGRAM_OPTION,
+  COMPRESS_TEMP_OPTION,
   DEBUG_PROGRAM_OPTION,
   FILES0_FROM_OPTION,
+  HEAD_OPTION,
   NMERGE_OPTION,
   RANDOM_SOURCE_OPTION,
   SORT_OPTION,
-  PARALLEL_OPTION
+  PARALLEL_OPTION,
+  STATS_OPTION,
+  UNIQUE_UNORDERED_OPTION
 };
 
 static char const short_options[] = "-bcCdfghik:mMno:rRsS:t:T:uVy:z";
@@ -394,11 +563,14 @@ static struct option const long_options[] =
   {"ignore-leading-blanks", no_argument, NULL, 'b'},
   {"check", optional_argument, NULL, CHECK_OPTION},
   {"compress-program", required_argument, NULL, COMPRESS_PROGRAM_OPTION},
+  {"compress-temp", no_argument, NULL, COMPRESS_TEMP_OPTION},
   {"debug", no_argument, NULL, DEBUG_PROGRAM_OPTION},
+  {"stats", no_argument, NULL, STATS_OPTION},
   {"dictionary-order", no_argument, NULL, 'd'},
   {"ignore-case", no_argument, NULL, 'f'},
   {"files0-from", required_argument, NULL, FILES0_FROM_OPTION},
   {"general-numeric-sort", no_argument, NULL, 'g'},
+  {"head", required_argument, NULL, HEAD_OPTION},
   {"ignore-nonprinting", no_argument, NULL, 'i'},
   {"key", required_argument, NULL, 'k'},
   {"merge", no_argument, NULL, 'm'},
@@ -412,11 +584,13 @@ static struct option const long_options[] =
   {"output", required_argument, NULL, 'o'},
   {"reverse", no_argument, NULL, 'r'},
   {"stable", no_argument, NULL, 's'},
+  {"auto-tune", no_argument, NULL, AUTO_TUNE_OPTION},
   {"batch-size", required_argument, NULL, NMERGE_OPTION},
   {"buffer-size", required_argument, NULL, 'S'},
   {"field-separator", required_argument, NULL, 't'},
   {"temporary-directory", required_argument, NULL, 'T'},
   {"unique", no_argument, NULL, 'u'},
+  {"unique-unordered", no_argument, NULL, UNIQUE_UNORDERED_OPTION},
   {"zero-terminated", no_argument, NULL, 'z'},
   {"parallel", required_argument, NULL, PARALLEL_OPTION},
   {GETOPT_HELP_OPTION_DECL},
@@ -482,11 +656,101 @@ static void cs_leave (struct cs_status const *status)
     }
 }
 
-enum { UNCOMPRESSED, UNREAPED, REAPED };
+/* A block of memory of an arena.  */
+
+struct arena_block
+{
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  max_align_t data[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/* An arena, from which objects that are to be freed together are
+   allocated in blocks, newest first, of SIZE bytes in all.  */
+
+struct arena
+{
+  struct arena_block *block;
+  size_t size;
+};
+
+/* The least size of an arena's block.  */
+enum { ARENA_BLOCK_SIZE = 64 * 1024 };
+
+/* Return SIZE bytes from ARENA, aligned to ALIGN, a power of 2 no
+   greater than that of max_align_t.  */
+
+static void *
+arena_alloc (struct arena *arena, size_t size, size_t align)
+{
+  struct arena_block *block = arena->block;
+  size_t used = block ? (block->used + align - 1) & ~(align - 1) : 0;
+
+  if (! block || block->size < used || block->size - used < size)
+    {
+      size_t block_size = MAX (ARENA_BLOCK_SIZE, size);
+      block = xmalloc (FLEXSIZEOF (struct arena_block, data, block_size));
+      block->next = arena->block;
+      block->size = block_size;
+      arena->block = block;
+      arena->size += block_size;
+      used = 0;
+    }
+
+  block->used = used + size;
+  return (char *) block->data + used;
+}
+
+/* Give back to ARENA the object P, the last one allocated from it.  */
+
+static void
+arena_unalloc (struct arena *arena, void *p)
+{
+  struct arena_block *block = arena->block;
+  block->used = (char *) p - (char *) block->data;
+}
+
+/* Free all the objects of ARENA at once.  If KEEP, keep its newest
+   block for reuse.  */
+
+static void
+arena_free (struct arena *arena, bool keep)
+{
+  struct arena_block *block = arena->block;
+
+  if (keep && block)
+    {
+      arena->block = block;
+      arena->size = block->size;
+      block->used = 0;
+      block = block->next;
+      arena->block->next = NULL;
+    }
+  else
+    {
+      arena->block = NULL;
+      arena->size = 0;
+    }
+
+  while (block)
+    {
+      struct arena_block *next = block->next;
+      free (block);
+      block = next;
+    }
+}
+
+enum { UNCOMPRESSED, UNREAPED, REAPED, COMPRESSED };
+
+/* A temporary file, in the list from temphead to temptail.  LINK
+   points to the pointer to it, either temphead or the NEXT of the
+   node before it, so that zaptemp can remove it at once.  */
 
 struct tempnode
 {
   struct tempnode *volatile next;
+  struct tempnode *volatile *link;
   pid_t pid;   
   char state;
   char name[FLEXIBLE_ARRAY_MEMBER];
@@ -494,6 +758,10 @@ struct tempnode
 static struct tempnode *volatile temphead;
 static struct tempnode *volatile *temptail = &temphead;
 
+/* The arena of the nodes of the list of temporary files, which is
+   freed whenever the list is empty.  */
+static struct arena temp_arena;
+
 struct sortfile
 {
   char const *name;
@@ -627,7 +895,9 @@ static struct tempnode * create_temp_file (int *pfd, bool survive_fd_exhaustion)
   char const *temp_dir = temp_dirs[temp_dir_index];
   size_t len = strlen (temp_dir);
   struct tempnode *node =
-  xmalloc (FLEXSIZEOF (struct tempnode, name, len + sizeof slashbase));
+    arena_alloc (&temp_arena,
+                 FLEXSIZEOF (struct tempnode, name, len + sizeof slashbase),
+                 alignof (struct tempnode));
   char *file = node->name;
   struct cs_status cs;
 
@@ -640,6 +910,7 @@ static struct tempnode * create_temp_file (int *pfd, bool survive_fd_exhaustion)
   fd = mkostemp (file, O_CLOEXEC);
   if (0 <= fd)
     {
+      node->link = temptail;
       *temptail = node;
       temptail = &node->next;
     }
@@ -652,7 +923,7 @@ static struct tempnode * create_temp_file (int *pfd, bool survive_fd_exhaustion)
       if (! (survive_fd_exhaustion && errno == EMFILE))
         die (SORT_FAILURE, errno, _("cannot create temporary file in %s"),
              quoteaf (temp_dir));
-      free (node);
+      arena_unalloc (&temp_arena, node);
       node = NULL;
     }
 
@@ -810,177 +1081,871 @@ pipe_fork (int pipefds[2], size_t tries)
 }
 
 
-static struct tempnode *
-maybe_create_temp (FILE **pfp, bool survive_fd_exhaustion)
+/* Built-in compression of temporary files.  A temporary file is a
+   sequence of blocks, each a header of two uint32_t values, the sizes
+   of the block's data as stored and as uncompressed, followed by the
+   stored data.  The data is stored as is if the sizes are equal, and
+   is otherwise compressed by temp_compress, which is a greedy LZ77
+   coder in the format of LZ4: each sequence is a token byte whose
+   high and low nibbles give the count of literal bytes and the match
+   length minus TEMP_MIN_MATCH (15 meaning that more length bytes
+   follow), then the literal bytes, then the match offset as two
+   little-endian bytes.  The last sequence has only literals.
+   This costs far less CPU than a general-purpose compressor run via
+   --compress-program, and needs no processes or pipes.  */
+
+enum
+  {
+    /* The uncompressed size of a full block.  Offsets within a block
+       fit in 16 bits.  */
+    TEMP_BLOCK_SIZE = 64 * 1024,
+
+    /* The minimum match length.  */
+    TEMP_MIN_MATCH = 4,
+
+    /* The log base 2 of the number of entries in the table that
+       temp_compress uses to find matches.  */
+    TEMP_HASH_BITS = 13,
+
+    /* The size of a block header, and an upper bound on the size of
+       a compressed block.  */
+    TEMP_HEADER_SIZE = 2 * sizeof (uint32_t),
+    TEMP_COMPRESS_BOUND = TEMP_BLOCK_SIZE + TEMP_BLOCK_SIZE / 255 + 16
+  };
+
+static inline uint32_t
+temp_load32 (unsigned char const *p)
 {
-  int tempfd;
-  struct tempnode *node = create_temp_file (&tempfd, survive_fd_exhaustion);
-  if (! node)
-    return NULL;
+  uint32_t v;
+  memcpy (&v, p, sizeof v);
+  return v;
+}
 
-  node->state = UNCOMPRESSED;
+/* Append to OP the length LEN in the form of the bytes that follow a
+   token nibble of 15, and return the new end of OP.  */
 
-  if (compress_program)
+static unsigned char *
+temp_put_length (unsigned char *op, size_t len)
+{
+  for (; 255 <= len; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/* Append to OP a sequence of the LITLEN bytes at LIT followed, if
+   MATCHLEN is nonzero, by a match of MATCHLEN bytes OFFSET bytes
+   back.  Return the new end of OP.  */
+
+static unsigned char *
+temp_put_sequence (unsigned char *op, unsigned char const *lit,
+                   size_t litlen, size_t offset, size_t matchlen)
+{
+  size_t matchcode = matchlen ? matchlen - TEMP_MIN_MATCH : 0;
+  *op++ = MIN (litlen, 15) << 4 | MIN (matchcode, 15);
+  if (15 <= litlen)
+    op = temp_put_length (op, litlen - 15);
+  op = mempcpy (op, lit, litlen);
+  if (matchlen)
     {
-      int pipefds[2];
+      *op++ = offset & UCHAR_MAX;
+      *op++ = offset >> CHAR_BIT;
+      if (15 <= matchcode)
+        op = temp_put_length (op, matchcode - 15);
+    }
+  return op;
+}
 
-      node->pid = pipe_fork (pipefds, MAX_FORK_TRIES_COMPRESS);
-      if (0 < node->pid)
-        {
-          close (tempfd);
-          close (pipefds[0]);
-          tempfd = pipefds[1];
+/* Compress the N bytes at SRC, where N <= TEMP_BLOCK_SIZE, into DST,
+   which has room for TEMP_COMPRESS_BOUND bytes.  Return the
+   compressed size.  */
 
-          register_proc (node);
-        }
-      else if (node->pid == 0)
-        {
-          close (pipefds[1]);
-          move_fd (tempfd, STDOUT_FILENO);
-          move_fd (pipefds[0], STDIN_FILENO);
+static size_t
+temp_compress (unsigned char const *src, size_t n, unsigned char *dst)
+{
+  uint16_t table[1 << TEMP_HASH_BITS];
+  unsigned char *op = dst;
+  size_t anchor = 0;
+  size_t i = 0;
 
-          execlp (compress_program, compress_program, (char *) NULL);
+  memset (table, 0, sizeof table);
 
-          async_safe_die (errno, "couldn't execute compress program");
+  while (i + TEMP_MIN_MATCH <= n)
+    {
+      uint32_t seq = temp_load32 (src + i);
+      size_t h = (seq * 2654435761u) >> (32 - TEMP_HASH_BITS);
+      size_t ref = table[h];
+      table[h] = i;
+
+      if (ref < i && temp_load32 (src + ref) == seq)
+        {
+          size_t len = TEMP_MIN_MATCH;
+          while (i + len < n && src[ref + len] == src[i + len])
+            len++;
+          op = temp_put_sequence (op, src + anchor, i - anchor, i - ref, len);
+          i += len;
+          anchor = i;
+        }
+      else
+        {
+          /* Skip ahead faster the longer the run of misses, so that
+             incompressible data costs little.  */
+          i += 1 + ((i - anchor) >> 6);
         }
     }
 
-  *pfp = fdopen (tempfd, "w");
-  if (! *pfp)
-    sort_die (_("couldn't create temporary file"), node->name);
-
-  return node;
+  if (anchor < n)
+    op = temp_put_sequence (op, src + anchor, n - anchor, 0, 0);
+  return op - dst;
 }
 
-static struct tempnode *
-create_temp (FILE **pfp)
+/* Read a length continued from a token nibble of 15 from *PIP, which
+   must stay before IEND, and add it to *LEN.  Return false if the
+   input ends first.  */
+
+static bool
+temp_get_length (unsigned char const **pip, unsigned char const *iend,
+                 size_t *len)
 {
-  return maybe_create_temp (pfp, false);
+  unsigned char const *ip = *pip;
+  unsigned char b;
+  do
+    {
+      if (ip == iend)
+        return false;
+      b = *ip++;
+      *len += b;
+    }
+  while (b == 255);
+  *pip = ip;
+  return true;
 }
 
+/* Decompress the N bytes at SRC into the DSTLEN bytes at DST.
+   Return false if the data is corrupt.  */
 
-static FILE *
-open_temp (struct tempnode *temp)
+static bool
+temp_decompress (unsigned char const *src, size_t n,
+                 unsigned char *dst, size_t dstlen)
 {
-  int tempfd, pipefds[2];
-  FILE *fp = NULL;
+  unsigned char const *ip = src;
+  unsigned char const *iend = src + n;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dstlen;
 
-  if (temp->state == UNREAPED)
-    wait_proc (temp->pid);
+  while (ip < iend)
+    {
+      unsigned char token = *ip++;
+      size_t litlen = token >> 4;
+      if (litlen == 15 && ! temp_get_length (&ip, iend, &litlen))
+        return false;
+      if (iend - ip < litlen || oend - op < litlen)
+        return false;
+      op = mempcpy (op, ip, litlen);
+      ip += litlen;
+      if (ip == iend)
+        break;
 
-  tempfd = open (temp->name, O_RDONLY);
-  if (tempfd < 0)
-    return NULL;
+      if (iend - ip < 2)
+        return false;
+      size_t offset = ip[0] | ip[1] << CHAR_BIT;
+      ip += 2;
+      size_t matchlen = token & 15;
+      if (matchlen == 15 && ! temp_get_length (&ip, iend, &matchlen))
+        return false;
+      matchlen += TEMP_MIN_MATCH;
+      if (offset == 0 || op - dst < offset || oend - op < matchlen)
+        return false;
+
+      unsigned char const *ref = op - offset;
+      if (matchlen <= offset)
+        op = mempcpy (op, ref, matchlen);
+      else
+        while (matchlen--)
+          *op++ = *ref++;
+    }
 
-  pid_t child = pipe_fork (pipefds, MAX_FORK_TRIES_DECOMPRESS);
+  return op == oend;
+}
 
-  switch (child)
-    {
-    case -1:
-      if (errno != EMFILE)
-        die (SORT_FAILURE, errno, _("couldn't create process for %s -d"),
-             quoteaf (compress_program));
-      close (tempfd);
-      errno = EMFILE;
-      break;
+/* A stream of a temporary file compressed in process.  */
 
-    case 0:
-      close (pipefds[0]);
-      move_fd (tempfd, STDIN_FILENO);
-      move_fd (pipefds[1], STDOUT_FILENO);
+struct temp_stream
+{
+  int fd;
+  bool writing;
 
-      execlp (compress_program, compress_program, "-d", (char *) NULL);
+  /* Uncompressed data: when writing, BUF holds USED bytes not yet
+     written; when reading, it holds a block of USED bytes, of which
+     POS have been consumed.  */
+  size_t used;
+  size_t pos;
+  unsigned char buf[TEMP_BLOCK_SIZE];
 
-      async_safe_die (errno, "couldn't execute compress program (with -d)");
+  /* A block header and its data as stored.  */
+  unsigned char cbuf[TEMP_HEADER_SIZE + TEMP_COMPRESS_BOUND];
+};
 
-    default:
-      temp->pid = child;
-      register_proc (temp);
-      close (tempfd);
-      close (pipefds[1]);
+/* Write the buffered data of TS as a block.  Return false, setting
+   errno, on failure.  */
 
-      fp = fdopen (pipefds[0], "r");
-      if (! fp)
-        {
-          int saved_errno = errno;
-          close (pipefds[0]);
-          errno = saved_errno;
-        }
-      break;
+static bool
+temp_stream_flush (struct temp_stream *ts)
+{
+  unsigned char *data = ts->cbuf + TEMP_HEADER_SIZE;
+  uint32_t header[2];
+  size_t size = temp_compress (ts->buf, ts->used, data);
+  if (ts->used <= size)
+    {
+      size = ts->used;
+      memcpy (data, ts->buf, size);
     }
+  header[0] = size;
+  header[1] = ts->used;
+  memcpy (ts->cbuf, header, TEMP_HEADER_SIZE);
 
-  return fp;
+  size += TEMP_HEADER_SIZE;
+  if (full_write (ts->fd, ts->cbuf, size) != size)
+    return false;
+  ts->used = 0;
+  return true;
 }
-static void
-add_temp_dir (char const *dir)
+
+static ssize_t
+temp_stream_write (void *cookie, char const *buf, size_t size)
 {
-  if (temp_dir_count == temp_dir_alloc)
-    temp_dirs = X2NREALLOC (temp_dirs, &temp_dir_alloc);
+  struct temp_stream *ts = cookie;
 
-  temp_dirs[temp_dir_count++] = dir;
-}
+  for (size_t n = size; n; )
+    {
+      size_t chunk = MIN (n, TEMP_BLOCK_SIZE - ts->used);
+      memcpy (ts->buf + ts->used, buf, chunk);
+      ts->used += chunk;
+      buf += chunk;
+      n -= chunk;
+      if (ts->used == TEMP_BLOCK_SIZE && ! temp_stream_flush (ts))
+        return -1;
+    }
 
+  return size;
+}
 
-static void
-zaptemp (char const *name)
+static ssize_t
+temp_stream_read (void *cookie, char *buf, size_t size)
 {
-  struct tempnode *volatile *pnode;
-  struct tempnode *node;
-  struct tempnode *next;
-  int unlink_status;
-  int unlink_errno = 0;
-  struct cs_status cs;
+  struct temp_stream *ts = cookie;
 
-  for (pnode = &temphead; (node = *pnode)->name != name; pnode = &node->next)
-    continue;
+  if (ts->pos == ts->used)
+    {
+      uint32_t header[2];
+      size_t nread = full_read (ts->fd, header, sizeof header);
+      if (nread != sizeof header)
+        {
+          if (errno)
+            return -1;
+          if (nread == 0)
+            return 0;
+          goto corrupt;
+        }
 
-  if (node->state == UNREAPED)
-    wait_proc (node->pid);
+      size_t stored = header[0];
+      size_t used = header[1];
+      if (! (0 < used && used <= TEMP_BLOCK_SIZE && stored <= used))
+        goto corrupt;
+      unsigned char *data = stored == used ? ts->buf : ts->cbuf;
+      if (full_read (ts->fd, data, stored) != stored)
+        {
+          if (errno)
+            return -1;
+          goto corrupt;
+        }
+      if (data != ts->buf && ! temp_decompress (data, stored, ts->buf, used))
+        goto corrupt;
+      ts->used = used;
+      ts->pos = 0;
+    }
 
-  next = node->next;
-  cs_enter (&cs);
-  unlink_status = unlink (name);
-  unlink_errno = errno;
-  *pnode = next;
-  cs_leave (&cs);
+  size_t n = MIN (size, ts->used - ts->pos);
+  memcpy (buf, ts->buf + ts->pos, n);
+  ts->pos += n;
+  return n;
 
-  if (unlink_status != 0)
-    error (0, unlink_errno, _("warning: cannot remove: %s"), quotef (name));
-  if (! next)
-    temptail = pnode;
-  free (node);
+ corrupt:
+  errno = EIO;
+  return -1;
 }
 
-#if HAVE_NL_LANGINFO
-
 static int
-struct_month_cmp (void const *m1, void const *m2)
+temp_stream_close (void *cookie)
 {
-  struct month const *month1 = m1;
-  struct month const *month2 = m2;
-  return strcmp (month1->name, month2->name);
+  struct temp_stream *ts = cookie;
+  bool ok = ! (ts->writing && ts->used) || temp_stream_flush (ts);
+  int saved_errno = errno;
+  if (close (ts->fd) != 0)
+    ok = false;
+  else
+    errno = saved_errno;
+  free (ts);
+  return ok ? 0 : -1;
 }
 
-#endif
+/* Return a stream for reading or writing, as MODE is "r" or "w", the
+   compressed temporary file open on FD.  Return NULL, setting errno,
+   on failure.  */
+
+static FILE *
+temp_stream_open (int fd, char const *mode)
+{
+  static cookie_io_functions_t const temp_stream_functions =
+    {
+      .read = temp_stream_read,
+      .write = temp_stream_write,
+      .close = temp_stream_close
+    };
+  struct temp_stream *ts = xmalloc (sizeof *ts);
+  ts->fd = fd;
+  ts->writing = *mode == 'w';
+  ts->used = ts->pos = 0;
+
+  FILE *fp = fopencookie (ts, mode, temp_stream_functions);
+  if (! fp)
+    free (ts);
+  return fp;
+}
+
+/* Asynchronous I/O.  When there are threads to spare, the input that
+   fillbuf reads can be read ahead, and the output that write_line
+   writes can be written behind, by a thread that moves chunks of data
+   between the underlying stream and a queue, so that reading and
+   writing overlap with sorting and merging.  */
+
+enum
+  {
+    /* The size of a chunk of data.  Regular files no larger than
+       this are not worth reading ahead.  */
+    ASYNC_CHUNK_SIZE = 256 * 1024,
+
+    /* The number of chunks that can wait to be written behind.  */
+    ASYNC_WRITE_CHUNKS = 8
+  };
+
+struct async_chunk
+{
+  struct async_chunk *next;
+  size_t used;
+  char data[ASYNC_CHUNK_SIZE];
+};
+
+struct async_stream
+{
+  /* The underlying stream and its name, as for xfclose.  */
+  FILE *fp;
+  char const *file;
+  bool writing;
+
+  /* The chunk being consumed by reads, of which POS bytes have been
+     consumed, or being filled by writes.  */
+  struct async_chunk *cur;
+  size_t pos;
+
+  /* The queue of chunks read ahead or waiting to be written, and the
+     most chunks it may hold.  */
+  struct async_chunk *head;
+  struct async_chunk **tail;
+  size_t nchunks;
+  size_t max_chunks;
+
+  /* True once the thread has reached end of file or an error when
+     reading, and once the stream is being closed.  ERR is the errno
+     value of the thread's failure, or 0.  */
+  bool eof;
+  bool closing;
+  int err;
+
+  /* LOCK protects the queue and the flags, and COND signals changes
+     to them.  STARTED is true if THREAD was created.  */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  bool started;
+};
 
+/* Append CHUNK to the queue of AS, waiting for room while the queue
+   is full.  Call this with the lock held.  */
 
 static void
-inittables (void)
+async_enqueue (struct async_stream *as, struct async_chunk *chunk)
 {
-  size_t i;
+  while (as->max_chunks <= as->nchunks && ! as->closing && ! as->err)
+    pthread_cond_wait (&as->cond, &as->lock);
+  chunk->next = NULL;
+  *as->tail = chunk;
+  as->tail = &chunk->next;
+  as->nchunks++;
+  pthread_cond_broadcast (&as->cond);
+}
 
-  for (i = 0; i < UCHAR_LIM; ++i)
+/* Remove and return the chunk at the head of the queue of AS, or
+   return NULL if the queue is empty.  Call this with the lock held.  */
+
+static struct async_chunk *
+async_dequeue (struct async_stream *as)
+{
+  struct async_chunk *chunk = as->head;
+  if (chunk)
     {
-      blanks[i] = field_sep (i);
-      nonprinting[i] = ! isprint (i);
-      nondictionary[i] = ! isalnum (i) && ! field_sep (i);
-      fold_toupper[i] = toupper (i);
+      as->head = chunk->next;
+      if (! as->head)
+        as->tail = &as->head;
+      as->nchunks--;
+      pthread_cond_broadcast (&as->cond);
     }
+  return chunk;
+}
 
-#if HAVE_NL_LANGINFO
-  if (hard_LC_TIME)
-    {
-      for (i = 0; i < MONTHS_PER_YEAR; i++)
+/* The thread that reads ahead the stream DATA.  */
+
+static void *
+async_reader (void *data)
+{
+  struct async_stream *as = data;
+  bool eof;
+
+  do
+    {
+      struct async_chunk *chunk = xmalloc (sizeof *chunk);
+      chunk->used = fread (chunk->data, 1, ASYNC_CHUNK_SIZE, as->fp);
+      eof = chunk->used < ASYNC_CHUNK_SIZE;
+      int err = eof && ferror (as->fp) ? errno : 0;
+
+      pthread_mutex_lock (&as->lock);
+      if (chunk->used && ! as->closing)
+        async_enqueue (as, chunk);
+      else
+        free (chunk);
+      if (eof || as->closing)
+        {
+          as->eof = eof = true;
+          as->err = err;
+          pthread_cond_broadcast (&as->cond);
+        }
+      pthread_mutex_unlock (&as->lock);
+    }
+  while (! eof);
+
+  return NULL;
+}
+
+/* The thread that writes behind the stream DATA.  After a write
+   error, discard the remaining output.  */
+
+static void *
+async_writer (void *data)
+{
+  struct async_stream *as = data;
+
+  pthread_mutex_lock (&as->lock);
+  while (true)
+    {
+      while (! as->head && ! as->closing)
+        pthread_cond_wait (&as->cond, &as->lock);
+      struct async_chunk *chunk = async_dequeue (as);
+      if (! chunk)
+        break;
+      bool ok = as->err == 0;
+      pthread_mutex_unlock (&as->lock);
+
+      if (ok)
+        ok = fwrite (chunk->data, 1, chunk->used, as->fp) == chunk->used;
+      int err = ok ? 0 : errno;
+      free (chunk);
+
+      pthread_mutex_lock (&as->lock);
+      if (err && ! as->err)
+        {
+          as->err = err;
+          pthread_cond_broadcast (&as->cond);
+        }
+    }
+  pthread_mutex_unlock (&as->lock);
+
+  return NULL;
+}
+
+static ssize_t
+async_read (void *cookie, char *buf, size_t size)
+{
+  struct async_stream *as = cookie;
+
+  if (! as->cur || as->pos == as->cur->used)
+    {
+      free (as->cur);
+      pthread_mutex_lock (&as->lock);
+      while (! as->head && ! as->eof)
+        pthread_cond_wait (&as->cond, &as->lock);
+      as->cur = async_dequeue (as);
+      int err = as->err;
+      pthread_mutex_unlock (&as->lock);
+
+      as->pos = 0;
+      if (! as->cur)
+        {
+          if (err)
+            {
+              errno = err;
+              return -1;
+            }
+          return 0;
+        }
+    }
+
+  size_t n = MIN (size, as->cur->used - as->pos);
+  memcpy (buf, as->cur->data + as->pos, n);
+  as->pos += n;
+  return n;
+}
+
+/* Queue the current chunk of AS to be written.  Return false,
+   setting errno, if the thread has failed to write.  */
+
+static bool
+async_flush (struct async_stream *as)
+{
+  pthread_mutex_lock (&as->lock);
+  async_enqueue (as, as->cur);
+  int err = as->err;
+  pthread_mutex_unlock (&as->lock);
+
+  as->cur = NULL;
+  errno = err;
+  return ! err;
+}
+
+static ssize_t
+async_write (void *cookie, char const *buf, size_t size)
+{
+  struct async_stream *as = cookie;
+
+  for (size_t n = size; n; )
+    {
+      if (! as->cur)
+        {
+          as->cur = xmalloc (sizeof *as->cur);
+          as->cur->used = 0;
+        }
+      size_t chunk = MIN (n, ASYNC_CHUNK_SIZE - as->cur->used);
+      memcpy (as->cur->data + as->cur->used, buf, chunk);
+      as->cur->used += chunk;
+      buf += chunk;
+      n -= chunk;
+      if (as->cur->used == ASYNC_CHUNK_SIZE && ! async_flush (as))
+        return -1;
+    }
+
+  return size;
+}
+
+/* Stop the thread of AS, then close its underlying stream as xfclose
+   does, diagnosing any failure of the thread to write.  */
+
+static int
+async_close (void *cookie)
+{
+  struct async_stream *as = cookie;
+  FILE *fp = as->fp;
+  char const *file = as->file;
+  int err = 0;
+
+  if (as->started)
+    {
+      if (as->writing && as->cur)
+        async_flush (as);
+      pthread_mutex_lock (&as->lock);
+      as->closing = true;
+      pthread_cond_broadcast (&as->cond);
+      pthread_mutex_unlock (&as->lock);
+      pthread_join (as->thread, NULL);
+      if (as->writing)
+        err = as->err;
+    }
+
+  free (as->cur);
+  while (as->head)
+    free (async_dequeue (as));
+  pthread_cond_destroy (&as->cond);
+  pthread_mutex_destroy (&as->lock);
+  bool started = as->started;
+  free (as);
+
+  if (started)
+    {
+      if (err)
+        {
+          errno = err;
+          sort_die (_("write failed"), file);
+        }
+      xfclose (fp, file);
+    }
+  return 0;
+}
+
+/* Return a stream that reads ahead the stream FP if MODE is "r", or
+   writes it behind if MODE is "w", keeping at most MAX_CHUNKS chunks
+   queued.  FILE is the name of FP, as for xfclose.  Closing the new
+   stream closes FP.  Return FP itself if the new stream cannot be
+   created, or if FP is too small a regular file to read ahead.  */
+
+static FILE *
+async_open (FILE *fp, char const *file, char const *mode, size_t max_chunks)
+{
+  static cookie_io_functions_t const async_functions =
+    {
+      .read = async_read,
+      .write = async_write,
+      .close = async_close
+    };
+  bool writing = *mode == 'w';
+  struct stat st;
+
+  if (! writing && fstat (fileno (fp), &st) == 0 && S_ISREG (st.st_mode)
+      && st.st_size <= ASYNC_CHUNK_SIZE)
+    return fp;
+
+  struct async_stream *as = xmalloc (sizeof *as);
+  as->fp = fp;
+  as->file = file;
+  as->writing = writing;
+  as->cur = NULL;
+  as->pos = 0;
+  as->head = NULL;
+  as->tail = &as->head;
+  as->nchunks = 0;
+  as->max_chunks = MAX (1, max_chunks);
+  as->eof = as->closing = as->started = false;
+  as->err = 0;
+  pthread_mutex_init (&as->lock, NULL);
+  pthread_cond_init (&as->cond, NULL);
+
+  FILE *afp = fopencookie (as, mode, async_functions);
+  if (! afp)
+    {
+      pthread_cond_destroy (&as->cond);
+      pthread_mutex_destroy (&as->lock);
+      free (as);
+      return fp;
+    }
+
+  as->started = pthread_create (&as->thread, NULL,
+                                writing ? async_writer : async_reader,
+                                as) == 0;
+  if (! as->started)
+    {
+      fclose (afp);
+      return fp;
+    }
+  return afp;
+}
+
+static struct tempnode *
+maybe_create_temp (FILE **pfp, bool survive_fd_exhaustion)
+{
+  int tempfd;
+  struct tempnode *node = create_temp_file (&tempfd, survive_fd_exhaustion);
+  if (! node)
+    return NULL;
+
+  node->state = UNCOMPRESSED;
+  sort_stats.temp_files++;
+
+  if (compress_temp)
+    {
+      node->state = COMPRESSED;
+      *pfp = temp_stream_open (tempfd, "w");
+      if (! *pfp)
+        sort_die (_("couldn't create temporary file"), node->name);
+      return node;
+    }
+
+  if (compress_program)
+    {
+      int pipefds[2];
+
+      node->pid = pipe_fork (pipefds, MAX_FORK_TRIES_COMPRESS);
+      if (0 < node->pid)
+        {
+          close (tempfd);
+          close (pipefds[0]);
+          tempfd = pipefds[1];
+
+          register_proc (node);
+        }
+      else if (node->pid == 0)
+        {
+          close (pipefds[1]);
+          move_fd (tempfd, STDOUT_FILENO);
+          move_fd (pipefds[0], STDIN_FILENO);
+
+          execlp (compress_program, compress_program, (char *) NULL);
+
+          async_safe_die (errno, "couldn't execute compress program");
+        }
+    }
+
+  *pfp = fdopen (tempfd, "w");
+  if (! *pfp)
+    sort_die (_("couldn't create temporary file"), node->name);
+
+  return node;
+}
+
+static struct tempnode *
+create_temp (FILE **pfp)
+{
+  return maybe_create_temp (pfp, false);
+}
+
+
+static FILE *
+open_temp (struct tempnode *temp)
+{
+  int tempfd, pipefds[2];
+  FILE *fp = NULL;
+
+  if (temp->state == UNREAPED)
+    wait_proc (temp->pid);
+
+  tempfd = open (temp->name, O_RDONLY);
+  if (tempfd < 0)
+    return NULL;
+
+  if (temp->state == COMPRESSED)
+    {
+      fp = temp_stream_open (tempfd, "r");
+      if (! fp)
+        {
+          int saved_errno = errno;
+          close (tempfd);
+          errno = saved_errno;
+        }
+      return fp;
+    }
+
+  pid_t child = pipe_fork (pipefds, MAX_FORK_TRIES_DECOMPRESS);
+
+  switch (child)
+    {
+    case -1:
+      if (errno != EMFILE)
+        die (SORT_FAILURE, errno, _("couldn't create process for %s -d"),
+             quoteaf (compress_program));
+      close (tempfd);
+      errno = EMFILE;
+      break;
+
+    case 0:
+      close (pipefds[0]);
+      move_fd (tempfd, STDIN_FILENO);
+      move_fd (pipefds[1], STDOUT_FILENO);
+
+      execlp (compress_program, compress_program, "-d", (char *) NULL);
+
+      async_safe_die (errno, "couldn't execute compress program (with -d)");
+
+    default:
+      temp->pid = child;
+      register_proc (temp);
+      close (tempfd);
+      close (pipefds[1]);
+
+      fp = fdopen (pipefds[0], "r");
+      if (! fp)
+        {
+          int saved_errno = errno;
+          close (pipefds[0]);
+          errno = saved_errno;
+        }
+      break;
+    }
+
+  return fp;
+}
+static void
+add_temp_dir (char const *dir)
+{
+  if (temp_dir_count == temp_dir_alloc)
+    temp_dirs = X2NREALLOC (temp_dirs, &temp_dir_alloc);
+
+  temp_dirs[temp_dir_count++] = dir;
+}
+
+
+static void
+zaptemp (struct tempnode *node)
+{
+  char const *name = node->name;
+  struct tempnode *next;
+  int unlink_status;
+  int unlink_errno = 0;
+  struct cs_status cs;
+
+  if (node->state == UNREAPED)
+    wait_proc (node->pid);
+
+  /* Every temporary file is written just once, and removed once
+     merged, so count its size now.  */
+  struct stat st;
+  if (stats && stat (name, &st) == 0)
+    sort_stats.temp_written += st.st_size;
+
+  next = node->next;
+  cs_enter (&cs);
+  unlink_status = unlink (name);
+  unlink_errno = errno;
+  *node->link = next;
+  if (next)
+    next->link = node->link;
+  else
+    temptail = node->link;
+  cs_leave (&cs);
+
+  if (unlink_status != 0)
+    error (0, unlink_errno, _("warning: cannot remove: %s"), quotef (name));
+
+  /* Free the nodes all at once when the last one is removed.  */
+  if (! temphead)
+    arena_free (&temp_arena, true);
+}
+
+#if HAVE_NL_LANGINFO
+
+static int
+struct_month_cmp (void const *m1, void const *m2)
+{
+  struct month const *month1 = m1;
+  struct month const *month2 = m2;
+  return strcmp (month1->name, month2->name);
+}
+
+#endif
+
+
+static void
+inittables (void)
+{
+  size_t i;
+
+  for (i = 0; i < UCHAR_LIM; ++i)
+    {
+      blanks[i] = field_sep (i);
+      nonprinting[i] = ! isprint (i);
+      nondictionary[i] = ! isalnum (i) && ! field_sep (i);
+      fold_toupper[i] = toupper (i);
+    }
+
+#if HAVE_NL_LANGINFO
+  if (hard_LC_TIME)
+    {
+      for (i = 0; i < MONTHS_PER_YEAR; i++)
         {
           char const *s;
           size_t s_len;
@@ -1119,6 +2084,23 @@ specify_nthreads (int oi, char c, char const *s)
   return nthreads;
 }
 
+/* Specify the number of lines to output with --head.  */
+static size_t
+specify_head_lines (int oi, char c, char const *s)
+{
+  uintmax_t n;
+  enum strtol_error e = xstrtoumax (s, NULL, 10, &n, "");
+  if (e == LONGINT_OVERFLOW)
+    return SIZE_MAX;
+  if (e != LONGINT_OK)
+    xstrtol_fatal (e, oi, c, long_options, s);
+  if (SIZE_MAX < n)
+    n = SIZE_MAX;
+  if (n == 0)
+    die (SORT_FAILURE, 0, _("number of lines must be nonzero"));
+  return n;
+}
+
 /* Return the default sort size.  */
 static size_t
 default_sort_size (void)
@@ -1222,6 +2204,18 @@ sort_buffer_size (FILE *const *fps, size_t nfps,
   return size;
 }
 
+/* Return the share of the memory budget SIZE of an internal sort that
+   the sort buffer may take.  The rest is left for the collation keys
+   of its lines if XFRM, which may take as much as the buffer, and for
+   the input read ahead of it if READ_AHEAD, which may take half as
+   much.  */
+
+static size_t
+sort_buffer_share (size_t size, bool xfrm, bool read_ahead)
+{
+  return size / (2 + 2 * xfrm + read_ahead) * 2;
+}
+
 /* Initialize BUF.  Reserve LINE_BYTES bytes for each line; LINE_BYTES
    must be at least sizeof (struct line).  Allocate ALLOC bytes
    initially.  */
@@ -1247,6 +2241,10 @@ initbuf (struct buffer *buf, size_t line_bytes, size_t alloc)
   buf->alloc = alloc;
   buf->used = buf->left = buf->nlines = 0;
   buf->eof = false;
+  buf->map = NULL;
+  buf->xfrm = NULL;
+  buf->xfrm_size = buf->xfrm_max = 0;
+  buf->grow_limit = 0;
 }
 
 /* Return one past the limit of the line array.  */
@@ -1396,6 +2394,306 @@ limfield (struct line const *line, struct keyfield const *key)
   return ptr;
 }
 
+/* Return the first bytes of the key from TEXT to LIM as a big-endian
+   integer, skipping bytes ignored by KEY and translating the rest as
+   KEY specifies (KEY is null for a whole-line key), and padding short
+   keys with zeros.  If two keys' prefixes differ, their order is that
+   of the prefixes.  */
+
+static uint64_t
+key_prefix (char const *text, char const *lim, struct keyfield const *key)
+{
+  bool const *ignore = key ? key->ignore : NULL;
+  char const *translate = key ? key->translate : NULL;
+  uint64_t prefix = 0;
+  int shift = sizeof prefix * CHAR_BIT;
+
+  for (; text < lim && shift; text++)
+    {
+      unsigned char ch = *text;
+      if (ignore && ignore[ch])
+        continue;
+      if (translate)
+        ch = translate[ch];
+      shift -= CHAR_BIT;
+      prefix |= (uint64_t) ch << shift;
+    }
+
+  return prefix;
+}
+
+static uint64_t line_key_prefix (struct line const *,
+                                 struct keyfield const *);
+
+/* Precompute, for efficiency, the position of the first key KEY (if
+   not null) of LINE, whose text and length are set, and the line's
+   key prefix.  */
+
+static void
+init_line_key (struct line *line, struct keyfield const *key)
+{
+  if (key)
+    {
+      char *text = line->text;
+      line->keylim = (key->eword == SIZE_MAX
+                      ? text + line->length - 1
+                      : limfield (line, key));
+
+      if (key->sword != SIZE_MAX)
+        line->keybeg = begfield (line, key);
+      else
+        {
+          /* A line of a mapped file ends in its delimiter, not in a
+             null byte, so do not skip past the key's limit.  */
+          if (key->skipsblanks)
+            while (text < line->keylim && blanks[to_uchar (*text)])
+              text++;
+          line->keybeg = text;
+        }
+    }
+  else
+    line->keybeg = NULL;
+
+  if (key_prefixes)
+    line->keyprefix = line_key_prefix (line, key);
+}
+
+/* Map the input file FP into memory for fillbuf to record its lines
+   in place, if possible, and return true if this was done.  BUF must
+   hold no lines.  Lines are left terminated by the line delimiter,
+   not by NUL, so this is not done if comparisons might collate whole
+   lines.  Nor is it done for files that are empty, are not regular,
+   do not end in a line delimiter, or are the output, which may be
+   truncated before the file's lines are written.  */
+
+static bool
+map_input (struct buffer *buf, FILE *fp)
+{
+  int fd = fileno (fp);
+  struct stat st;
+
+  if (hard_LC_COLLATE
+      || fstat (fd, &st) != 0 || ! S_ISREG (st.st_mode)
+      || st.st_size <= 0 || SIZE_MAX < st.st_size
+      || lseek (fd, 0, SEEK_CUR) != 0)
+    return false;
+
+  struct stat *outst = get_outstatus ();
+  if (outst && SAME_INODE (st, *outst))
+    return false;
+
+  /* Sorting reads the mapping only, but --debug and --unique-unordered
+     temporarily null-terminate keys in place, so it must be writable,
+     with changes to it private.  */
+  char *map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  if (map == MAP_FAILED)
+    return false;
+  if (map[st.st_size - 1] != eolchar)
+    {
+      munmap (map, st.st_size);
+      return false;
+    }
+
+  buf->map = map;
+  buf->mapsize = st.st_size;
+  buf->mapped = 0;
+  buf->used = buf->left = buf->nlines = 0;
+  return true;
+}
+
+/* Unmap the input file that map_input mapped for BUF, once none of
+   its lines are needed any more.  */
+
+static void
+unmap_input (struct buffer *buf)
+{
+  if (buf->map)
+    {
+      munmap (buf->map, buf->mapsize);
+      buf->map = NULL;
+      buf->used = buf->left = buf->nlines = 0;
+    }
+}
+
+/* Double the size of BUF, which holds USED bytes of text and NLINES
+   lines, if that keeps it within its grow limit and memory allows,
+   keeping its text and lines.  Return true if BUF was grown.  */
+
+static bool
+growbuf (struct buffer *buf)
+{
+  if (buf->grow_limit / 2 < buf->alloc)
+    return false;
+
+  size_t alloc = 2 * buf->alloc;
+  char *p = malloc (alloc);
+  if (! p)
+    return false;
+
+  /* Copy the text to the start of the new buffer, and the lines to its
+     end, pointing them into the copied text.  Without keys, a line's
+     key is null or its collation key, which does not move.  */
+  struct line const *lines = buffer_linelim (buf) - buf->nlines;
+  struct line *new_lines = (struct line *) (p + alloc) - buf->nlines;
+  memcpy (p, buf->buf, buf->used);
+  for (size_t i = 0; i < buf->nlines; i++)
+    {
+      new_lines[i] = lines[i];
+      new_lines[i].text = p + (lines[i].text - buf->buf);
+      if (keylist)
+        {
+          new_lines[i].keybeg = p + (lines[i].keybeg - buf->buf);
+          new_lines[i].keylim = p + (lines[i].keylim - buf->buf);
+        }
+    }
+
+  free (buf->buf);
+  buf->buf = p;
+  buf->alloc = alloc;
+  if (stats)
+    atomic_fetch_add (&sort_stats.buffer_growths, 1);
+  return true;
+}
+
+/* Like fillbuf, for a BUF whose input is mapped.  Record as many of
+   the remaining lines as the line array has room for.  */
+
+static bool
+fillbuf_mapped (struct buffer *buf)
+{
+  struct keyfield const *key = keylist;
+  char eol = eolchar;
+  size_t mergesize = merge_buffer_size - MIN_MERGE_BUFFER_SIZE;
+  size_t maxlines = buf->alloc / buf->line_bytes;
+  struct line *line = buffer_linelim (buf);
+  char *ptr = buf->map + buf->mapped;
+  char *lim = buf->map + buf->mapsize;
+
+  /* map_input checked that the file ends in a delimiter.  */
+  for (buf->nlines = 0; buf->nlines < maxlines && ptr < lim; )
+    {
+      size_t ends[LINE_INDEX_BATCH];
+      size_t nends = line_index (ptr, lim - ptr, eol, ends,
+                                 MIN (LINE_INDEX_BATCH,
+                                      maxlines - buf->nlines));
+      char *line_start = ptr;
+      for (size_t i = 0; i < nends; i++)
+        {
+          char *p = ptr + ends[i];
+          line--;
+          line->text = line_start;
+          line->length = p - line_start;
+          mergesize = MAX (mergesize, line->length);
+          init_line_key (line, key);
+          line_start = p;
+        }
+      buf->nlines += nends;
+      ptr = line_start;
+    }
+
+  buf->mapped = ptr - buf->map;
+  buf->eof = ptr == lim;
+  merge_buffer_size = mergesize + MIN_MERGE_BUFFER_SIZE;
+  return true;
+}
+
+/* The size of a block of collation keys.  */
+enum { XFRM_BLOCK_SIZE = 1024 * 1024 };
+
+/* Free the blocks of collation keys from BLOCK on.  */
+
+static void
+free_xfrm_blocks (struct xfrm_block *block)
+{
+  while (block)
+    {
+      struct xfrm_block *next = block->next;
+      free (block);
+      block = next;
+    }
+}
+
+static size_t xstrxfrm (char *restrict, char const *restrict, size_t);
+
+/* Transform TEXT, a line of LENGTH bytes that ends in a null byte and
+   may contain others, into *XBUF, of *XSIZE bytes, growing it as
+   needed.  Each null-terminated part of TEXT is transformed by
+   strxfrm and followed by a null byte, so that comparing the results
+   with memcmp orders lines as xmemcoll0 does.  Return the length of
+   the result.  */
+
+static size_t
+xfrm_text (char const *text, size_t length, char **xbuf, size_t *xsize)
+{
+  size_t len = 0;
+
+  if (! *xsize)
+    *xbuf = x2realloc (*xbuf, xsize);
+
+  for (char const *p = text; p < text + length; p += strlen (p) + 1)
+    while (true)
+      {
+        size_t avail = *xsize - len;
+        size_t n = xstrxfrm (*xbuf + len, p, avail);
+        if (n < avail)
+          {
+            len += n + 1;
+            break;
+          }
+        while (*xsize - len <= n)
+          *xbuf = x2realloc (*xbuf, xsize);
+      }
+
+  return len;
+}
+
+/* Set the KEYBEG and KEYLIM of each line of BUF after the first NOLD,
+   which compare uses when there are no keys, to the line's collation
+   key.  Stop once the keys would take more than BUF->xfrm_max bytes;
+   the remaining lines are collated at each comparison.  */
+
+static void
+xfrm_lines (struct buffer *buf, size_t nold)
+{
+  static char *xbuf;
+  static size_t xsize;
+  struct line *line = buffer_linelim (buf) - nold;
+  struct line const *linebase = buffer_linelim (buf) - buf->nlines;
+
+  /* Reuse the newest block for a fresh buffer's lines.  */
+  if (nold == 0 && buf->xfrm)
+    {
+      free_xfrm_blocks (buf->xfrm->next);
+      buf->xfrm->next = NULL;
+      buf->xfrm->used = 0;
+      buf->xfrm_size = buf->xfrm->size;
+    }
+
+  while (linebase < line)
+    {
+      line--;
+      size_t len = xfrm_text (line->text, line->length, &xbuf, &xsize);
+      struct xfrm_block *block = buf->xfrm;
+      if (! block || block->size - block->used < len)
+        {
+          size_t size = MAX (XFRM_BLOCK_SIZE, len);
+          if (buf->xfrm_max - buf->xfrm_size < size)
+            break;
+          block = xmalloc (FLEXSIZEOF (struct xfrm_block, data, size));
+          block->next = buf->xfrm;
+          block->size = size;
+          block->used = 0;
+          buf->xfrm = block;
+          buf->xfrm_size += size;
+        }
+
+      line->keybeg = memcpy (block->data + block->used, xbuf, len);
+      line->keylim = line->keybeg + len;
+      block->used += len;
+    }
+}
+
 /* Fill BUF reading from FP, moving buf->left bytes from the end
    of buf->buf to the beginning first.  If EOF is reached and the
    file wasn't terminated by a newline, supply one.  Set up BUF's line
@@ -1412,12 +2710,16 @@ fillbuf (struct buffer *buf, FILE *fp, char const *file)
   if (buf->eof)
     return false;
 
+  if (buf->map)
+    return fillbuf_mapped (buf);
+
   if (buf->used != buf->left)
     {
       memmove (buf->buf, buf->buf + buf->used - buf->left, buf->left);
       buf->used = buf->left;
       buf->nlines = 0;
     }
+  size_t nold = buf->nlines;
 
   while (true)
     {
@@ -1436,7 +2738,6 @@ fillbuf (struct buffer *buf, FILE *fp, char const *file)
           size_t readsize = (avail - 1) / (line_bytes + 1);
           size_t bytes_read = fread (ptr, 1, readsize, fp);
           char *ptrlim = ptr + bytes_read;
-          char *p;
           avail -= bytes_read;
 
           if (bytes_read != readsize)
@@ -1453,41 +2754,33 @@ fillbuf (struct buffer *buf, FILE *fp, char const *file)
                 }
             }
 
-          /* Find and record each line in the just-read input.  */
-          while ((p = memchr (ptr, eol, ptrlim - ptr)))
+          /* Find and record each line in the just-read input, finding
+             the ends of a batch of lines at a time.  */
+          size_t nends;
+          do
             {
-              /* Delimit the line with NUL. This eliminates the need to
-                 temporarily replace the last byte with NUL when calling
-                 xmemcoll, which increases performance.  */
-              *p = '\0';
-              ptr = p + 1;
-              line--;
-              line->text = line_start;
-              line->length = ptr - line_start;
-              mergesize = MAX (mergesize, line->length);
-              avail -= line_bytes;
-
-              if (key)
+              size_t ends[LINE_INDEX_BATCH];
+              nends = line_index (ptr, ptrlim - ptr, eol,
+                                  ends, LINE_INDEX_BATCH);
+              for (size_t i = 0; i < nends; i++)
                 {
-                  /* Precompute the position of the first key for
-                     efficiency.  */
-                  line->keylim = (key->eword == SIZE_MAX
-                                  ? p
-                                  : limfield (line, key));
-
-                  if (key->sword != SIZE_MAX)
-                    line->keybeg = begfield (line, key);
-                  else
-                    {
-                      if (key->skipsblanks)
-                        while (blanks[to_uchar (*line_start)])
-                          line_start++;
-                      line->keybeg = line_start;
-                    }
+                  char *p = ptr + ends[i];
+                  /* Delimit the line with NUL. This eliminates the need to
+                     temporarily replace the last byte with NUL when calling
+                     xmemcoll, which increases performance.  */
+                  p[-1] = '\0';
+                  line--;
+                  line->text = line_start;
+                  line->length = p - line_start;
+                  mergesize = MAX (mergesize, line->length);
+                  avail -= line_bytes;
+                  init_line_key (line, key);
+                  line_start = p;
                 }
-
-              line_start = ptr;
+              if (nends)
+                ptr = line_start;
             }
+          while (nends == LINE_INDEX_BATCH);
 
           ptr = ptrlim;
           if (buf->eof)
@@ -1498,8 +2791,12 @@ fillbuf (struct buffer *buf, FILE *fp, char const *file)
       buf->nlines = buffer_linelim (buf) - line;
       if (buf->nlines != 0)
         {
+          if (! buf->eof && buf->grow_limit && growbuf (buf))
+            continue;
           buf->left = ptr - line_start;
           merge_buffer_size = mergesize + MIN_MERGE_BUFFER_SIZE;
+          if (buf->xfrm_max)
+            xfrm_lines (buf, nold);
           return true;
         }
 
@@ -1637,53 +2934,213 @@ numcompare (char const *a, char const *b)
   while (blanks[to_uchar (*b)])
     b++;
 
-  return strnumcmp (a, b, decimal_point, thousands_sep);
+  return strnumcmp (a, b, decimal_point, thousands_sep);
+}
+
+/* Work around a problem whereby the long double value returned by glibc's
+   strtold ("NaN", ...) contains uninitialized bits: clear all bytes of
+   A and B before calling strtold.  FIXME: remove this function if
+   gnulib guarantees that strtold's result is always well defined.  */
+static int
+nan_compare (char const *sa, char const *sb)
+{
+  long double a;
+  memset (&a, 0, sizeof a);
+  a = strtold (sa, NULL);
+
+  long double b;
+  memset (&b, 0, sizeof b);
+  b = strtold (sb, NULL);
+
+  return memcmp (&a, &b, sizeof a);
+}
+
+static int
+general_numcompare (char const *sa, char const *sb)
+{
+  /* FIXME: maybe add option to try expensive FP conversion
+     only if A and B can't be compared more cheaply/accurately.  */
+
+  char *ea;
+  char *eb;
+  long double a = strtold (sa, &ea);
+  long double b = strtold (sb, &eb);
+
+  /* Put conversion errors at the start of the collating sequence.  */
+  if (sa == ea)
+    return sb == eb ? 0 : -1;
+  if (sb == eb)
+    return 1;
+
+  /* Sort numbers in the usual way, where -0 == +0.  Put NaNs after
+     conversion errors but before numbers; sort them by internal
+     bit-pattern, for lack of a more portable alternative.  */
+  return (a < b ? -1
+          : a > b ? 1
+          : a == b ? 0
+          : b == b ? -1
+          : a == a ? 1
+          : nan_compare (sa, sb));
+}
+
+/* Return true if KEY is a numeric key.  */
+
+static inline bool
+key_numeric (struct keyfield const *key)
+{
+  return key->numeric || key->general_numeric || key->human_numeric;
+}
+
+/* Return an integer whose order is consistent with that of numcompare,
+   or if HUMAN with that of human_numcompare, for the NUL-terminated
+   number NUMBER: the unit order, the sign, the count of integer digits
+   (leading zeros and thousands separators aside) and the first
+   significant digits, packed into bit-fields from the top down.
+   Negative numbers have their count and digits complemented.
+   Numbers that differ only after NUMERIC_PREFIX_DIGITS significant
+   digits get equal results.  */
+
+enum
+  {
+    NUMERIC_PREFIX_DIGITS = 12,
+    NUMERIC_PREFIX_DIGIT_BITS = 4,
+    NUMERIC_PREFIX_LENGTH_BITS = 9,
+    NUMERIC_PREFIX_MAGNITUDE_BITS = (NUMERIC_PREFIX_LENGTH_BITS
+                                     + (NUMERIC_PREFIX_DIGITS
+                                        * NUMERIC_PREFIX_DIGIT_BITS))
+  };
+
+static uint64_t
+numeric_prefix (char const *number, bool human)
+{
+  uint64_t const magnitude_mask =
+    ((uint64_t) 1 << NUMERIC_PREFIX_MAGNITUDE_BITS) - 1;
+  size_t const length_max = (1 << NUMERIC_PREFIX_LENGTH_BITS) - 1;
+  size_t length = 0;
+  uint64_t digits = 0;
+  int ndigits = 0;
+
+  while (blanks[to_uchar (*number)])
+    number++;
+
+  int order = human ? find_unit_order (number) : 0;
+  bool negative = *number == '-';
+  char const *p = number + negative;
+
+  while (*p == '0' || to_uchar (*p) == thousands_sep)
+    p++;
+
+  for (; ISDIGIT (*p); length++)
+    {
+      if (ndigits < NUMERIC_PREFIX_DIGITS)
+        {
+          digits = digits << NUMERIC_PREFIX_DIGIT_BITS | (*p - '0');
+          ndigits++;
+        }
+      do
+        p++;
+      while (to_uchar (*p) == thousands_sep);
+    }
+
+  bool nonzero = length != 0;
+  if (to_uchar (*p) == decimal_point)
+    while (ISDIGIT (*++p))
+      {
+        nonzero |= *p != '0';
+        if (ndigits < NUMERIC_PREFIX_DIGITS)
+          {
+            digits = digits << NUMERIC_PREFIX_DIGIT_BITS | (*p - '0');
+            ndigits++;
+          }
+      }
+
+  /* Digits are comparable only between numbers of the same length,
+     so drop them from the lengths that do not fit.  */
+  if (length_max <= length)
+    {
+      length = length_max;
+      digits = 0;
+    }
+  else
+    digits <<= (NUMERIC_PREFIX_DIGITS - ndigits) * NUMERIC_PREFIX_DIGIT_BITS;
+  uint64_t magnitude =
+    ((uint64_t) length << (NUMERIC_PREFIX_DIGITS * NUMERIC_PREFIX_DIGIT_BITS)
+     | digits);
+
+  /* Units have orders in -8..8, and signs are classed 0 for negative,
+     1 for zero, and 2 for positive.  */
+  uint64_t prefix = order + 8;
+  prefix <<= 2;
+  if (! nonzero)
+    prefix = (prefix | 1) << NUMERIC_PREFIX_MAGNITUDE_BITS;
+  else if (negative)
+    prefix = (prefix << NUMERIC_PREFIX_MAGNITUDE_BITS
+              | (~magnitude & magnitude_mask));
+  else
+    prefix = (prefix | 2) << NUMERIC_PREFIX_MAGNITUDE_BITS | magnitude;
+  return prefix;
 }
 
-/* Work around a problem whereby the long double value returned by glibc's
-   strtold ("NaN", ...) contains uninitialized bits: clear all bytes of
-   A and B before calling strtold.  FIXME: remove this function if
-   gnulib guarantees that strtold's result is always well defined.  */
-static int
-nan_compare (char const *sa, char const *sb)
+/* Return an integer whose order is consistent with that of
+   general_numcompare for the NUL-terminated number NUMBER: 0 for a
+   conversion error, 1 for a NaN, and otherwise the bits of the value
+   rounded to double, rearranged so that they order as unsigned
+   integers do.  */
+
+static uint64_t
+general_numeric_prefix (char const *number)
 {
-  long double a;
-  memset (&a, 0, sizeof a);
-  a = strtold (sa, NULL);
+  char *end;
+  long double value = strtold (number, &end);
 
-  long double b;
-  memset (&b, 0, sizeof b);
-  b = strtold (sb, NULL);
+  if (number == end)
+    return 0;
+  if (value != value)
+    return 1;
 
-  return memcmp (&a, &b, sizeof a);
+  /* Rounding preserves order, and -0 == +0.  */
+  double d = value == 0 ? 0 : value;
+  uint64_t bits;
+  verify (sizeof d == sizeof bits);
+  memcpy (&bits, &d, sizeof bits);
+
+  uint64_t const sign_bit = (uint64_t) 1 << (sizeof bits * CHAR_BIT - 1);
+  return bits & sign_bit ? ~bits : bits | sign_bit;
 }
 
-static int
-general_numcompare (char const *sa, char const *sb)
-{
-  /* FIXME: maybe add option to try expensive FP conversion
-     only if A and B can't be compared more cheaply/accurately.  */
+static uint64_t random_key_prefix (char const *, char const *,
+                                   struct keyfield const *);
 
-  char *ea;
-  char *eb;
-  long double a = strtold (sa, &ea);
-  long double b = strtold (sb, &eb);
+/* Return the keyprefix of LINE, whose first key is KEY (null if there
+   are no keys) and has been located.  */
 
-  /* Put conversion errors at the start of the collating sequence.  */
-  if (sa == ea)
-    return sb == eb ? 0 : -1;
-  if (sb == eb)
-    return 1;
+static uint64_t
+line_key_prefix (struct line const *line, struct keyfield const *key)
+{
+  if (! key)
+    return key_prefix (line->text, line->text + line->length - 1, NULL);
 
-  /* Sort numbers in the usual way, where -0 == +0.  Put NaNs after
-     conversion errors but before numbers; sort them by internal
-     bit-pattern, for lack of a more portable alternative.  */
-  return (a < b ? -1
-          : a > b ? 1
-          : a == b ? 0
-          : b == b ? -1
-          : a == a ? 1
-          : nan_compare (sa, sb));
+  char *beg = line->keybeg;
+  char *lim = MAX (line->keybeg, line->keylim);
+
+  if (key->random)
+    return random_key_prefix (beg, lim, key);
+  if (! key_numeric (key))
+    return key_prefix (beg, lim, key);
+
+  /* Parse a null-terminated copy of the key, as writing to a line
+     of a mapped file would copy its page.  */
+  char stackbuf[64];
+  size_t len = lim - beg;
+  char *copy = len < sizeof stackbuf ? stackbuf : xmalloc (len + 1);
+  memcpy (copy, beg, len);
+  copy[len] = '\0';
+  uint64_t prefix = (key->general_numeric
+                     ? general_numeric_prefix (copy)
+                     : numeric_prefix (copy, key->human_numeric));
+  if (copy != stackbuf)
+    free (copy);
+  return prefix;
 }
 
 /* Return an integer in 1..12 of the month name MONTH.
@@ -1732,6 +3189,9 @@ getmonth (char const *month, char **ea)
 /* A randomly chosen MD5 state, used for random comparison.  */
 static struct md5_ctx random_md5_state;
 
+/* A randomly chosen key for random_hash, from the same random bytes.  */
+static uint64_t random_hash_key[2];
+
 /* Initialize the randomly chosen MD5 state.  */
 
 static void
@@ -1746,6 +3206,95 @@ random_md5_state_init (char const *random_source)
     sort_die (_("close failed"), random_source);
   md5_init_ctx (&random_md5_state);
   md5_process_bytes (buf, sizeof buf, &random_md5_state);
+
+  verify (sizeof random_hash_key <= sizeof buf);
+  memcpy (random_hash_key, buf, sizeof random_hash_key);
+}
+
+/* One round of SipHash on the state V.  */
+
+static inline void
+sip_round (uint64_t v[4])
+{
+#define ROTL64(x, n) ((x) << (n) | (x) >> (64 - (n)))
+  v[0] += v[1]; v[1] = ROTL64 (v[1], 13); v[1] ^= v[0];
+  v[0] = ROTL64 (v[0], 32);
+  v[2] += v[3]; v[3] = ROTL64 (v[3], 16); v[3] ^= v[2];
+  v[0] += v[3]; v[3] = ROTL64 (v[3], 21); v[3] ^= v[0];
+  v[2] += v[1]; v[1] = ROTL64 (v[1], 17); v[1] ^= v[2];
+  v[2] = ROTL64 (v[2], 32);
+#undef ROTL64
+}
+
+/* Return the SipHash-2-4 of the LEN bytes at DATA, keyed with
+   random_hash_key.  */
+
+static uint64_t
+random_hash (char const *data, size_t len)
+{
+  uint64_t v[4] = { random_hash_key[0] ^ 0x736f6d6570736575,
+                    random_hash_key[1] ^ 0x646f72616e646f6d,
+                    random_hash_key[0] ^ 0x6c7967656e657261,
+                    random_hash_key[1] ^ 0x7465646279746573 };
+  uint64_t m;
+  size_t n = len;
+
+  for (; sizeof m <= n; data += sizeof m, n -= sizeof m)
+    {
+      memcpy (&m, data, sizeof m);
+      v[3] ^= m;
+      sip_round (v);
+      sip_round (v);
+      v[0] ^= m;
+    }
+
+  m = 0;
+  memcpy (&m, data, n);
+  m |= (uint64_t) len << 56;
+  v[3] ^= m;
+  sip_round (v);
+  sip_round (v);
+  v[0] ^= m;
+
+  v[2] ^= 0xff;
+  for (int i = 0; i < 4; i++)
+    sip_round (v);
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/* Return the keyprefix of the random key KEY from BEG to LIM: a keyed
+   hash of the key as compare_random sees it, after ignoring and
+   translating characters and, in a hard locale, transforming it for
+   collation.  Equal keys thus have equal prefixes, and unequal keys
+   are ordered at random by their prefixes, without hashing the keys
+   again at each comparison.  */
+
+static uint64_t
+random_key_prefix (char const *beg, char const *lim,
+                   struct keyfield const *key)
+{
+  /* Concurrent merges read lines, so each thread has its own copies.  */
+  static _Thread_local char *tbuf;
+  static _Thread_local size_t tsize;
+  static _Thread_local char *xbuf;
+  static _Thread_local size_t xsize;
+  char const *translate = key->translate;
+  bool const *ignore = key->ignore;
+  size_t len = 0;
+
+  if (! (ignore || translate || hard_LC_COLLATE))
+    return random_hash (beg, lim - beg);
+
+  while (tsize <= (size_t) (lim - beg))
+    tbuf = X2REALLOC (tbuf, &tsize);
+  for (char const *p = beg; p < lim; p++)
+    if (! (ignore && ignore[to_uchar (*p)]))
+      tbuf[len++] = translate ? translate[to_uchar (*p)] : *p;
+  tbuf[len] = '\0';
+
+  if (! hard_LC_COLLATE)
+    return random_hash (tbuf, len);
+  return random_hash (xbuf, xfrm_text (tbuf, len + 1, &xbuf, &xsize));
 }
 
 /* This is like strxfrm, except it reports any error and exits.  */
@@ -1790,6 +3339,11 @@ compare_random (char *restrict texta, size_t lena,
   struct md5_ctx s[2];
   s[0] = s[1] = random_md5_state;
 
+  /* Identical keys, as those of lines with equal keyprefixes usually
+     are, compare equal however they are hashed.  */
+  if (lena == lenb && memcmp (texta, textb, lena) == 0)
+    return 0;
+
   if (hard_LC_COLLATE)
     {
       char const *lima = texta + lena;
@@ -1934,14 +3488,6 @@ mark_key (size_t offset, size_t width)
     }
 }
 
-/* Return true if KEY is a numeric key.  */
-
-static inline bool
-key_numeric (struct keyfield const *key)
-{
-  return key->numeric || key->general_numeric || key->human_numeric;
-}
-
 /* For LINE, output a debugging line that underlines KEY in LINE.
    If KEY is null, underline the whole line.  */
 
@@ -2208,7 +3754,13 @@ keycompare (struct line const *a, struct line const *b)
           void *allocated IF_LINT (= NULL);
           char stackbuf[4000];
 
-          if (ignore || translate)
+          /* Lines of a mapped file are not null-terminated, and writing
+             to them would copy their pages.  */
+          bool copy = (ignore || translate
+                       || a->text[a->length - 1] != '\0'
+                       || b->text[b->length - 1] != '\0');
+
+          if (copy)
             {
               /* Compute with copies of the keys, which are the result of
                  translating or ignoring characters, and which need their
@@ -2271,7 +3823,7 @@ keycompare (struct line const *a, struct line const *b)
                 diff = xmemcoll0 (ta, tlena + 1, tb, tlenb + 1);
             }
 
-          if (ignore || translate)
+          if (copy)
             free (allocated);
           else
             {
@@ -2379,6 +3931,16 @@ compare (struct line const *a, struct line const *b)
   int diff;
   size_t alen, blen;
 
+  if (stats)
+    ncompares++;
+
+  /* Lines whose cached key prefixes differ are ordered by them.  */
+  if (key_prefixes && a->keyprefix != b->keyprefix)
+    {
+      diff = a->keyprefix < b->keyprefix ? -1 : 1;
+      return (keylist ? keylist->reverse : reverse) ? -diff : diff;
+    }
+
   /* First try to compare on the specified keys (if any).
      The only two cases with no key at all are unadorned sort,
      and unadorned sort -r. */
@@ -2397,6 +3959,14 @@ compare (struct line const *a, struct line const *b)
     diff = - NONZERO (blen);
   else if (blen == 0)
     diff = 1;
+  else if (hard_LC_COLLATE && ! keylist && a->keybeg && b->keybeg)
+    {
+      /* Compare the collation keys of the lines, from xfrm_lines.  */
+      size_t xalen = a->keylim - a->keybeg;
+      size_t xblen = b->keylim - b->keybeg;
+      if (! (diff = memcmp (a->keybeg, b->keybeg, MIN (xalen, xblen))))
+        diff = xalen < xblen ? -1 : xalen != xblen;
+    }
   else if (hard_LC_COLLATE)
     {
       /* xmemcoll0 is a performance enhancement as
@@ -2441,6 +4011,13 @@ write_line (struct line const *line, FILE *fp, char const *output_file)
 
       debug_line (line);
     }
+  else if (ebuf[-1] == eolchar)
+    {
+      /* The line is still terminated as in the input, which is
+         mapped.  Do not write to it, to avoid copying its page.  */
+      if (fwrite (buf, 1, n_bytes, fp) != n_bytes)
+        sort_die (_("write failed"), output_file);
+    }
   else
     {
       ebuf[-1] = eolchar;
@@ -2470,6 +4047,7 @@ check (char const *file_name, char checkonly)
   initbuf (&buf, sizeof (struct line),
            MAX (merge_buffer_size, sort_size));
   temp.text = NULL;
+  temp.keybeg = NULL;
 
   while (fillbuf (&buf, fp, file_name))
     {
@@ -2525,6 +4103,7 @@ check (char const *file_name, char checkonly)
         }
       memcpy (temp.text, line->text, line->length);
       temp.length = line->length;
+      temp.keyprefix = line->keyprefix;
       if (key)
         {
           temp.keybeg = temp.text + (line->keybeg - line->text);
@@ -2557,22 +4136,43 @@ open_input_files (struct sortfile *files, size_t nfiles, FILE ***pfps)
                 : stream_open (files[i].name, "r"));
       if (!fps[i])
         break;
+
+      struct stat st;
+      if (stats && files[i].temp && stat (files[i].name, &st) == 0)
+        sort_stats.temp_read += st.st_size;
     }
 
   return i;
 }
 
+/* Return true if the current line of input A of a merge is to be
+   output before that of input B.  CUR gives the current line of each
+   input, and is null for inputs at end of file.  Break ties by input
+   number, so that the merge is stable.  */
+
+static inline bool
+merge_precedes (struct line const *const *cur, size_t a, size_t b)
+{
+  if (! cur[a])
+    return false;
+  if (! cur[b])
+    return true;
+  int diff = compare (cur[a], cur[b]);
+  return diff < 0 || (diff == 0 && a < b);
+}
+
 /* Merge lines from FILES onto OFP.  NTEMPS is the number of temporary
    files (all of which are at the start of the FILES array), and
    NFILES is the number of files; 0 <= NTEMPS <= NFILES <= NMERGE.
    FPS is the vector of open stream corresponding to the files.
+   SIZE is the total size to allocate for the input buffers.
    Close input and output streams before returning.
    OUTPUT_FILE gives the name of the output file.  If it is NULL,
    the output file is standard output.  */
 
 static void
 mergefps (struct sortfile *files, size_t ntemps, size_t nfiles,
-          FILE *ofp, char const *output_file, FILE **fps)
+          FILE *ofp, char const *output_file, FILE **fps, size_t size)
 {
   struct buffer *buffer = xnmalloc (nfiles, sizeof *buffer);
                                 /* Input buffers for each file. */
@@ -2581,63 +4181,71 @@ mergefps (struct sortfile *files, size_t ntemps, size_t nfiles,
                                 /* &saved if there is a saved line. */
   size_t savealloc = 0;		/* Size allocated for the saved line. */
   struct line const **cur = xnmalloc (nfiles, sizeof *cur);
-                                /* Current line in each line table. */
+                                /* Current line in each line table,
+                                   or null at end of file. */
   struct line const **base = xnmalloc (nfiles, sizeof *base);
                                 /* Base of each line table.  */
-  size_t *ord = xnmalloc (nfiles, sizeof *ord);
-                                /* Table representing a permutation of fps,
-                                   such that cur[ord[0]] is the smallest line
-                                   and will be next output. */
+  size_t *tree = xnmalloc (nfiles, sizeof *tree);
+                                /* Loser tree of the files: tree[0] is
+                                   the file whose current line will be
+                                   output next, and tree[N] for
+                                   0 < N < NFILES is the loser of the
+                                   match at node N, whose children are
+                                   nodes 2*N and 2*N + 1.  Node NFILES + I
+                                   is the leaf for file I. */
   size_t i;
-  size_t j;
-  size_t t;
+  size_t n;
   struct keyfield const *key = keylist;
   saved.text = NULL;
+  saved.keybeg = NULL;
 
   /* Read initial lines from each input file. */
-  for (i = 0; i < nfiles; )
+  for (i = 0; i < nfiles; i++)
     {
       initbuf (&buffer[i], sizeof (struct line),
-               MAX (merge_buffer_size, sort_size / nfiles));
+               MAX (merge_buffer_size, size / nfiles));
       if (fillbuf (&buffer[i], fps[i], files[i].name))
         {
           struct line const *linelim = buffer_linelim (&buffer[i]);
           cur[i] = linelim - 1;
           base[i] = linelim - buffer[i].nlines;
-          i++;
         }
       else
         {
           /* fps[i] is empty; eliminate it from future consideration.  */
+          cur[i] = NULL;
           xfclose (fps[i], files[i].name);
           if (i < ntemps)
-            {
-              ntemps--;
-              zaptemp (files[i].name);
-            }
+            zaptemp (files[i].temp);
           free (buffer[i].buf);
-          --nfiles;
-          for (j = i; j < nfiles; ++j)
-            {
-              files[j] = files[j + 1];
-              fps[j] = fps[j + 1];
-            }
         }
     }
 
-  /* Set up the ord table according to comparisons among input lines.
-     Since this only reorders two items if one is strictly greater than
-     the other, it is stable. */
-  for (i = 0; i < nfiles; ++i)
-    ord[i] = i;
-  for (i = 1; i < nfiles; ++i)
-    if (0 < compare (cur[ord[i - 1]], cur[ord[i]]))
-      t = ord[i - 1], ord[i - 1] = ord[i], ord[i] = t, i = 0;
+  /* Play the initial tournament from the leaves up, temporarily
+     keeping the winner of the match at node N in WINNER[N].  */
+  if (1 < nfiles)
+    {
+      size_t *winner = xnmalloc (nfiles, sizeof *winner);
+      for (n = nfiles - 1; 0 < n; n--)
+        {
+          size_t lo = 2 * n < nfiles ? winner[2 * n] : 2 * n - nfiles;
+          size_t hi = (2 * n + 1 < nfiles
+                       ? winner[2 * n + 1] : 2 * n + 1 - nfiles);
+          bool hi_wins = merge_precedes (cur, hi, lo);
+          winner[n] = hi_wins ? hi : lo;
+          tree[n] = hi_wins ? lo : hi;
+        }
+      tree[0] = winner[1];
+      free (winner);
+    }
+  else if (nfiles)
+    tree[0] = 0;
 
   /* Repeatedly output the smallest line until no input remains. */
-  while (nfiles)
+  while (nfiles && cur[tree[0]])
     {
-      struct line const *smallest = cur[ord[0]];
+      size_t w = tree[0];
+      struct line const *smallest = cur[w];
 
       /* If uniquified output is turned on, output only the first of
          an identical series of lines. */
@@ -2666,6 +4274,7 @@ mergefps (struct sortfile *files, size_t ntemps, size_t nfiles,
                 }
               saved.length = smallest->length;
               memcpy (saved.text, smallest->text, saved.length);
+              saved.keyprefix = smallest->keyprefix;
               if (key)
                 {
                   saved.keybeg =
@@ -2679,70 +4288,35 @@ mergefps (struct sortfile *files, size_t ntemps, size_t nfiles,
         write_line (smallest, ofp, output_file);
 
       /* Check if we need to read more lines into core. */
-      if (base[ord[0]] < smallest)
-        cur[ord[0]] = smallest - 1;
+      if (base[w] < smallest)
+        cur[w] = smallest - 1;
+      else if (fillbuf (&buffer[w], fps[w], files[w].name))
+        {
+          struct line const *linelim = buffer_linelim (&buffer[w]);
+          cur[w] = linelim - 1;
+          base[w] = linelim - buffer[w].nlines;
+        }
       else
         {
-          if (fillbuf (&buffer[ord[0]], fps[ord[0]], files[ord[0]].name))
-            {
-              struct line const *linelim = buffer_linelim (&buffer[ord[0]]);
-              cur[ord[0]] = linelim - 1;
-              base[ord[0]] = linelim - buffer[ord[0]].nlines;
-            }
-          else
-            {
-              /* We reached EOF on fps[ord[0]].  */
-              for (i = 1; i < nfiles; ++i)
-                if (ord[i] > ord[0])
-                  --ord[i];
-              --nfiles;
-              xfclose (fps[ord[0]], files[ord[0]].name);
-              if (ord[0] < ntemps)
-                {
-                  ntemps--;
-                  zaptemp (files[ord[0]].name);
-                }
-              free (buffer[ord[0]].buf);
-              for (i = ord[0]; i < nfiles; ++i)
-                {
-                  fps[i] = fps[i + 1];
-                  files[i] = files[i + 1];
-                  buffer[i] = buffer[i + 1];
-                  cur[i] = cur[i + 1];
-                  base[i] = base[i + 1];
-                }
-              for (i = 0; i < nfiles; ++i)
-                ord[i] = ord[i + 1];
-              continue;
-            }
+          /* We reached EOF on fps[w].  */
+          cur[w] = NULL;
+          xfclose (fps[w], files[w].name);
+          if (w < ntemps)
+            zaptemp (files[w].temp);
+          free (buffer[w].buf);
         }
 
-      /* The new line just read in may be larger than other lines
-         already in main memory; push it back in the queue until we
-         encounter a line larger than it.  Optimize for the common
-         case where the new line is smallest.  */
-      {
-        size_t lo = 1;
-        size_t hi = nfiles;
-        size_t probe = lo;
-        size_t ord0 = ord[0];
-        size_t count_of_smaller_lines;
-
-        while (lo < hi)
+      /* Replay the matches on the path from W's leaf to the root,
+         which takes about log2 (NFILES) comparisons however the new
+         line compares to the others.  */
+      for (n = (nfiles + w) / 2; 0 < n; n /= 2)
+        if (merge_precedes (cur, tree[n], w))
           {
-            int cmp = compare (cur[ord0], cur[ord[probe]]);
-            if (cmp < 0 || (cmp == 0 && ord0 < ord[probe]))
-              hi = probe;
-            else
-              lo = probe + 1;
-            probe = (lo + hi) / 2;
+            size_t loser = w;
+            w = tree[n];
+            tree[n] = loser;
           }
-
-        count_of_smaller_lines = lo - 1;
-        for (j = 0; j < count_of_smaller_lines; j++)
-          ord[j] = ord[j + 1];
-        ord[count_of_smaller_lines] = ord0;
-      }
+      tree[0] = w;
     }
 
   if (unique && savedline)
@@ -2754,7 +4328,7 @@ mergefps (struct sortfile *files, size_t ntemps, size_t nfiles,
   xfclose (ofp, output_file);
   free (fps);
   free (buffer);
-  free (ord);
+  free (tree);
   free (base);
   free (cur);
 }
@@ -2776,22 +4350,19 @@ mergefiles (struct sortfile *files, size_t ntemps, size_t nfiles,
   size_t nopened = open_input_files (files, nfiles, &fps);
   if (nopened < nfiles && nopened < 2)
     sort_die (_("open failed"), files[nopened].name);
-  mergefps (files, ntemps, nopened, ofp, output_file, fps);
+  mergefps (files, ntemps, nopened, ofp, output_file, fps, sort_size);
   return nopened;
 }
 
-/* Merge into T (of size NLINES) the two sorted arrays of lines
-   LO (with NLINES / 2 members), and
-   T - (NLINES / 2) (with NLINES - NLINES / 2 members).
+/* Merge into T (of size NLO + NHI) the two sorted arrays of lines
+   LO (with NLO members), and T - NLO (with NHI members).
    T and LO point just past their respective arrays, and the arrays
-   are in reverse order.  NLINES must be at least 2.  */
+   are in reverse order.  NLO and NHI must be nonzero.  */
 
 static void
-mergelines (struct line *restrict t, size_t nlines,
+mergelines (struct line *restrict t, size_t nlo, size_t nhi,
             struct line const *restrict lo)
 {
-  size_t nlo = nlines / 2;
-  size_t nhi = nlines - nlo;
   struct line *hi = t - nlo;
 
   while (true)
@@ -2819,6 +4390,45 @@ mergelines (struct line *restrict t, size_t nlines,
       }
 }
 
+/* Merge into T (of size NLO + NHI) the two sorted arrays of lines
+   T (with NLO members), and HI (with NHI members), which replaces the
+   last NHI members of T.  This is like mergelines, except that it
+   fills T from its last line, so it is the shorter HI that must be
+   copied elsewhere.  NLO and NHI must be nonzero.  */
+
+static void
+mergelines_from_end (struct line *restrict t, size_t nlo, size_t nhi,
+                     struct line const *restrict hi)
+{
+  struct line *lo = t - nlo;
+  struct line *dest = lo - nhi;
+  hi -= nhi;
+
+  while (true)
+    if (0 < compare (lo, hi))
+      {
+        *dest++ = *lo++;
+        if (! --nlo)
+          {
+            do
+              *dest++ = *hi++;
+            while (--nhi);
+
+            return;
+          }
+      }
+    else
+      {
+        *dest++ = *hi++;
+        if (! --nhi)
+          {
+            /* LO must equal DEST now, and there is no need to copy
+               from LO to DEST.  */
+            return;
+          }
+      }
+}
+
 /* Sort the array LINES with NLINES members, using TEMP for temporary space.
    Do this all within one thread.  NLINES must be at least 2.
    If TO_TEMP, put the sorted output into TEMP, and TEMP is as large as LINES.
@@ -2871,15 +4481,336 @@ sequential_sort (struct line *restrict lines, size_t nlines,
       struct line const *sorted_lo;
       if (to_temp)
         {
-          dest = temp;
-          sorted_lo = lines;
+          dest = temp;
+          sorted_lo = lines;
+        }
+      else
+        {
+          dest = lines;
+          sorted_lo = temp;
+        }
+      mergelines (dest, nlo, nhi, sorted_lo);
+    }
+}
+
+/* Return the radix bucket of LINE for byte offset DEPTH of its first
+   key, or of the whole line if there are no keys: 0 if the key is
+   shorter than DEPTH + 1 bytes, otherwise 1 + the byte at DEPTH.
+   Take leading bytes from the key prefix, which radix_sortable
+   implies is cached, to avoid touching the line's text.  */
+
+static inline size_t
+radix_bucket (struct line const *line, size_t depth)
+{
+  char const *beg;
+  char const *lim;
+
+  if (keylist)
+    {
+      beg = line->keybeg;
+      lim = MAX (line->keybeg, line->keylim);
+    }
+  else
+    {
+      beg = line->text;
+      lim = line->text + line->length - 1;
+    }
+
+  if (lim - beg <= depth)
+    return 0;
+  if (depth < sizeof line->keyprefix)
+    return ((line->keyprefix >> ((sizeof line->keyprefix - 1 - depth)
+                                 * CHAR_BIT))
+            & UCHAR_MAX) + 1;
+  return to_uchar (beg[depth]) + 1;
+}
+
+/* Sort the array LINES with NLINES members in place, as
+   sequential_sort does when TO_TEMP is false, by comparing the bytes
+   of each line's key from offset DEPTH onward.  LINES points just past
+   the end of the array, which is in reverse order, and TEMP has room
+   for NLINES / 2 lines.  LEVEL is the recursion depth.
+   This is an in-place MSD radix sort (McIlroy, Bostic and McIlroy's
+   "American flag sort"): each pass distributes the lines into one
+   bucket per byte value, plus bucket 0 for keys that have ended, and
+   then sorts each bucket on the following byte.  Buckets that are
+   small, or whose keys are all equal, are passed to sequential_sort,
+   so that compare has the last word.  The sort is not stable, so it
+   is used only if radix_sortable.  */
+
+static void
+radix_sort (struct line *restrict lines, size_t nlines,
+            struct line *restrict temp, size_t depth, unsigned int level)
+{
+  struct line *base = lines - nlines;
+  size_t next[UCHAR_LIM + 1];
+  size_t end[UCHAR_LIM + 1];
+  size_t b;
+  size_t i;
+
+  if (nlines < RADIX_SORT_THRESHOLD || RADIX_SORT_MAX_DEPTH <= level)
+    {
+      sequential_sort (lines, nlines, temp, false);
+      return;
+    }
+
+  /* Count the bucket sizes, skipping over bytes that all lines share.  */
+  while (true)
+    {
+      memset (end, 0, sizeof end);
+      for (i = 0; i < nlines; i++)
+        end[radix_bucket (&base[i], depth)]++;
+
+      b = radix_bucket (&base[0], depth);
+      if (end[b] != nlines)
+        break;
+      if (b == 0)
+        {
+          /* The keys are all equal.  Without keys, so are the lines.  */
+          if (keylist)
+            sequential_sort (lines, nlines, temp, false);
+          return;
+        }
+      depth++;
+    }
+
+  /* Lay the buckets out in decreasing order from BASE, so that
+     bucket 0 ends at LINES, and then permute each line into place.  */
+  size_t pos = 0;
+  for (b = UCHAR_LIM + 1; b-- != 0; )
+    {
+      next[b] = pos;
+      pos += end[b];
+      end[b] = pos;
+    }
+
+  for (b = UCHAR_LIM + 1; b-- != 0; )
+    while (next[b] < end[b])
+      {
+        struct line line = base[next[b]];
+        size_t lb;
+
+        while ((lb = radix_bucket (&line, depth)) != b)
+          {
+            struct line displaced = base[next[lb]];
+            base[next[lb]++] = line;
+            line = displaced;
+          }
+
+        base[next[b]++] = line;
+      }
+
+  /* Sort the lines within each bucket.  */
+  pos = 0;
+  for (b = UCHAR_LIM + 1; b-- != 0; )
+    {
+      size_t n = end[b] - pos;
+      if (1 < n)
+        {
+          if (b != 0)
+            radix_sort (base + end[b], n, temp, depth + 1, level + 1);
+          else if (keylist)
+            sequential_sort (base + end[b], n, temp, false);
+        }
+      pos = end[b];
+    }
+}
+
+/* Sort the array LINES with NLINES members in place, using TEMP,
+   which has room for NLINES / 2 lines, for temporary space, without
+   regard to any order the lines are in already.
+   NLINES must be at least 2.  */
+
+static void
+unordered_sort (struct line *restrict lines, size_t nlines,
+                struct line *restrict temp)
+{
+  if (radix_sortable)
+    radix_sort (lines, nlines, temp, 0, 0);
+  else
+    sequential_sort (lines, nlines, temp, false);
+}
+
+/* Return the number of lines at the start of the array LINES with
+   NLINES members that are in ascending order, where LINES points just
+   past the end of the array, which is in reverse order.  If REVERSE
+   and the lines start in strictly descending order instead, reverse
+   them in place and return their number; as no two of them compare
+   equal, this keeps the sort stable.  NLINES must be nonzero.  */
+
+static size_t
+find_run (struct line *lines, size_t nlines, bool reverse)
+{
+  size_t n = 1;
+
+  if (reverse && 1 < nlines && 0 < compare (&lines[-1], &lines[-2]))
+    {
+      for (n = 2; n < nlines && 0 < compare (&lines[-n], &lines[-1 - n]);
+           n++)
+        continue;
+
+      for (struct line *lo = lines - n, *hi = lines - 1; lo < hi; lo++, hi--)
+        {
+          struct line tmp = *lo;
+          *lo = *hi;
+          *hi = tmp;
+        }
+    }
+  else
+    while (n < nlines && compare (&lines[-n], &lines[-1 - n]) <= 0)
+      n++;
+
+  return n;
+}
+
+/* Find the run of sorted lines that starts START lines into the array
+   LINES with NLINES members, as find_run does, and return its length.
+   If the run is short, sort a few lines more with it, counting them
+   in *SORTED; but if that count is already too large for the lines
+   seen so far, sort all the rest of the lines into one run.  TEMP is as for
+   internal_sort.  */
+
+static size_t
+next_run (struct line *restrict lines, size_t start, size_t nlines,
+          struct line *restrict temp, size_t *sorted)
+{
+  size_t rest = nlines - start;
+  size_t n = find_run (lines - start, rest, true);
+
+  if (n < NATURAL_RUN_MIN && n < rest)
+    {
+      if (*sorted && start / NATURAL_RUN_SLACK < *sorted)
+        {
+          n = rest;
+
+          /* If only such patches come before, sort them again with the
+             rest, so that they need no merging.  */
+          if (*sorted == start)
+            {
+              unordered_sort (lines, nlines, temp);
+              return n;
+            }
+        }
+      else
+        {
+          n = MIN (rest, NATURAL_RUN_MIN);
+          *sorted += n;
+        }
+      unordered_sort (lines - start, n, temp);
+    }
+
+  return n;
+}
+
+/* Merge the adjacent sorted runs of NLO lines and NHI lines that start
+   START lines into the array LINES, copying the shorter of the two
+   into TEMP.  NLO and NHI must be nonzero.  */
+
+static void
+merge_runs (struct line *restrict lines, size_t start, size_t nlo,
+            size_t nhi, struct line *restrict temp)
+{
+  struct line *t = lines - start;
+
+  /* Runs that are already in order need no merging; this is usual
+     for concatenations of sorted inputs.  */
+  if (compare (t - nlo, t - nlo - 1) <= 0)
+    return;
+
+  if (nlo <= nhi)
+    {
+      memcpy (temp - nlo, t - nlo, nlo * sizeof *t);
+      mergelines (t, nlo, nhi, temp);
+    }
+  else
+    {
+      memcpy (temp - nhi, t - nlo - nhi, nhi * sizeof *t);
+      mergelines_from_end (t, nlo, nhi, temp);
+    }
+}
+
+/* Return the power of the boundary between the adjacent runs of lines
+   [START, MID) and [MID, END) of an array with NLINES members: the
+   depth of the node of a balanced binary merge tree of the whole array
+   that would merge lines on both sides of the boundary.  */
+
+static unsigned int
+run_power (size_t start, size_t mid, size_t end, size_t nlines)
+{
+  /* Find the first bit in which the binary fractions of NLINES for
+     the midpoints of the runs differ, doubling both of them.  */
+  size_t a = start + mid;
+  size_t b = mid + end;
+  unsigned int power = 0;
+
+  while (true)
+    {
+      power++;
+      if (nlines <= a)
+        {
+          a -= nlines;
+          b -= nlines;
         }
-      else
+      else if (nlines <= b)
+        return power;
+      a *= 2;
+      b *= 2;
+    }
+}
+
+/* Sort the array LINES with NLINES members in place, using TEMP,
+   which has room for NLINES / 2 lines, for temporary space.
+   NLINES must be at least 2.
+   Take advantage of any runs of lines that are already in order, or
+   in strictly reverse order, by merging the runs as Munro and Wild's
+   powersort does ("Nearly-Optimal Mergesorts", ESA 2018): merge the
+   runs on a stack, each as soon as the boundaries after it are
+   shallower in the merge tree than its own.  Sorted input takes just
+   NLINES - 1 comparisons.  */
+
+static void
+internal_sort (struct line *restrict lines, size_t nlines,
+               struct line *restrict temp)
+{
+  struct
+  {
+    size_t start;
+    size_t len;
+    unsigned int power;
+  } stack[sizeof nlines * CHAR_BIT + 1];
+  size_t nstack = 0;
+  size_t sorted = 0;
+  size_t start = 0;
+  size_t len = next_run (lines, start, nlines, temp, &sorted);
+
+  while (start + len < nlines)
+    {
+      size_t next = start + len;
+      size_t next_len = next_run (lines, next, nlines, temp, &sorted);
+      unsigned int power = run_power (start, next, next + next_len, nlines);
+
+      while (nstack && power < stack[nstack - 1].power)
         {
-          dest = lines;
-          sorted_lo = temp;
+          nstack--;
+          merge_runs (lines, stack[nstack].start, stack[nstack].len, len,
+                      temp);
+          start = stack[nstack].start;
+          len += stack[nstack].len;
         }
-      mergelines (dest, nlines, sorted_lo);
+
+      stack[nstack].start = start;
+      stack[nstack].len = len;
+      stack[nstack].power = power;
+      nstack++;
+      start = next;
+      len = next_len;
+    }
+
+  while (nstack)
+    {
+      nstack--;
+      merge_runs (lines, stack[nstack].start, stack[nstack].len, len, temp);
+      len += stack[nstack].len;
     }
 }
 
@@ -2889,11 +4820,14 @@ static struct merge_node *init_node (struct merge_node *restrict,
 
 
 /* Create and return a merge tree for NTHREADS threads, sorting NLINES
-   lines, with destination DEST.  */
+   lines, with destination DEST, allocated from ARENA.  */
 static struct merge_node *
-merge_tree_init (size_t nthreads, size_t nlines, struct line *dest)
+merge_tree_init (struct arena *arena, size_t nthreads, size_t nlines,
+                 struct line *dest)
 {
-  struct merge_node *merge_tree = xmalloc (2 * sizeof *merge_tree * nthreads);
+  struct merge_node *merge_tree =
+    arena_alloc (arena, 2 * sizeof *merge_tree * nthreads,
+                 alignof (struct merge_node));
 
   struct merge_node *root = merge_tree;
   root->lo = root->hi = root->end_lo = root->end_hi = NULL;
@@ -2908,7 +4842,7 @@ merge_tree_init (size_t nthreads, size_t nlines, struct line *dest)
   return merge_tree;
 }
 
-/* Destroy the merge tree. */
+/* Destroy the merge tree.  Its memory is freed with its arena.  */
 static void
 merge_tree_destroy (size_t nthreads, struct merge_node *merge_tree)
 {
@@ -2920,8 +4854,6 @@ merge_tree_destroy (size_t nthreads, struct merge_node *merge_tree)
       pthread_mutex_destroy (&node->lock);
       node++;
     }
-
-  free (merge_tree);
 }
 
 /* Initialize a merge tree node and its descendants.  The node's
@@ -2975,18 +4907,6 @@ init_node (struct merge_node *restrict parent,
 }
 
 
-/* Compare two merge nodes A and B for priority.  */
-
-static int
-compare_nodes (void const *a, void const *b)
-{
-  struct merge_node const *nodea = a;
-  struct merge_node const *nodeb = b;
-  if (nodea->level == nodeb->level)
-      return (nodea->nlo + nodea->nhi) < (nodeb->nlo + nodeb->nhi);
-  return nodea->level < nodeb->level;
-}
-
 /* Lock a merge tree NODE.  */
 
 static inline void
@@ -3003,56 +4923,35 @@ unlock_node (struct merge_node *node)
   pthread_mutex_unlock (&node->lock);
 }
 
-/* Destroy merge QUEUE. */
+/* Initialize merge QUEUE, for merging TOTAL_LINES lines with the
+   threads of POOL and sending the output to TFP.  TEMP_OUTPUT is the
+   name of TFP, or is null if TFP is standard output.  */
 
 static void
-queue_destroy (struct merge_node_queue *queue)
+queue_init (struct merge_node_queue *queue, struct task_pool *pool,
+            size_t total_lines, FILE *tfp, char const *temp_output)
 {
-  heap_free (queue->priority_queue);
-  pthread_cond_destroy (&queue->cond);
-  pthread_mutex_destroy (&queue->mutex);
+  queue->pool = pool;
+  queue->total_lines = total_lines;
+  queue->tfp = tfp;
+  queue->temp_output = temp_output;
+  atomic_init (&queue->unfinished, 1);
 }
 
-/* Initialize merge QUEUE, allocating space suitable for a maximum of
-   NTHREADS threads.  */
-
-static void
-queue_init (struct merge_node_queue *queue, size_t nthreads)
-{
-  /* Though it's highly unlikely all nodes are in the heap at the same
-     time, the heap should accommodate all of them.  Counting a NULL
-     dummy head for the heap, reserve 2 * NTHREADS nodes.  */
-  queue->priority_queue = heap_alloc (compare_nodes, 2 * nthreads);
-  pthread_mutex_init (&queue->mutex, NULL);
-  pthread_cond_init (&queue->cond, NULL);
-}
+static void merge_node_task (void *, void *);
+static void pool_push (struct task_pool *, size_t, void (*) (void *, void *),
+                       void *, void *);
+static void pool_done (struct task_pool *, atomic_size_t *);
+static _Thread_local size_t pool_worker;
 
-/* Insert NODE into QUEUE.  The caller either holds a lock on NODE, or
-   does not need to lock NODE.  */
+/* Insert NODE into QUEUE, as a task of the calling thread.  The caller
+   either holds a lock on NODE, or does not need to lock NODE.  */
 
 static void
 queue_insert (struct merge_node_queue *queue, struct merge_node *node)
 {
-  pthread_mutex_lock (&queue->mutex);
-  heap_insert (queue->priority_queue, node);
   node->queued = true;
-  pthread_cond_signal (&queue->cond);
-  pthread_mutex_unlock (&queue->mutex);
-}
-
-/* Pop the top node off the priority QUEUE, lock the node, return it.  */
-
-static struct merge_node *
-queue_pop (struct merge_node_queue *queue)
-{
-  struct merge_node *node;
-  pthread_mutex_lock (&queue->mutex);
-  while (! (node = heap_remove_top (queue->priority_queue)))
-    pthread_cond_wait (&queue->cond, &queue->mutex);
-  pthread_mutex_unlock (&queue->mutex);
-  lock_node (node);
-  node->queued = false;
-  return node;
+  pool_push (queue->pool, pool_worker, merge_node_task, queue, node);
 }
 
 /* Output LINE to TFP, unless -u is specified and the line compares
@@ -3174,47 +5073,531 @@ queue_check_insert_parent (struct merge_node_queue *queue,
     }
   else if (node->nlo + node->nhi == 0)
     {
-      /* If the MERGE_ROOT NODE has finished merging, insert the
-         MERGE_END node.  */
-      queue_insert (queue, node->parent);
+      /* The MERGE_ROOT NODE has finished merging, and so has the
+         whole tree.  */
+      pool_done (queue->pool, &queue->unfinished);
     }
 }
 
-/* Repeatedly pop QUEUE for a node with lines to merge, and merge at least
-   some of those lines, until the MERGE_END node is popped.
-   TOTAL_LINES is the total number of lines.  If merging at the top
-   level, send output to TFP.  TEMP_OUTPUT is the name of TFP, or is
-   null if TFP is standard output.  */
+/* Merge at least some of the lines available to NODE of the merge
+   tree of QUEUE, and queue NODE and its parent again if they can then
+   be worked on.  This is the task for NODE that queue_insert queued.  */
 
 static void
-merge_loop (struct merge_node_queue *queue,
-            size_t total_lines, FILE *tfp, char const *temp_output)
+merge_node_task (void *queue_arg, void *node_arg)
+{
+  struct merge_node_queue *queue = queue_arg;
+  struct merge_node *node = node_arg;
+
+  lock_node (node);
+  node->queued = false;
+  mergelines_node (node, queue->total_lines, queue->tfp, queue->temp_output);
+  queue_check_insert (queue, node);
+  queue_check_insert_parent (queue, node);
+  unlock_node (node);
+}
+
+
+static void sortlines (struct line *restrict, size_t, size_t, size_t,
+                       struct merge_node *, struct merge_node_queue *);
+
+#ifdef CPU_SETSIZE
+
+/* A NUMA node, with the set of its CPUs that sort may run on.  */
+struct cpu_node
+{
+  cpu_set_t cpus;
+  size_t ncpus;
+};
+
+/* The NUMA nodes with CPUs that sort may run on, if there are at least
+   two of them; otherwise NCPU_NODES is 0, and threads are not pinned.
+   NCPUS is the total of the nodes' CPUs.  */
+static struct cpu_node *cpu_nodes;
+static size_t ncpu_nodes;
+static size_t ncpus;
+
+/* The CPUs that sort may run on.  */
+static cpu_set_t allowed_cpus;
+
+/* Add to NODE the CPUs in the Linux cpulist format list STR (e.g.,
+   "0-3,8-11") that are also in ALLOWED.  */
+
+static void
+parse_cpulist (struct cpu_node *node, char const *str,
+               cpu_set_t const *allowed)
+{
+  while (ISDIGIT (*str))
+    {
+      char *end;
+      unsigned long int lo = strtoul (str, &end, 10);
+      unsigned long int hi = lo;
+      if (*end == '-')
+        hi = strtoul (end + 1, &end, 10);
+      for (unsigned long int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET (cpu, allowed) && ! CPU_ISSET (cpu, &node->cpus))
+          {
+            CPU_SET (cpu, &node->cpus);
+            node->ncpus++;
+          }
+      str = end + (*end == ',');
+    }
+}
+
+/* Find the NUMA nodes that sort may run on, from the cpulist files
+   under /sys.  */
+
+static void
+init_cpu_nodes (void)
+{
+  static bool initialized;
+  cpu_set_t const *allowed = &allowed_cpus;
+  char const *dirname = "/sys/devices/system/node";
+  DIR *dirp;
+
+  if (initialized)
+    return;
+  initialized = true;
+
+  if (sched_getaffinity (0, sizeof allowed_cpus, &allowed_cpus) != 0
+      || ! (dirp = opendir (dirname)))
+    return;
+
+  struct dirent const *dp;
+  size_t nalloc = 0;
+  size_t n = 0;
+  while ((dp = readdir (dirp)))
+    {
+      char file[sizeof "/sys/devices/system/node/" + NAME_MAX
+                + sizeof "/cpulist"];
+      char list[4096];
+      if (! (STRNCMP_LIT (dp->d_name, "node") == 0
+             && ISDIGIT (dp->d_name[4])
+             && strlen (dp->d_name) <= NAME_MAX))
+        continue;
+      sprintf (file, "%s/%s/cpulist", dirname, dp->d_name);
+      int fd = open (file, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      ssize_t len = read (fd, list, sizeof list - 1);
+      close (fd);
+      if (len <= 0)
+        continue;
+      list[len] = '\0';
+
+      if (n == nalloc)
+        cpu_nodes = X2NREALLOC (cpu_nodes, &nalloc);
+      CPU_ZERO (&cpu_nodes[n].cpus);
+      cpu_nodes[n].ncpus = 0;
+      parse_cpulist (&cpu_nodes[n], list, allowed);
+      if (cpu_nodes[n].ncpus)
+        ncpus += cpu_nodes[n++].ncpus;
+    }
+  closedir (dirp);
+
+  if (n < 2)
+    {
+      free (cpu_nodes);
+      cpu_nodes = NULL;
+      ncpus = 0;
+      n = 0;
+    }
+  ncpu_nodes = n;
+}
+
+/* Return the NUMA node for sort thread number THREAD, or NULL if
+   threads are not pinned.  Threads are numbered in the order of the
+   parts of the line array that they sort, and are spread over the
+   nodes in proportion to their CPUs, so that each subtree of the
+   merge tree stays on as few nodes as possible.  */
+
+static struct cpu_node *
+thread_cpu_node (size_t thread)
+{
+  if (! ncpu_nodes)
+    return NULL;
+  size_t cpu = thread % ncpus;
+  struct cpu_node *node = cpu_nodes;
+  while (node->ncpus <= cpu)
+    cpu -= node++->ncpus;
+  return node;
+}
+
+/* Pin the calling thread to the NUMA node for sort thread number
+   THREAD, if threads are pinned.  */
+
+static void
+pin_thread (size_t thread)
+{
+  struct cpu_node *node = thread_cpu_node (thread);
+  if (node)
+    pthread_setaffinity_np (pthread_self (), sizeof node->cpus, &node->cpus);
+}
+
+/* Arguments for prefault_thread.  */
+
+struct prefault_args
+{
+  struct buffer const *buf;
+  size_t nthreads;
+  size_t thread;
+};
+
+/* Touch each page of the range [BEG, END) of BUF->buf, where BEG and
+   END are byte offsets that may be negative.  */
+
+static void
+prefault_range (struct buffer const *buf, ptrdiff_t beg, ptrdiff_t end)
+{
+  size_t pagesize = getpagesize ();
+  for (ptrdiff_t off = MAX (beg, 0); off < end; off += pagesize)
+    ((char volatile *) buf->buf)[off] = 0;
+}
+
+/* Touch first, from the NUMA node of the sort thread in DATA, the
+   pages of its part of a full line array, and of the part of the
+   buffer below the array that serves as its temporary storage, so
+   that the kernel allocates them on that node.  */
+
+static void *
+prefault_thread (void *data)
+{
+  struct prefault_args const *args = data;
+  struct buffer const *buf = args->buf;
+  ptrdiff_t nlines = buf->alloc / buf->line_bytes;
+  ptrdiff_t line_size = sizeof (struct line);
+  ptrdiff_t hi = (buf->alloc
+                  - args->thread * nlines / args->nthreads * line_size);
+  ptrdiff_t lo = (buf->alloc
+                  - (args->thread + 1) * nlines / args->nthreads * line_size);
+
+  pin_thread (args->thread);
+  prefault_range (buf, lo, hi);
+  prefault_range (buf, lo - nlines * line_size, hi - nlines * line_size);
+  return NULL;
+}
+
+/* If threads are pinned, have each of the NTHREADS threads that will
+   sort the buffer BUF, which must be freshly allocated, touch its
+   parts first.  */
+
+static void
+prefault_buffer (struct buffer const *buf, size_t nthreads)
+{
+  init_cpu_nodes ();
+  if (! ncpu_nodes || nthreads < 2)
+    return;
+
+  pthread_t *threads = xnmalloc (nthreads, sizeof *threads);
+  struct prefault_args *args = xnmalloc (nthreads, sizeof *args);
+  bool *started = xnmalloc (nthreads, sizeof *started);
+
+  for (size_t t = 0; t < nthreads; t++)
+    {
+      args[t].buf = buf;
+      args[t].nthreads = nthreads;
+      args[t].thread = t;
+      started[t] = pthread_create (&threads[t], NULL, prefault_thread,
+                                   &args[t]) == 0;
+    }
+  for (size_t t = 0; t < nthreads; t++)
+    if (started[t])
+      pthread_join (threads[t], NULL);
+
+  free (started);
+  free (args);
+  free (threads);
+}
+
+#else
+
+static void pin_thread (size_t thread) { }
+static void prefault_buffer (struct buffer const *buf, size_t nthreads) { }
+
+#endif
+
+/* A task for a thread pool: a call RUN (ARG1, ARG2).  */
+
+struct pool_task
+{
+  void (*run) (void *, void *);
+  void *arg1;
+  void *arg2;
+};
+
+/* The tasks of one worker of a thread pool, in a circular buffer.
+   The worker itself takes the newest task, while other workers that
+   have run out of tasks steal the oldest one, which tends to be the
+   largest.  */
+
+struct pool_deque
+{
+  pthread_mutex_t lock;
+  struct task_pool *pool;
+  struct pool_task *tasks;
+  size_t head;
+  size_t count;
+  size_t alloc;
+
+  /* For --stats, the number of tasks the worker ran, how many of
+     those it stole from other workers, and the time it slept for want
+     of tasks.  */
+  size_t ran;
+  size_t stolen;
+  xtime_t idle;
+};
+
+/* A pool of threads that run tasks, which may themselves push more
+   tasks.  Worker 0 is the thread that created the pool, which runs
+   tasks only while it waits in pool_wait; workers 1 through
+   NWORKERS - 1 are threads of the pool.  */
+
+struct task_pool
+{
+  size_t nworkers;
+  struct pool_deque *deques;
+  pthread_t *threads;
+  bool *started;
+
+  /* The number of tasks in all the deques, and of threads waiting
+     for IDLE_COND.  */
+  atomic_size_t ntasks;
+  atomic_size_t nsleepers;
+
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  bool shutdown;
+
+  /* When the pool was created, for --stats.  */
+  xtime_t created;
+};
+
+/* Push onto the deque of worker WORKER of POOL the task RUN (ARG1, ARG2),
+   and wake up a sleeping worker to run it.  */
+
+static void
+pool_push (struct task_pool *pool, size_t worker,
+           void (*run) (void *, void *), void *arg1, void *arg2)
 {
-  while (1)
+  struct pool_deque *d = &pool->deques[worker % pool->nworkers];
+
+  pthread_mutex_lock (&d->lock);
+  if (d->count == d->alloc)
+    {
+      size_t old_alloc = d->alloc;
+      d->tasks = X2NREALLOC (d->tasks, &d->alloc);
+
+      /* Unwrap the tasks that wrapped around the old end; the buffer
+         has at least doubled, so they fit after it.  */
+      memcpy (d->tasks + old_alloc, d->tasks, d->head * sizeof *d->tasks);
+    }
+  struct pool_task *task = &d->tasks[(d->head + d->count++) % d->alloc];
+  task->run = run;
+  task->arg1 = arg1;
+  task->arg2 = arg2;
+  pthread_mutex_unlock (&d->lock);
+
+  atomic_fetch_add (&pool->ntasks, 1);
+  if (atomic_load (&pool->nsleepers))
     {
-      struct merge_node *node = queue_pop (queue);
+      pthread_mutex_lock (&pool->idle_lock);
+      pthread_cond_signal (&pool->idle_cond);
+      pthread_mutex_unlock (&pool->idle_lock);
+    }
+}
 
-      if (node->level == MERGE_END)
+/* Take into *TASK a task from the deque D: its newest if NEWEST,
+   otherwise its oldest.  Return true if there was one.  */
+
+static bool
+pool_take (struct pool_deque *d, bool newest, struct pool_task *task)
+{
+  bool found = false;
+  pthread_mutex_lock (&d->lock);
+  if (d->count)
+    {
+      found = true;
+      d->count--;
+      if (newest)
+        *task = d->tasks[(d->head + d->count) % d->alloc];
+      else
         {
-          unlock_node (node);
-          /* Reinsert so other threads can pop it. */
-          queue_insert (queue, node);
-          break;
+          *task = d->tasks[d->head];
+          d->head = (d->head + 1) % d->alloc;
         }
-      mergelines_node (node, total_lines, tfp, temp_output);
-      queue_check_insert (queue, node);
-      queue_check_insert_parent (queue, node);
+    }
+  pthread_mutex_unlock (&d->lock);
+  return found;
+}
+
+/* Run one task of POOL as its worker number pool_worker: the newest of
+   the worker's own, or else the oldest of another worker's.  Return
+   false if there was no task to run.  */
+
+static bool
+pool_run_one (struct task_pool *pool)
+{
+  size_t self = pool_worker;
+  struct pool_deque *d = &pool->deques[self];
+  struct pool_task task;
+  bool stolen = false;
+
+  if (! pool_take (d, true, &task))
+    {
+      size_t i;
+      for (i = 1; i < pool->nworkers; i++)
+        if (pool_take (&pool->deques[(self + i) % pool->nworkers], false,
+                       &task))
+          break;
+      if (i == pool->nworkers)
+        return false;
+      stolen = true;
+    }
+  atomic_fetch_sub (&pool->ntasks, 1);
+
+  d->ran++;
+  d->stolen += stolen;
+  task.run (task.arg1, task.arg2);
+  return true;
+}
+
+/* Run tasks of POOL until *UNFINISHED is 0, sleeping while there are
+   none to run.  */
+
+static void
+pool_wait (struct task_pool *pool, atomic_size_t *unfinished)
+{
+  while (atomic_load (unfinished))
+    if (! pool_run_one (pool))
+      {
+        xtime_t start = stats ? gethrxtime () : 0;
+        pthread_mutex_lock (&pool->idle_lock);
+        atomic_fetch_add (&pool->nsleepers, 1);
+        while (atomic_load (unfinished) && ! atomic_load (&pool->ntasks))
+          pthread_cond_wait (&pool->idle_cond, &pool->idle_lock);
+        atomic_fetch_sub (&pool->nsleepers, 1);
+        pthread_mutex_unlock (&pool->idle_lock);
+        if (stats)
+          pool->deques[pool_worker].idle += gethrxtime () - start;
+      }
+}
+
+/* Decrement *UNFINISHED, and if it is then 0, wake up the threads in
+   pool_wait for it.  */
+
+static void
+pool_done (struct task_pool *pool, atomic_size_t *unfinished)
+{
+  if (atomic_fetch_sub (unfinished, 1) == 1)
+    {
+      pthread_mutex_lock (&pool->idle_lock);
+      pthread_cond_broadcast (&pool->idle_cond);
+      pthread_mutex_unlock (&pool->idle_lock);
+    }
+}
+
+/* The loop of a thread of a pool, whose deque is DATA.  */
+
+static void *
+pool_thread (void *data)
+{
+  struct pool_deque *d = data;
+  struct task_pool *pool = d->pool;
+  bool shutdown = false;
+
+  pool_worker = d - pool->deques;
+  pin_thread (pool_worker);
+
+  while (! shutdown)
+    if (! pool_run_one (pool))
+      {
+        xtime_t start = stats ? gethrxtime () : 0;
+        pthread_mutex_lock (&pool->idle_lock);
+        atomic_fetch_add (&pool->nsleepers, 1);
+        while (! pool->shutdown && ! atomic_load (&pool->ntasks))
+          pthread_cond_wait (&pool->idle_cond, &pool->idle_lock);
+        atomic_fetch_sub (&pool->nsleepers, 1);
+        shutdown = pool->shutdown && ! atomic_load (&pool->ntasks);
+        pthread_mutex_unlock (&pool->idle_lock);
+        if (stats)
+          d->idle += gethrxtime () - start;
+      }
+
+  atomic_fetch_add (&sort_stats.comparisons, ncompares);
+  return NULL;
+}
 
-      unlock_node (node);
+/* Return a new pool of NWORKERS workers, counting the calling thread.
+   If a thread cannot be created, the remaining workers steal its
+   tasks.  */
+
+static struct task_pool *
+pool_create (size_t nworkers)
+{
+  struct task_pool *pool = xmalloc (sizeof *pool);
+  pool->nworkers = nworkers;
+  pool->deques = xcalloc (nworkers, sizeof *pool->deques);
+  pool->threads = xnmalloc (nworkers, sizeof *pool->threads);
+  pool->started = xcalloc (nworkers, sizeof *pool->started);
+  atomic_init (&pool->ntasks, 0);
+  atomic_init (&pool->nsleepers, 0);
+  pthread_mutex_init (&pool->idle_lock, NULL);
+  pthread_cond_init (&pool->idle_cond, NULL);
+  pool->shutdown = false;
+  pool->created = stats ? gethrxtime () : 0;
+
+  for (size_t i = 0; i < nworkers; i++)
+    {
+      pthread_mutex_init (&pool->deques[i].lock, NULL);
+      pool->deques[i].pool = pool;
     }
+
+  pool_worker = 0;
+  for (size_t i = 1; i < nworkers; i++)
+    pool->started[i] = pthread_create (&pool->threads[i], NULL, pool_thread,
+                                       &pool->deques[i]) == 0;
+  return pool;
 }
 
+/* Stop the threads of POOL, which must have no tasks left, and free
+   it.  With --debug, report how the tasks were spread, and with
+   --stats, add the threads' times to sort_stats.  */
+
+static void
+pool_destroy (struct task_pool *pool)
+{
+  pthread_mutex_lock (&pool->idle_lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast (&pool->idle_cond);
+  pthread_mutex_unlock (&pool->idle_lock);
+
+  for (size_t i = 0; i < pool->nworkers; i++)
+    {
+      struct pool_deque *d = &pool->deques[i];
+      if (pool->started[i])
+        pthread_join (pool->threads[i], NULL);
+      if (stats && 1 < pool->nworkers)
+        error (0, 0, _("worker %zu: ran %zu tasks, of which %zu stolen"),
+               i, d->ran, d->stolen);
+      if (stats && (i == 0 || pool->started[i]))
+        {
+          sort_stats.threads++;
+          sort_stats.thread_time += gethrxtime () - pool->created;
+          sort_stats.thread_idle += d->idle;
+        }
+      pthread_mutex_destroy (&d->lock);
+      free (d->tasks);
+    }
 
-static void sortlines (struct line *restrict, size_t, size_t,
-                       struct merge_node *, struct merge_node_queue *,
-                       FILE *, char const *);
+  pthread_cond_destroy (&pool->idle_cond);
+  pthread_mutex_destroy (&pool->idle_lock);
+  free (pool->started);
+  free (pool->threads);
+  free (pool->deques);
+  free (pool);
+}
 
-/* Thread arguments for sortlines_thread. */
+/* Task arguments for sortlines_task. */
 
 struct thread_args
 {
@@ -3225,6 +5608,10 @@ struct thread_args
   /* Number of threads to use.  If 0 or 1, sort single-threaded.  */
   size_t nthreads;
 
+  /* The number of the first of these threads, counting from 0 in the
+     order of the lines that they sort.  */
+  size_t first_thread;
+
   /* Number of lines in LINES and DEST.  */
   size_t const total_lines;
 
@@ -3232,26 +5619,23 @@ struct thread_args
      to this node's parent. */
   struct merge_node *const node;
 
-  /* The priority queue controlling available work for the entire
-     internal sort.  */
+  /* The merging that remains to be done for the entire internal
+     sort.  */
   struct merge_node_queue *const queue;
 
-  /* If at the top level, the file to output to, and the file's name.
-     If the file is standard output, the file's name is null.  */
-  FILE *tfp;
-  char const *output_temp;
+  /* The count of unfinished tasks to decrement once sorted.  */
+  atomic_size_t *unfinished;
 };
 
-/* Like sortlines, except with a signature acceptable to pthread_create.  */
+/* Like sortlines, except with a signature acceptable to pool_push.  */
 
-static void *
-sortlines_thread (void *data)
+static void
+sortlines_task (void *data, void *unused)
 {
   struct thread_args const *args = data;
-  sortlines (args->lines, args->nthreads, args->total_lines,
-             args->node, args->queue, args->tfp,
-             args->output_temp);
-  return NULL;
+  sortlines (args->lines, args->nthreads, args->first_thread,
+             args->total_lines, args->node, args->queue);
+  pool_done (args->queue->pool, args->unfinished);
 }
 
 /* Sort lines, possibly in parallel.  The arguments are as in struct
@@ -3262,50 +5646,61 @@ sortlines_thread (void *data)
    binary merge tree and creates a NODE structure corresponding to all the
    future line merging NODE is responsible for. For each call to
    sortlines, half the available threads are assigned to each recursive
-   call, until a leaf node having only 1 available thread is reached.
+   call, which is pushed as a task of the thread pool, until a leaf node
+   having only 1 available thread is reached.  A thread waiting for the
+   tasks of its two halves runs other tasks meanwhile.
    Each leaf node then performs two sequential sorts, one on each half of
    the lines it is responsible for. It records in its NODE structure that
-   there are two sorted sublists available to merge from, and inserts its
-   NODE into the priority queue.
-   The binary merge phase then begins. Each thread drops into a loop
-   where the thread retrieves a NODE from the priority queue, merges lines
-   available to that NODE, and potentially insert NODE or its parent back
-   into the queue if there are sufficient available lines for them to
-   merge. This continues until all lines at all nodes of the merge tree
-   have been merged. */
+   there are two sorted sublists available to merge from, and queues
+   its NODE as a task.
+   The binary merge phase then begins. Each task merges lines available
+   to its NODE, and potentially queues NODE or its parent again if there
+   are sufficient available lines for them to merge.  This continues
+   until all lines at all nodes of the merge tree have been merged;
+   the caller waits for that with pool_wait.  */
 
 static void
-sortlines (struct line *restrict lines, size_t nthreads,
+sortlines (struct line *restrict lines, size_t nthreads, size_t first_thread,
            size_t total_lines, struct merge_node *node,
-           struct merge_node_queue *queue, FILE *tfp, char const *temp_output)
+           struct merge_node_queue *queue)
 {
   size_t nlines = node->nlo + node->nhi;
 
-  /* Calculate thread arguments. */
-  size_t lo_threads = nthreads / 2;
-  size_t hi_threads = nthreads - lo_threads;
-  pthread_t thread;
-  struct thread_args args = {lines, lo_threads, total_lines,
-                             node->lo_child, queue, tfp, temp_output};
-
-  if (nthreads > 1 && SUBTHREAD_LINES_HEURISTIC <= nlines
-      && pthread_create (&thread, NULL, sortlines_thread, &args) == 0)
+  if (nthreads > 1 && SUBTHREAD_LINES_HEURISTIC <= nlines)
     {
-      sortlines (lines - node->nlo, hi_threads, total_lines,
-                 node->hi_child, queue, tfp, temp_output);
-      pthread_join (thread, NULL);
+      /* Sort each half as a task of the worker with the number of its
+         first thread, which is pinned to that thread's NUMA node.  */
+      size_t lo_threads = nthreads / 2;
+      size_t hi_threads = nthreads - lo_threads;
+      atomic_size_t unfinished;
+      struct thread_args lo = {lines, lo_threads, first_thread, total_lines,
+                               node->lo_child, queue, &unfinished};
+      struct thread_args hi = {lines - node->nlo, hi_threads,
+                               first_thread + lo_threads, total_lines,
+                               node->hi_child, queue, &unfinished};
+      atomic_init (&unfinished, 2);
+      pool_push (queue->pool, lo.first_thread, sortlines_task, &lo, NULL);
+      pool_push (queue->pool, hi.first_thread, sortlines_task, &hi, NULL);
+      pool_wait (queue->pool, &unfinished);
     }
   else
     {
-      /* Nthreads = 1, this is a leaf NODE, or pthread_create failed.
-         Sort with 1 thread. */
+      /* Nthreads = 1, or this is a leaf NODE.  Sort with 1 thread. */
       size_t nlo = node->nlo;
       size_t nhi = node->nhi;
       struct line *temp = lines - total_lines;
+      bool report = stats && MERGE_ROOT < node->level;
+      xtime_t start = report ? gethrxtime () : 0;
       if (1 < nhi)
-        sequential_sort (lines - nlo, nhi, temp - nlo / 2, false);
+        internal_sort (lines - nlo, nhi, temp - nlo / 2);
       if (1 < nlo)
-        sequential_sort (lines, nlo, temp, false);
+        internal_sort (lines, nlo, temp);
+
+      /* With --stats, report the timing of each of several threads.  */
+      if (report)
+        error (0, 0, _("thread %zu: sorted %zu lines in %.3fs on worker %zu"),
+               first_thread, nlines, (gethrxtime () - start) / 1e9,
+               pool_worker);
 
       /* Update merge NODE. No need to lock yet. */
       node->lo = lines;
@@ -3314,7 +5709,6 @@ sortlines (struct line *restrict lines, size_t nthreads,
       node->end_hi = lines - nlo - nhi;
 
       queue_insert (queue, node);
-      merge_loop (queue, total_lines, tfp, temp_output);
     }
 }
 
@@ -3414,15 +5808,198 @@ check_output (char const *outfile)
     }
 }
 
+/* A merge into a temporary file during an intermediate pass of merge,
+   run in a thread of its own so that the pass's merges can proceed
+   concurrently.  */
+
+struct merge_job
+{
+  /* The input files and their open streams.  FILES is a copy, as
+     merge reuses its array for the pass's output files.  */
+  struct sortfile *files;
+  FILE **fps;
+  size_t nfiles;
+
+  /* The number of temporary files at the start of FILES.  The thread
+     leaves them alone, and finish_merge_job removes them, so that
+     only the main thread modifies the list of temporary files.  */
+  size_t ntemps;
+
+  /* The output file and its name.  */
+  FILE *ofp;
+  char const *output_file;
+
+  /* The total size of the input buffers.  */
+  size_t size;
+
+  /* The thread, valid if RUNNING.  */
+  pthread_t thread;
+  bool running;
+};
+
+/* Run the merge JOB, with a signature acceptable to pthread_create.  */
+
+static void *
+merge_job_thread (void *data)
+{
+  struct merge_job const *job = data;
+  mergefps (job->files, 0, job->nfiles, job->ofp, job->output_file,
+            job->fps, job->size);
+  atomic_fetch_add (&sort_stats.comparisons, ncompares);
+  return NULL;
+}
+
+/* Wait for JOB, if running, to finish, and remove its input files
+   that are temporary.  */
+
+static void
+finish_merge_job (struct merge_job *job)
+{
+  if (job->running)
+    {
+      pthread_join (job->thread, NULL);
+      for (size_t i = 0; i < job->ntemps; i++)
+        zaptemp (job->files[i].temp);
+      free (job->files);
+      job->running = false;
+    }
+}
+
+/* Start merging FILES onto OFP, as mergefiles does, in a thread of its
+   own in slot *NEXT of the array JOBS of NJOBS slots, after waiting
+   for the merge previously in that slot; then advance *NEXT to the
+   following slot.  NTEMPS, NFILES and OUTPUT_FILE are as for
+   mergefiles.  Return the number of files being merged.  */
+
+static size_t
+start_merge_job (struct sortfile *files, size_t ntemps, size_t nfiles,
+                 FILE *ofp, char const *output_file,
+                 struct merge_job *jobs, size_t njobs, size_t *next)
+{
+  struct merge_job *job = &jobs[*next];
+  *next = (*next + 1) % njobs;
+  finish_merge_job (job);
+
+  FILE **fps;
+  size_t nopened = open_input_files (files, nfiles, &fps);
+  if (nopened < nfiles)
+    {
+      /* Let the other merges release their file descriptors, and
+         try again.  */
+      for (size_t i = 0; i < nopened; i++)
+        xfclose (fps[i], files[i].name);
+      free (fps);
+      for (size_t i = 0; i < njobs; i++)
+        finish_merge_job (&jobs[i]);
+      nopened = open_input_files (files, nfiles, &fps);
+      if (nopened < nfiles && nopened < 2)
+        sort_die (_("open failed"), files[nopened].name);
+    }
+
+  job->files = xmemdup (files, nopened * sizeof *files);
+  job->fps = fps;
+  job->nfiles = nopened;
+  job->ntemps = MIN (ntemps, nopened);
+  job->ofp = ofp;
+  job->output_file = output_file;
+  job->size = sort_size / njobs;
+  job->running = (pthread_create (&job->thread, NULL, merge_job_thread, job)
+                  == 0);
+  if (! job->running)
+    {
+      mergefps (files, job->ntemps, nopened, ofp, output_file, fps,
+                sort_size);
+      free (job->files);
+    }
+  return nopened;
+}
+
+/* Merge FILES into a new temporary file, as mergefiles does, and
+   store the new file into *OUT.  NTEMPS and NFILES are as for
+   mergefiles.  If NJOBS is greater than 1, do this with
+   start_merge_job; the new file is then complete only once the
+   merge is finished.  Return the number of files merged.  */
+
+static size_t
+merge_into_temp (struct sortfile *files, size_t ntemps, size_t nfiles,
+                 struct sortfile *out,
+                 struct merge_job *jobs, size_t njobs, size_t *next)
+{
+  FILE *tfp;
+  struct tempnode *temp = create_temp (&tfp);
+  size_t nopened;
+
+  if (njobs <= 1)
+    nopened = mergefiles (files, ntemps, nfiles, tfp, temp->name);
+  else
+    nopened = start_merge_job (files, ntemps, nfiles, tfp, temp->name,
+                               jobs, njobs, next);
+
+  /* OUT may be one of FILES, so set it only now.  */
+  out->name = temp->name;
+  out->temp = temp;
+  return nopened;
+}
+
+/* Return the number of files to merge at once in NJOBS concurrent
+   merges.  This is NMERGE, or with --auto-tune and no --batch-size,
+   as many more as the limits on file descriptors and memory allow,
+   so that merges take fewer passes.  Not with --compress-program,
+   as each compressed input of a merge takes a process.  */
+
+static unsigned int
+auto_nmerge (size_t njobs)
+{
+  struct rlimit rlimit;
+  if (! auto_tune || nmerge_specified || compress_program
+      || getrlimit (RLIMIT_NOFILE, &rlimit) != 0)
+    return nmerge;
+
+  /* Each merge needs a file descriptor for its output as well as its
+     inputs, and standard input, output and error stay open.  */
+  uintmax_t fds = rlimit.rlim_cur / njobs;
+  if (fds <= 4)
+    return nmerge;
+  uintmax_t n = fds - 4;
+
+  /* Each input needs a buffer with room for its longest line, and for
+     AUTO_MERGE_LINES lines of average length.  */
+  size_t size = sort_size ? sort_size : default_sort_size ();
+  size_t line_size = (sort_stats.lines
+                      ? sort_stats.bytes / sort_stats.lines : 0);
+  size_t input_size = MAX (merge_buffer_size,
+                           (AUTO_MERGE_LINES
+                            * (line_size + sizeof (struct line))));
+  n = MIN (n, size / njobs / input_size);
+
+  return MAX (nmerge, MIN (n, AUTO_NMERGE_MAX));
+}
+
 /* Merge the input FILES.  NTEMPS is the number of files at the
    start of FILES that are temporary; it is zero at the top level.
    NFILES is the total number of files.  Put the output in
-   OUTPUT_FILE; a null OUTPUT_FILE stands for standard output.  */
+   OUTPUT_FILE; a null OUTPUT_FILE stands for standard output.
+   Run the merges of each intermediate pass in up to NTHREADS
+   threads.  */
 
 static void
 merge (struct sortfile *files, size_t ntemps, size_t nfiles,
-       char const *output_file)
+       char const *output_file, size_t nthreads)
 {
+  /* The merges of an intermediate pass are independent, but each
+     needs over NMERGE + 1 file descriptors, and the processes of a
+     compression program are not managed in a thread-safe way.  */
+  size_t njobs = compress_program ? 1 : nthreads;
+  xtime_t start = stats ? gethrxtime () : 0;
+  nmerge = auto_nmerge (njobs);
+  struct rlimit rlimit;
+  if (getrlimit (RLIMIT_NOFILE, &rlimit) == 0)
+    njobs = MIN (njobs, MAX (1, rlimit.rlim_cur / (nmerge + 2)));
+  struct merge_job *jobs = NULL;
+  size_t next_job = 0;
+  if (1 < njobs && nmerge < nfiles)
+    jobs = xcalloc (njobs, sizeof *jobs);
+
   while (nmerge < nfiles)
     {
       /* Number of input files processed so far.  */
@@ -3443,13 +6020,11 @@ merge (struct sortfile *files, size_t ntemps, size_t nfiles,
          descriptors allowed.  */
       for (out = in = 0; nmerge <= nfiles - in; out++)
         {
-          FILE *tfp;
-          struct tempnode *temp = create_temp (&tfp);
-          size_t num_merged = mergefiles (&files[in], MIN (ntemps, nmerge),
-                                          nmerge, tfp, temp->name);
+          size_t num_merged = merge_into_temp (&files[in],
+                                               MIN (ntemps, nmerge), nmerge,
+                                               &files[out],
+                                               jobs, njobs, &next_job);
           ntemps -= MIN (ntemps, num_merged);
-          files[out].name = temp->name;
-          files[out].temp = temp;
           in += num_merged;
         }
 
@@ -3462,13 +6037,11 @@ merge (struct sortfile *files, size_t ntemps, size_t nfiles,
              NMERGE-sized output window.  Do one more merge.  Merge as few
              files as possible, to avoid needless I/O.  */
           size_t nshortmerge = remainder - cheap_slots + 1;
-          FILE *tfp;
-          struct tempnode *temp = create_temp (&tfp);
-          size_t num_merged = mergefiles (&files[in], MIN (ntemps, nshortmerge),
-                                          nshortmerge, tfp, temp->name);
+          size_t num_merged = merge_into_temp (&files[in],
+                                               MIN (ntemps, nshortmerge),
+                                               nshortmerge, &files[out++],
+                                               jobs, njobs, &next_job);
           ntemps -= MIN (ntemps, num_merged);
-          files[out].name = temp->name;
-          files[out++].temp = temp;
           in += num_merged;
         }
 
@@ -3477,8 +6050,17 @@ merge (struct sortfile *files, size_t ntemps, size_t nfiles,
       memmove (&files[out], &files[in], (nfiles - in) * sizeof *files);
       ntemps += out;
       nfiles -= in - out;
+
+      /* The next pass reads this pass's output.  */
+      if (jobs)
+        for (size_t i = 0; i < njobs; i++)
+          finish_merge_job (&jobs[i]);
+      sort_stats.merge_passes++;
+      sort_stats.max_merge = MAX (sort_stats.max_merge, nmerge);
     }
 
+  free (jobs);
+
   avoid_trashing_input (files, ntemps, nfiles, output_file);
 
   /* We aren't guaranteed that this final mergefiles will work, therefore we
@@ -3490,13 +6072,18 @@ merge (struct sortfile *files, size_t ntemps, size_t nfiles,
       /* Merge directly into the output file if possible.  */
       FILE **fps;
       size_t nopened = open_input_files (files, nfiles, &fps);
+      sort_stats.merge_passes++;
+      sort_stats.max_merge = MAX (sort_stats.max_merge, nopened);
 
       if (nopened == nfiles)
         {
           FILE *ofp = stream_open (output_file, "w");
           if (ofp)
             {
-              mergefps (files, ntemps, nfiles, ofp, output_file, fps);
+              if (1 < nthreads && ! debug)
+                ofp = async_open (ofp, output_file, "w", ASYNC_WRITE_CHUNKS);
+              mergefps (files, ntemps, nfiles, ofp, output_file, fps,
+                        sort_size);
               break;
             }
           if (errno != EMFILE || nopened <= 2)
@@ -3522,7 +6109,7 @@ merge (struct sortfile *files, size_t ntemps, size_t nfiles,
 
       /* Merge into the newly allocated temporary.  */
       mergefps (&files[0], MIN (ntemps, nopened), nopened, tfp, temp->name,
-                fps);
+                fps, sort_size);
       ntemps -= MIN (ntemps, nopened);
       files[0].name = temp->name;
       files[0].temp = temp;
@@ -3531,6 +6118,478 @@ merge (struct sortfile *files, size_t ntemps, size_t nfiles,
       ntemps++;
       nfiles -= nopened - 1;
     }
+
+  if (stats)
+    sort_stats.merge_time += gethrxtime () - start;
+}
+
+/* A line kept by sort_head, with its own copy of its text, and its
+   number in the input, which breaks ties.  */
+
+struct head_line
+{
+  struct line line;
+  uintmax_t seq;
+};
+
+/* Compare the kept lines A and B as they are to be output.  */
+
+static int
+head_compare (struct head_line const *a, struct head_line const *b)
+{
+  int diff = compare (&a->line, &b->line);
+  return diff ? diff : a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/* Move the kept line at index I of HEAP, of N lines, down to restore
+   the heap order, in which each line follows those below it.  */
+
+static void
+head_sift_down (struct head_line *heap, size_t n, size_t i)
+{
+  struct head_line l = heap[i];
+  for (size_t child; (child = 2 * i + 1) < n; i = child)
+    {
+      if (child + 1 < n && head_compare (&heap[child], &heap[child + 1]) < 0)
+        child++;
+      if (head_compare (&l, &heap[child]) >= 0)
+        break;
+      heap[i] = heap[child];
+    }
+  heap[i] = l;
+}
+
+/* Move the kept line at index I of HEAP up to restore the heap order.  */
+
+static void
+head_sift_up (struct head_line *heap, size_t i)
+{
+  struct head_line l = heap[i];
+  while (i)
+    {
+      size_t parent = (i - 1) / 2;
+      if (head_compare (&heap[parent], &l) >= 0)
+        break;
+      heap[i] = heap[parent];
+      i = parent;
+    }
+  heap[i] = l;
+}
+
+/* Return true if the subheap at index I of HEAP, of N lines, has a
+   line that compares equal to LINE.  Lines below one that precedes
+   LINE precede it too, so they need not be looked at.  */
+
+static bool
+head_find (struct head_line const *heap, size_t n, size_t i,
+           struct line const *line)
+{
+  for (; i < n; i = 2 * i + 2)
+    {
+      int diff = compare (&heap[i].line, line);
+      if (diff < 0)
+        return false;
+      if (diff == 0 || head_find (heap, n, 2 * i + 1, line))
+        return true;
+    }
+  return false;
+}
+
+/* Make a copy of LINE into *COPY, with its text copied to TEXT.  */
+
+static void
+copy_line (struct line *copy, struct line const *line, char *text)
+{
+  memcpy (text, line->text, line->length);
+  *copy = *line;
+  copy->text = text;
+  if (keylist)
+    {
+      copy->keybeg = text + (line->keybeg - line->text);
+      copy->keylim = text + (line->keylim - line->text);
+    }
+}
+
+/* Make a copy of LINE, numbered SEQ, into *KEPT.  */
+
+static void
+head_keep (struct head_line *kept, struct line const *line, uintmax_t seq)
+{
+  copy_line (&kept->line, line, xmalloc (line->length));
+  kept->seq = seq;
+}
+
+/* Output onto OUTPUT_FILE the first HEAD_LINES lines that sorting
+   NFILES FILES would.  Read the input in one pass, keeping in a heap
+   only the lines that are among the first so far, with the last of
+   them on top, so that most lines need just one comparison to be
+   dropped.  */
+
+static void
+sort_head (char *const *files, size_t nfiles, char const *output_file)
+{
+  struct buffer buf;
+  size_t nalloc = MIN (head_lines, 1024);
+  struct head_line *heap = xnmalloc (nalloc, sizeof *heap);
+  size_t n = 0;
+  uintmax_t seq = 0;
+
+  buf.alloc = 0;
+
+  for (; nfiles; files++, nfiles--)
+    {
+      char const *file = *files;
+      FILE *fp = xfopen (file, "r");
+
+      if (! buf.alloc)
+        initbuf (&buf, sizeof (struct line),
+                 sort_buffer_size (&fp, 1, files, nfiles,
+                                   sizeof (struct line)));
+      buf.eof = false;
+      map_input (&buf, fp);
+
+      while (fillbuf (&buf, fp, file))
+        {
+          struct line const *line = buffer_linelim (&buf);
+          struct line const *linebase = line - buf.nlines;
+
+          while (linebase < line)
+            {
+              line--;
+              seq++;
+              if (n == head_lines)
+                {
+                  /* Drop LINE unless it precedes the last kept line,
+                     which it then replaces.  */
+                  if (compare (line, &heap[0].line) >= 0
+                      || (unique && head_find (heap, n, 0, line)))
+                    continue;
+                  free (heap[0].line.text);
+                  head_keep (&heap[0], line, seq);
+                  head_sift_down (heap, n, 0);
+                }
+              else if (! (unique && head_find (heap, n, 0, line)))
+                {
+                  if (n == nalloc)
+                    heap = x2nrealloc (heap, &nalloc, sizeof *heap);
+                  head_keep (&heap[n], line, seq);
+                  head_sift_up (heap, n++);
+                }
+            }
+        }
+
+      xfclose (fp, file);
+      unmap_input (&buf);
+    }
+
+  /* Sort the kept lines in place, and output them.  */
+  for (size_t i = n; 1 < i; )
+    {
+      struct head_line top = heap[0];
+      heap[0] = heap[--i];
+      heap[i] = top;
+      head_sift_down (heap, i, 0);
+    }
+
+  FILE *ofp = xfopen (output_file, "w");
+  for (size_t i = 0; i < n; i++)
+    {
+      write_line (&heap[i].line, ofp, output_file);
+      IF_LINT (free (heap[i].line.text));
+    }
+  xfclose (ofp, output_file);
+
+  IF_LINT (free (heap));
+  IF_LINT (free (buf.buf));
+}
+
+/* The number of partitions that unique_files spills lines to, as a
+   power of 2, and the deepest partition that it spills from again.
+   It spills only once it keeps at least UNIQUE_MIN_LINES lines, so
+   that each pass makes progress however little memory there is.  */
+enum
+  {
+    UNIQUE_PARTITION_BITS = 4,
+    UNIQUE_MAX_DEPTH = 7,
+    UNIQUE_MIN_LINES = 1024
+  };
+
+/* A slot of the hash table of unique_files: a kept line, with its own
+   text, or an empty slot if TEXT is null.  */
+
+struct unique_slot
+{
+  uint64_t hash;
+  struct line line;
+};
+
+/* Return true if equal lines can be found by hashing, for
+   --unique-unordered.  Random and version keys are not hashed, nor
+   are keys compared by the locale's collation, as lines that collate
+   equally may differ.  */
+
+static bool
+unique_hashable (void)
+{
+  if (hard_LC_COLLATE)
+    return false;
+  for (struct keyfield const *key = keylist; key; key = key->next)
+    if (key->random || key->version)
+      return false;
+  return true;
+}
+
+/* Return H updated with the 64-bit value V.  */
+
+static inline uint64_t
+unique_hash_mix (uint64_t h, uint64_t v)
+{
+  h = (h ^ v) * 0x9e3779b97f4a7c15;
+  return h ^ (h >> 29);
+}
+
+/* Return H updated with the LEN bytes at P.  */
+
+static uint64_t
+unique_hash_bytes (uint64_t h, char const *p, size_t len)
+{
+  uint64_t w;
+  size_t n = len;
+  for (; sizeof w <= n; p += sizeof w, n -= sizeof w)
+    {
+      memcpy (&w, p, sizeof w);
+      h = unique_hash_mix (h, w);
+    }
+  w = 0;
+  memcpy (&w, p, n);
+  return unique_hash_mix (unique_hash_mix (h, w), len);
+}
+
+/* Return a hash of LINE such that lines that compare equal with -u
+   have equal hashes.  Each key is hashed as keycompare compares it:
+   after ignoring and translating characters, and by value if numeric
+   or a month.  */
+
+static uint64_t
+unique_hash (struct line const *line)
+{
+  static char *tbuf;
+  static size_t tbufsize;
+  struct keyfield const *key = keylist;
+
+  if (! key)
+    return unique_hash_bytes (0, line->text, line->length - 1);
+
+  char *beg = line->keybeg;
+  char *lim = line->keylim;
+  uint64_t h = 0;
+
+  while (true)
+    {
+      char const *translate = key->translate;
+      bool const *ignore = key->ignore;
+      lim = MAX (beg, lim);
+      char *t = beg;
+      size_t len = lim - beg;
+
+      if (ignore || translate)
+        {
+          while (tbufsize <= len)
+            tbuf = X2REALLOC (tbuf, &tbufsize);
+          size_t tlen = 0;
+          for (size_t i = 0; i < len; i++)
+            if (! (ignore && ignore[to_uchar (beg[i])]))
+              tbuf[tlen++] = translate ? translate[to_uchar (beg[i])] : beg[i];
+          t = tbuf;
+          len = tlen;
+        }
+
+      if (key_numeric (key) || key->month)
+        {
+          /* Parse the key, temporarily null-terminated.  */
+          char saved = t[len];
+          uint64_t value;
+          t[len] = '\0';
+          if (key->month)
+            value = getmonth (t, NULL);
+          else if (key->general_numeric)
+            value = general_numeric_prefix (t);
+          else
+            value = numeric_prefix (t, key->human_numeric);
+          t[len] = saved;
+          h = unique_hash_mix (h, value);
+        }
+      else
+        h = unique_hash_bytes (h, t, len);
+
+      key = key->next;
+      if (! key)
+        return h;
+
+      /* Find the beginning and limit of the next field.  */
+      if (key->eword != SIZE_MAX)
+        lim = limfield (line, key);
+      else
+        lim = line->text + line->length - 1;
+
+      if (key->sword != SIZE_MAX)
+        beg = begfield (line, key);
+      else
+        {
+          beg = line->text;
+          if (key->skipsblanks)
+            while (beg < lim && blanks[to_uchar (*beg)])
+              ++beg;
+        }
+    }
+}
+
+/* Return the slot of TABLE, of NSLOTS slots, for LINE with hash H:
+   the slot of a kept line equal to LINE, or else the empty slot
+   where LINE belongs.  */
+
+static struct unique_slot *
+unique_lookup (struct unique_slot *table, size_t nslots, uint64_t h,
+               struct line const *line)
+{
+  for (size_t i = h & (nslots - 1); ; i = (i + 1) & (nslots - 1))
+    {
+      struct unique_slot *slot = &table[i];
+      if (! slot->line.text
+          || (slot->hash == h && compare (&slot->line, line) == 0))
+        return slot;
+    }
+}
+
+/* Output to OFP, named OUTPUT_FILE, the first of each set of equal
+   lines of the NFILES FILES, in one pass, keeping copies of the lines
+   output so far in a hash table.  Once the table uses more memory
+   than sort would, keep it as it is, and spill the lines not in it to
+   temporary files partitioned by hash, so that equal lines end up in
+   the same partition; then do the same for each partition.  DEPTH is
+   the number of times the lines have been partitioned.  */
+
+static void
+unique_files (struct sortfile *files, size_t nfiles, FILE *ofp,
+              char const *output_file, unsigned int depth)
+{
+  size_t limit = sort_size ? sort_size : default_sort_size ();
+  size_t nslots = 1024;
+  size_t nkept = 0;
+  size_t used = nslots * sizeof (struct unique_slot);
+  struct unique_slot *table = xcalloc (nslots, sizeof *table);
+  struct sortfile parts[1 << UNIQUE_PARTITION_BITS];
+  FILE *partfps[1 << UNIQUE_PARTITION_BITS];
+  int part_shift = 64 - (depth + 1) * UNIQUE_PARTITION_BITS;
+  bool part_used[1 << UNIQUE_PARTITION_BITS] = { false, };
+  bool spilling = false;
+  struct buffer buf;
+
+  /* The kept lines' text.  */
+  struct arena text = { NULL, 0 };
+
+  /* The input buffer takes a quarter of the memory.  */
+  initbuf (&buf, sizeof (struct line), limit / 4);
+  used += buf.alloc;
+
+  for (size_t i = 0; i < nfiles; i++)
+    {
+      char const *file = files[i].name;
+      FILE *fp = (files[i].temp && files[i].temp->state != UNCOMPRESSED
+                  ? open_temp (files[i].temp)
+                  : stream_open (file, "r"));
+      if (! fp)
+        sort_die (_("open failed"), file);
+
+      buf.eof = false;
+      map_input (&buf, fp);
+
+      while (fillbuf (&buf, fp, file))
+        {
+          struct line const *line = buffer_linelim (&buf);
+          struct line const *linebase = line - buf.nlines;
+
+          while (linebase < line)
+            {
+              line--;
+              uint64_t h = unique_hash (line);
+              struct unique_slot *slot = unique_lookup (table, nslots, h, line);
+              if (slot->line.text)
+                continue;
+
+              if (spilling)
+                {
+                  int p = h >> part_shift & ((1 << UNIQUE_PARTITION_BITS) - 1);
+                  write_line (line, partfps[p], parts[p].name);
+                  part_used[p] = true;
+                  continue;
+                }
+
+              slot->hash = h;
+              copy_line (&slot->line, line,
+                         arena_alloc (&text, line->length, 1));
+              write_line (line, ofp, output_file);
+
+              if (nslots <= 2 * ++nkept)
+                {
+                  /* Keep the table at most half full.  */
+                  struct unique_slot *old = table;
+                  table = xcalloc (2 * nslots, sizeof *table);
+                  for (size_t j = 0; j < nslots; j++)
+                    if (old[j].line.text)
+                      *unique_lookup (table, 2 * nslots, old[j].hash,
+                                      &old[j].line) = old[j];
+                  free (old);
+                  used += nslots * sizeof *table;
+                  nslots *= 2;
+                }
+
+              if (limit < used + text.size && UNIQUE_MIN_LINES <= nkept
+                  && depth < UNIQUE_MAX_DEPTH)
+                {
+                  spilling = true;
+                  for (int p = 0; p < 1 << UNIQUE_PARTITION_BITS; p++)
+                    {
+                      parts[p].temp = create_temp (&partfps[p]);
+                      parts[p].name = parts[p].temp->name;
+                    }
+                }
+            }
+        }
+
+      xfclose (fp, file);
+      unmap_input (&buf);
+      if (depth)
+        zaptemp (files[i].temp);
+    }
+
+  arena_free (&text, false);
+  free (table);
+  free (buf.buf);
+
+  if (spilling)
+    for (int p = 0; p < 1 << UNIQUE_PARTITION_BITS; p++)
+      {
+        xfclose (partfps[p], parts[p].name);
+        if (part_used[p])
+          unique_files (&parts[p], 1, ofp, output_file, depth + 1);
+        else
+          zaptemp (parts[p].temp);
+      }
+}
+
+/* With --stats, add the time since *SINCE to *PHASE, and start the
+   next phase at *SINCE.  */
+
+static void
+stats_phase (xtime_t *phase, xtime_t *since)
+{
+  if (stats)
+    {
+      xtime_t now = gethrxtime ();
+      *phase += now - *since;
+      *since = now;
+    }
 }
 
 /* Sort NFILES FILES onto OUTPUT_FILE.  Use at most NTHREADS threads.  */
@@ -3544,6 +6603,28 @@ sort (char *const *files, size_t nfiles, char const *output_file,
   size_t ntemps = 0;
   bool output_file_created = false;
 
+  /* Input files that are sorted already, to be merged as they are
+     rather than copied to temporary files.  */
+  char const **sorted_files = NULL;
+  size_t nsorted = 0;
+  size_t sorted_alloc = 0;
+
+  /* True if BUF holds lines of earlier files, to be sorted together
+     with those of the next file.  */
+  bool lines_pending = false;
+
+  /* The threads that sort each buffer, created for the first one.  */
+  struct task_pool *pool = NULL;
+
+  /* The memory of each buffer's merge tree.  */
+  struct arena arena = { NULL, 0 };
+
+  /* The start of the current phase, for --stats.  */
+  xtime_t since = stats ? gethrxtime () : 0;
+
+  /* The memory left for input read ahead of the buffer.  */
+  size_t read_ahead = 0;
+
   buf.alloc = 0;
 
   while (nfiles)
@@ -3570,9 +6651,35 @@ sort (char *const *files, size_t nfiles, char const *output_file,
         bytes_per_line = sizeof (struct line) * 3 / 2;
 
       if (! buf.alloc)
-        initbuf (&buf, bytes_per_line,
-                 sort_buffer_size (&fp, 1, files, nfiles, bytes_per_line));
+        {
+          /* Collating whole lines compares them slowly, so transform
+             each line just once, as long as the keys fit in their
+             share of the memory.  Beyond that, collating at each
+             comparison is the better use of memory.  */
+          bool xfrm = hard_LC_COLLATE && ! keylist;
+          size_t share = sort_buffer_share (sort_size ? sort_size
+                                            : default_sort_size (),
+                                            xfrm, 1 < nthreads);
+          initbuf (&buf, bytes_per_line,
+                   MIN (share, sort_buffer_size (&fp, 1, files, nfiles,
+                                                 bytes_per_line)));
+          prefault_buffer (&buf, nthreads);
+          if (xfrm)
+            buf.xfrm_max = share;
+          if (auto_tune)
+            buf.grow_limit = share;
+          read_ahead = share / 2;
+        }
       buf.eof = false;
+
+      /* Record the lines of a mapped file in place.  Otherwise, read
+         about the next buffer's worth of text, which is at most half
+         the buffer with the lines' own storage, while this buffer is
+         sorted.  */
+      bool mapped = ! lines_pending && map_input (&buf, fp);
+      if (! mapped && 1 < nthreads && ASYNC_CHUNK_SIZE <= read_ahead)
+        fp = async_open (fp, file, "r", read_ahead / ASYNC_CHUNK_SIZE);
+      lines_pending = false;
       files++;
       nfiles--;
 
@@ -3580,7 +6687,9 @@ sort (char *const *files, size_t nfiles, char const *output_file,
         {
           struct line *line;
 
-          if (buf.eof && nfiles
+          stats_phase (&sort_stats.input_time, &since);
+
+          if (buf.eof && nfiles && ! buf.map
               && (bytes_per_line + 1
                   < (buf.alloc - buf.used - bytes_per_line * buf.nlines)))
             {
@@ -3588,12 +6697,35 @@ sort (char *const *files, size_t nfiles, char const *output_file,
                  Concatenate the next input file; this is faster in
                  the usual case.  */
               buf.left = buf.used;
+              lines_pending = true;
               break;
             }
 
           saved_line.text = NULL;
           line = buffer_linelim (&buf);
-          if (buf.eof && !nfiles && !ntemps && !buf.left)
+          sort_stats.lines += buf.nlines;
+          sort_stats.bytes += (line[-buf.nlines].text
+                               + line[-buf.nlines].length - line[-1].text);
+          sort_stats.buffers++;
+          sort_stats.max_buffer = MAX (sort_stats.max_buffer, buf.alloc);
+
+          /* If the buffer maps all of a file whose lines are in order
+             already, merge the file itself at the end.  Files that
+             are merged come after the temporary files, so if lines
+             from other files could tie with this file's, keep their
+             order by doing this only for the last file.  */
+          if (mapped && buf.eof && ! STREQ (file, "-")
+              && (nfiles == 0 || ! (stable || unique))
+              && find_run (line, buf.nlines, false) == buf.nlines)
+            {
+              if (nsorted == sorted_alloc)
+                sorted_files = X2NREALLOC (sorted_files, &sorted_alloc);
+              sorted_files[nsorted++] = file;
+              break;
+            }
+          mapped = false;
+
+          if (buf.eof && !nfiles && !ntemps && !nsorted && !buf.left)
             {
               xfclose (fp, file);
               tfp = xfopen (output_file, "w");
@@ -3605,52 +6737,100 @@ sort (char *const *files, size_t nfiles, char const *output_file,
               ++ntemps;
               temp_output = create_temp (&tfp)->name;
             }
+          if (1 < nthreads && ! debug)
+            tfp = async_open (tfp, temp_output, "w", ASYNC_WRITE_CHUNKS);
           if (1 < buf.nlines)
             {
+              if (! pool)
+                pool = pool_create (nthreads);
               struct merge_node_queue queue;
-              queue_init (&queue, nthreads);
+              queue_init (&queue, pool, buf.nlines, tfp, temp_output);
               struct merge_node *merge_tree =
-                merge_tree_init (nthreads, buf.nlines, line);
+                merge_tree_init (&arena, nthreads, buf.nlines, line);
 
-              sortlines (line, nthreads, buf.nlines, merge_tree + 1,
-                         &queue, tfp, temp_output);
+              sortlines (line, nthreads, 0, buf.nlines, merge_tree + 1,
+                         &queue);
+              pool_wait (pool, &queue.unfinished);
 
-#ifdef lint
               merge_tree_destroy (nthreads, merge_tree);
-              queue_destroy (&queue);
-#endif
+              arena_free (&arena, true);
             }
           else
             write_unique (line - 1, tfp, temp_output);
 
           xfclose (tfp, temp_output);
+          stats_phase (&sort_stats.sort_time, &since);
 
           if (output_file_created)
             goto finish;
         }
       xfclose (fp, file);
+      unmap_input (&buf);
+      stats_phase (&sort_stats.input_time, &since);
     }
 
  finish:
+  if (pool)
+    pool_destroy (pool);
+  arena_free (&arena, false);
+  unmap_input (&buf);
+  free_xfrm_blocks (buf.xfrm);
   free (buf.buf);
 
   if (! output_file_created)
     {
       struct tempnode *node = temphead;
-      struct sortfile *tempfiles = xnmalloc (ntemps, sizeof *tempfiles);
+      struct sortfile *tempfiles = xnmalloc (ntemps + nsorted,
+                                             sizeof *tempfiles);
       for (size_t i = 0; node; i++)
         {
           tempfiles[i].name = node->name;
           tempfiles[i].temp = node;
           node = node->next;
         }
-      merge (tempfiles, ntemps, ntemps, output_file);
+      for (size_t i = 0; i < nsorted; i++)
+        {
+          tempfiles[ntemps + i].name = sorted_files[i];
+          tempfiles[ntemps + i].temp = NULL;
+        }
+      merge (tempfiles, ntemps, ntemps + nsorted, output_file, nthreads);
       free (tempfiles);
     }
+  free (sorted_files);
 
   reap_all ();
 }
 
+/* Report the statistics of the run, for --stats.  */
+
+static void
+report_stats (void)
+{
+  uintmax_t comparisons = atomic_load (&sort_stats.comparisons) + ncompares;
+
+  error (0, 0, _("input: %ju lines, %ju bytes, in %zu buffers of up to"
+                 " %zu bytes, grown %zu times"),
+         sort_stats.lines, sort_stats.bytes, sort_stats.buffers,
+         sort_stats.max_buffer, atomic_load (&sort_stats.buffer_growths));
+  error (0, 0, _("temporary files: %ju, of %ju bytes written and %ju bytes"
+                 " read"),
+         sort_stats.temp_files, sort_stats.temp_written,
+         sort_stats.temp_read);
+  error (0, 0, _("merge passes: %zu, of up to %zu files at once"),
+         sort_stats.merge_passes, sort_stats.max_merge);
+  error (0, 0, _("comparisons: %ju"), comparisons);
+  if (sort_stats.threads)
+    error (0, 0, _("threads: %zu, busy %.1f%% of %.3fs"),
+           sort_stats.threads,
+           (100.0 * (sort_stats.thread_time - sort_stats.thread_idle)
+            / MAX (sort_stats.thread_time, 1)),
+           sort_stats.thread_time / 1e9 / sort_stats.threads);
+  error (0, 0, _("time: %.3fs input, %.3fs sort, %.3fs merge, %.3fs total"),
+         sort_stats.input_time / 1e9, sort_stats.sort_time / 1e9,
+         sort_stats.merge_time / 1e9,
+         (gethrxtime () - sort_stats.start) / 1e9);
+}
+
 /* Insert a malloc'd copy of key KEY_ARG at the end of the key list.  */
 
 static void
@@ -3854,6 +7034,7 @@ main (int argc, char **argv)
   textdomain (PACKAGE);
 
   initialize_exit_failure (SORT_FAILURE);
+  sort_stats.start = gethrxtime ();
 
   hard_LC_COLLATE = hard_locale (LC_COLLATE);
 #if HAVE_NL_LANGINFO
@@ -4057,15 +7238,30 @@ main (int argc, char **argv)
           break;
 
         case COMPRESS_PROGRAM_OPTION:
-          if (compress_program && !STREQ (compress_program, optarg))
+          if (compress_temp
+              || (compress_program && !STREQ (compress_program, optarg)))
             die (SORT_FAILURE, 0, _("multiple compress programs specified"));
           compress_program = optarg;
           break;
 
+        case COMPRESS_TEMP_OPTION:
+          if (compress_program)
+            die (SORT_FAILURE, 0, _("multiple compress programs specified"));
+          compress_temp = true;
+          break;
+
         case DEBUG_PROGRAM_OPTION:
           debug = true;
           break;
 
+        case STATS_OPTION:
+          stats = true;
+          break;
+
+        case AUTO_TUNE_OPTION:
+          auto_tune = true;
+          break;
+
         case FILES0_FROM_OPTION:
           files_from = optarg;
           break;
@@ -4127,6 +7323,7 @@ main (int argc, char **argv)
 
         case NMERGE_OPTION:
           specify_nmerge (oi, c, optarg);
+          nmerge_specified = true;
           break;
 
         case 'o':
@@ -4182,10 +7379,18 @@ main (int argc, char **argv)
           nthreads = specify_nthreads (oi, c, optarg);
           break;
 
+        case HEAD_OPTION:
+          head_lines = specify_head_lines (oi, c, optarg);
+          break;
+
         case 'u':
           unique = true;
           break;
 
+        case UNIQUE_UNORDERED_OPTION:
+          unique = unique_unordered = true;
+          break;
+
         case 'y':
           /* Accept and ignore e.g. -y0 for compatibility with Solaris 2.x
              through Solaris 7.  It is also accepted by many non-Solaris
@@ -4327,6 +7532,21 @@ main (int argc, char **argv)
 
   reverse = gkey.reverse;
 
+  key_prefixes = (keylist && key_numeric (keylist)
+                  ? ! keylist->translate
+                  : ((keylist && keylist->random)
+                     || ! (hard_LC_COLLATE
+                           || (keylist
+                               && (keylist->month || keylist->version)))));
+
+  radix_sortable = (! hard_LC_COLLATE
+                    && (keylist
+                        ? ! (keylist->ignore || keylist->translate
+                             || key_numeric (keylist) || keylist->month
+                             || keylist->version || keylist->random
+                             || keylist->reverse || stable || unique)
+                        : ! reverse));
+
   if (need_random)
     random_md5_state_init (random_source);
 
@@ -4373,30 +7593,43 @@ main (int argc, char **argv)
   /* Check output is writable, or exit immediately.  */
   check_output (outfile);
 
-  if (mergeonly)
+  if (!nthreads)
+    {
+      unsigned long int np = num_processors (NPROC_CURRENT_OVERRIDABLE);
+      nthreads = MIN (np, DEFAULT_MAX_THREADS);
+    }
+
+  /* Avoid integer overflow later.  */
+  size_t nthreads_max = SIZE_MAX / (2 * sizeof (struct merge_node));
+  nthreads = MIN (nthreads, nthreads_max);
+
+  if (head_lines)
+    sort_head (files, nfiles, outfile);
+  else if (unique_unordered && unique_hashable ())
     {
       struct sortfile *sortfiles = xcalloc (nfiles, sizeof *sortfiles);
 
       for (size_t i = 0; i < nfiles; ++i)
         sortfiles[i].name = files[i];
 
-      merge (sortfiles, 0, nfiles, outfile);
+      avoid_trashing_input (sortfiles, 0, nfiles, outfile);
+      FILE *ofp = xfopen (outfile, "w");
+      unique_files (sortfiles, nfiles, ofp, outfile, 0);
+      xfclose (ofp, outfile);
       IF_LINT (free (sortfiles));
     }
-  else
+  else if (mergeonly)
     {
-      if (!nthreads)
-        {
-          unsigned long int np = num_processors (NPROC_CURRENT_OVERRIDABLE);
-          nthreads = MIN (np, DEFAULT_MAX_THREADS);
-        }
+      struct sortfile *sortfiles = xcalloc (nfiles, sizeof *sortfiles);
 
-      /* Avoid integer overflow later.  */
-      size_t nthreads_max = SIZE_MAX / (2 * sizeof (struct merge_node));
-      nthreads = MIN (nthreads, nthreads_max);
+      for (size_t i = 0; i < nfiles; ++i)
+        sortfiles[i].name = files[i];
 
-      sort (files, nfiles, outfile, nthreads);
+      merge (sortfiles, 0, nfiles, outfile, nthreads);
+      IF_LINT (free (sortfiles));
     }
+  else
+    sort (files, nfiles, outfile, nthreads);
 
 #ifdef lint
   if (files_from)
@@ -4408,5 +7641,8 @@ main (int argc, char **argv)
   if (have_read_stdin && fclose (stdin) == EOF)
     sort_die (_("close failed"), "-");
 
+  if (stats)
+    report_stats ();
+
   return EXIT_SUCCESS;
 }
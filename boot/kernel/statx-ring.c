@@ -0,0 +1,274 @@
+#include <config.h>
+#include <sys/types.h>
+#include "system.h"
+#include "statx-ring.h"
+
+#if HAVE_STATX_RING
+
+# include <linux/io_uring.h>
+# include <sched.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+
+/* IORING_OP_STATX and IORING_REGISTER_PROBE are enumerators, so go by
+   a feature flag that came with them in Linux 5.6.  */
+# if defined IORING_FEAT_CUR_PERSONALITY && defined __NR_io_uring_setup
+#  define USE_IO_URING 1
+# else
+#  define USE_IO_URING 0
+# endif
+
+/* The rings shared with the kernel are used directly, without
+   liburing.  The kernel moves the head of the submission queue and the
+   tail of the completion queue, and this module the others; each side
+   reads the other's indexes with acquire semantics and publishes its
+   own with release semantics.  */
+
+struct statx_ring
+{
+  int fd;
+
+  /* The number of entries of the submission queue, which is at most
+     the number of requests in flight.  The completion queue is at
+     least as long, so it never overflows.  */
+  unsigned int entries;
+
+  /* The submission queue, its entries, and the completion queue.  */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* The mappings of the rings and of the submission queue entries.
+     CQ_MAP equals SQ_MAP if the kernel maps both rings at once.  */
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  size_t sqes_size;
+
+  /* True once the ring has failed, after which requests are run
+     synchronously.  */
+  bool broken;
+};
+
+# if USE_IO_URING
+
+/* Return true if the kernel can run IORING_OP_STATX on the io_uring
+   open on FD.  */
+
+static bool
+statx_supported (int fd)
+{
+  size_t size = (sizeof (struct io_uring_probe)
+                 + IORING_OP_LAST * sizeof (struct io_uring_probe_op));
+  struct io_uring_probe *probe = xzalloc (size);
+  bool supported
+    = (syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                probe, IORING_OP_LAST) == 0
+       && IORING_OP_STATX < probe->ops_len
+       && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED));
+  free (probe);
+  return supported;
+}
+
+static void *
+map_ring (int fd, size_t size, off_t offset)
+{
+  void *p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+# endif
+
+/* Return a new io_uring with room for ENTRIES requests in flight,
+   or a null pointer if the kernel cannot stat files through one,
+   because it is too old or io_uring is disabled, for instance.  */
+
+struct statx_ring *
+statx_ring_open (unsigned int entries)
+{
+# if USE_IO_URING
+  struct io_uring_params params;
+  memset (&params, 0, sizeof params);
+  int fd = syscall (__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return NULL;
+  if (! statx_supported (fd))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  struct statx_ring *ring = xzalloc (sizeof *ring);
+  ring->fd = fd;
+  ring->entries = params.sq_entries;
+  ring->sq_map_size = (params.sq_off.array
+                       + params.sq_entries * sizeof (unsigned int));
+  ring->cq_map_size = (params.cq_off.cqes
+                       + params.cq_entries * sizeof (struct io_uring_cqe));
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->sq_map_size = ring->cq_map_size = MAX (ring->sq_map_size,
+                                                 ring->cq_map_size);
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  ring->sq_map = map_ring (fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+  ring->cq_map = (params.features & IORING_FEAT_SINGLE_MMAP
+                  ? ring->sq_map
+                  : map_ring (fd, ring->cq_map_size, IORING_OFF_CQ_RING));
+  ring->sqes = map_ring (fd, ring->sqes_size, IORING_OFF_SQES);
+  if (! (ring->sq_map && ring->cq_map && ring->sqes))
+    {
+      statx_ring_close (ring);
+      return NULL;
+    }
+
+  char *sq = ring->sq_map;
+  ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+  char *cq = ring->cq_map;
+  ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return ring;
+# else
+  return NULL;
+# endif
+}
+
+# if USE_IO_URING
+
+/* Put REQUESTS[I] into the next free entry of RING's submission
+   queue, whose tail is *TAIL, and advance *TAIL.  */
+
+static void
+queue_request (struct statx_ring *ring, struct statx_request *requests,
+               size_t i, unsigned int *tail)
+{
+  unsigned int index = *tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof *sqe);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = requests[i].fd;
+  sqe->addr = (uintptr_t) requests[i].name;
+  sqe->len = requests[i].mask;
+  sqe->off = (uintptr_t) requests[i].buf;
+  sqe->statx_flags = requests[i].flags;
+  sqe->user_data = i;
+  ring->sq_array[index] = index;
+  ++*tail;
+}
+
+/* Note the results of the completed requests of RING, and return
+   their number.  */
+
+static size_t
+reap_requests (struct statx_ring *ring, struct statx_request *requests)
+{
+  unsigned int head = *ring->cq_head;
+  unsigned int tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+  size_t n = tail - head;
+
+  for (; head != tail; head++)
+    {
+      struct io_uring_cqe const *cqe = &ring->cqes[head & ring->cq_mask];
+      requests[cqe->user_data].err = cqe->res < 0 ? - cqe->res : 0;
+    }
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+# endif
+
+/* Run the N REQUESTS, through RING if it is not null and works, and
+   one at a time otherwise.  The requests are all done on return.  */
+
+void
+statx_ring_run (struct statx_ring *ring, struct statx_request *requests,
+                size_t n)
+{
+  /* An ERR of -1 marks a request that is not done yet.  */
+  for (size_t i = 0; i < n; i++)
+    requests[i].err = -1;
+
+# if USE_IO_URING
+  if (ring && ! ring->broken)
+    {
+      unsigned int sq_head0 = __atomic_load_n (ring->sq_head,
+                                               __ATOMIC_ACQUIRE);
+      size_t queued = 0;
+      size_t completed = 0;
+
+      while (completed < n)
+        {
+          unsigned int tail = *ring->sq_tail;
+          while (queued < n && queued - completed < ring->entries)
+            queue_request (ring, requests, queued++, &tail);
+          __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+          /* Submit the queued requests, and wait for all those in
+             flight.  The kernel does not wait if it takes fewer
+             requests than asked to.  */
+          unsigned int to_submit
+            = tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+          if (syscall (__NR_io_uring_enter, ring->fd, to_submit,
+                       queued - completed, IORING_ENTER_GETEVENTS,
+                       NULL, 0) < 0
+              && errno != EINTR)
+            {
+              /* Give up on the ring, but wait for the requests that
+                 the kernel took, as they write into their buffers.
+                 It is never entered again, so the others stay
+                 queued and are run below.  */
+              ring->broken = true;
+              size_t taken = (__atomic_load_n (ring->sq_head,
+                                               __ATOMIC_ACQUIRE)
+                              - sq_head0);
+              while (completed < taken)
+                {
+                  size_t reaped = reap_requests (ring, requests);
+                  if (! reaped)
+                    sched_yield ();
+                  completed += reaped;
+                }
+              break;
+            }
+
+          completed += reap_requests (ring, requests);
+        }
+    }
+# endif
+
+  for (size_t i = 0; i < n; i++)
+    if (requests[i].err < 0)
+      requests[i].err = (statx (requests[i].fd, requests[i].name,
+                                requests[i].flags, requests[i].mask,
+                                requests[i].buf) == 0
+                         ? 0 : errno);
+}
+
+/* Close RING and free its storage.  */
+
+void
+statx_ring_close (struct statx_ring *ring)
+{
+  if (ring->sqes)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_map && ring->cq_map != ring->sq_map)
+    munmap (ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map)
+    munmap (ring->sq_map, ring->sq_map_size);
+  close (ring->fd);
+  free (ring);
+}
+
+#endif
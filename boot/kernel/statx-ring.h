@@ -0,0 +1,43 @@
+#ifndef STATX_RING_H
+# define STATX_RING_H
+
+# include <sys/types.h>
+# include <sys/stat.h>
+
+/* Whether files can be stat'ed in batches through an io_uring: on
+   Linux with statx, where the io_uring header is available.  Whether
+   the running kernel allows it is only known once statx_ring_open has
+   been tried.  */
+# if defined __linux__ && HAVE_STATX && defined STATX_INO \
+     && defined __has_include
+#  if __has_include (<linux/io_uring.h>)
+#   define HAVE_STATX_RING 1
+#  endif
+# endif
+
+# if HAVE_STATX_RING
+
+/* A request to statx the file NAME relative to the directory open on
+   FD, with FLAGS and MASK, into *BUF.  ERR is set to the errno value
+   of its failure, or to 0.  */
+
+struct statx_request
+{
+  int fd;
+  char const *name;
+  int flags;
+  unsigned int mask;
+  struct statx *buf;
+  int err;
+};
+
+struct statx_ring;
+
+extern struct statx_ring *statx_ring_open (unsigned int entries);
+extern void statx_ring_run (struct statx_ring *ring,
+                            struct statx_request *requests, size_t n);
+extern void statx_ring_close (struct statx_ring *ring);
+
+# endif
+
+#endif
@@ -4,6 +4,7 @@
 #include "system.h"
 #include "argmatch.h"
 #include "linebuffer.h"
+#include "lineindex.h"
 #include "die.h"
 #include "error.h"
 #include "fadvise.h"
@@ -226,12 +227,14 @@ static void check_file (char const *infile, char const *outfile, char delimiter)
 {
   struct linebuffer lb1, lb2;
   struct linebuffer *thisline, *prevline;
+  struct line_reader reader;
 
   if (! (STREQ (infile, "-") || freopen (infile, "r", stdin)))
     die (EXIT_FAILURE, errno, "%s", quotef (infile));
   if (! (STREQ (outfile, "-") || freopen (outfile, "w", stdout)))
     die (EXIT_FAILURE, errno, "%s", quotef (outfile));
   fadvise (stdin, FADVISE_SEQUENTIAL);
+  line_reader_init (&reader, stdin, delimiter);
   thisline = &lb1;
   prevline = &lb2;
 
@@ -242,12 +245,12 @@ static void check_file (char const *infile, char const *outfile, char delimiter)
       char *prevfield IF_LINT ( = NULL);
       size_t prevlen IF_LINT ( = 0);
       bool first_group_printed = false;
-      while (!feof (stdin))
+      while (! line_reader_eof (&reader))
         {
           char *thisfield;
           size_t thislen;
           bool new_group;
-          if (readlinebuffer_delim (thisline, stdin, delimiter) == 0)
+          if (line_reader_read (&reader, thisline) == 0)
             break;
           thisfield = find_field (thisline);
           thislen = thisline->length - 1 - (thisfield - thisline->buffer);
@@ -273,18 +276,18 @@ static void check_file (char const *infile, char const *outfile, char delimiter)
       size_t prevlen;
       uintmax_t match_count = 0;
       bool first_delimiter = true;
-      if (readlinebuffer_delim (prevline, stdin, delimiter) == 0)
+      if (line_reader_read (&reader, prevline) == 0)
         goto closefiles;
       prevfield = find_field (prevline);
       prevlen = prevline->length - 1 - (prevfield - prevline->buffer);
-      while (!feof (stdin))
+      while (! line_reader_eof (&reader))
         {
           bool match;
           char *thisfield;
           size_t thislen;
-          if (readlinebuffer_delim (thisline, stdin, delimiter) == 0)
+          if (line_reader_read (&reader, thisline) == 0)
             {
-              if (ferror (stdin))
+              if (line_reader_error (&reader))
                 goto closefiles;
               break;
             }
@@ -329,9 +332,10 @@ static void check_file (char const *infile, char const *outfile, char delimiter)
     }
 
  closefiles:
-  if (ferror (stdin) || fclose (stdin) != 0)
+  if (line_reader_error (&reader) || ferror (stdin) || fclose (stdin) != 0)
     die (EXIT_FAILURE, 0, _("error reading %s"), quoteaf (infile));
 
+  line_reader_free (&reader);
   free (lb1.buffer);
   free (lb2.buffer);
 }